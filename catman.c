@@ -24,10 +24,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #if HAVE_ERR
 #include <err.h>
 #endif
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #if HAVE_FTS
@@ -35,19 +37,56 @@
 #else
 #include "compat_fts.h"
 #endif
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-int	 process_manpage(int, int, const char *);
-int	 process_tree(int, int);
+#include "mandoc_aux.h"
+
+#define	TMP_PREFIX ".catman."  /* for output not yet complete */
+
+/*
+ * One page sent to mandocd(8) and not yet acknowledged.
+ */
+struct	page {
+	char	 *path; /* relative to both srcdir and dstdir */
+	char	 *tmpname; /* output file to be renamed */
+};
+
+/*
+ * One mandocd(8) process and the pages it was sent.
+ */
+struct	server {
+	struct page	*pages; /* pages in flight */
+	size_t	  first; /* index of the oldest page in flight */
+	size_t	  busy; /* number of pages in flight */
+	pid_t	  pid; /* of the mandocd(8) process */
+	int	  fd; /* socket connected to it */
+};
+
+int	 ack_read(struct server *, int);
+void	 clean_dir(int, const char *);
+int	 is_newer(const struct stat *, const struct stat *);
+void	 page_free(struct server *);
+int	 process_manpage(int, const char *, const struct stat *);
+int	 process_tree(int);
 void	 run_mandocd(int, const char *, const char *)
 		__attribute__((__noreturn__));
+void	 servers_start(const char *, const char *);
+int	 servers_stop(int);
 ssize_t	 sock_fd_write(int, int, int, int);
 void	 usage(void) __attribute__((__noreturn__));
 
+static	struct server	*servers; /* one for each mandocd(8) process */
+static	size_t		 nservers; /* -j */
+static	size_t		 nextserver; /* to be sent the next page */
+static	size_t		 window; /* -w: maximum pages in flight */
+static	int		 update; /* -u: skip pages that are up to date */
+
 
 void
 run_mandocd(int sockfd, const char *outtype, const char* defos)
@@ -65,6 +104,145 @@ run_mandocd(int sockfd, const char *outtype, const char* defos)
 	err(1, "exec");
 }
 
+/*
+ * Start the mandocd(8) processes,
+ * each connected to its own socket.
+ */
+void
+servers_start(const char *outtype, const char *defos)
+{
+	struct server	*srv;
+	size_t		 i;
+	int		 srv_fds[2];
+
+	servers = mandoc_calloc(nservers, sizeof(*servers));
+	for (srv = servers; srv < servers + nservers; srv++) {
+		if (socketpair(AF_LOCAL, SOCK_STREAM, AF_UNSPEC,
+		    srv_fds) == -1)
+			err(1, "socketpair");
+		switch (srv->pid = fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			/*
+			 * Do not keep the other sockets open, or the
+			 * other servers would not notice when they close.
+			 */
+			for (i = 0; servers + i < srv; i++)
+				close(servers[i].fd);
+			close(srv_fds[0]);
+			run_mandocd(srv_fds[1], outtype, defos);
+		default:
+			break;
+		}
+		close(srv_fds[1]);
+		srv->fd = srv_fds[0];
+		srv->pages = mandoc_reallocarray(NULL,
+		    window, sizeof(*srv->pages));
+	}
+}
+
+/*
+ * Wait for all pages in flight to be acknowledged,
+ * close the sockets, and wait for the mandocd(8) processes to exit.
+ */
+int
+servers_stop(int dstdir_fd)
+{
+	struct server	*srv;
+	int		 rc, status;
+
+	rc = 0;
+	for (srv = servers; srv < servers + nservers; srv++) {
+		while (srv->busy > 0) {
+			if (ack_read(srv, dstdir_fd) == -1) {
+				rc = -1;
+				break;
+			}
+		}
+		close(srv->fd);
+		while (srv->busy > 0) {
+			(void)unlinkat(dstdir_fd,
+			    srv->pages[srv->first].tmpname, 0);
+			page_free(srv);
+		}
+		free(srv->pages);
+	}
+	for (srv = servers; srv < servers + nservers; srv++) {
+		while (waitpid(srv->pid, &status, 0) == -1) {
+			if (errno != EINTR) {
+				warn("waitpid");
+				rc = -1;
+				break;
+			}
+		}
+		if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0) {
+			warnx("mandocd failed");
+			rc = -1;
+		}
+	}
+	free(servers);
+	return rc;
+}
+
+/*
+ * Forget about the oldest page in flight.
+ */
+void
+page_free(struct server *srv)
+{
+	free(srv->pages[srv->first].path);
+	free(srv->pages[srv->first].tmpname);
+	srv->first = (srv->first + 1) % window;
+	srv->busy--;
+}
+
+/*
+ * Read the acknowledgement for the oldest page in flight.
+ * It contains the highest message level and the size of the output.
+ * Move the complete output into place, or discard it
+ * and keep the old version if formatting failed.
+ */
+int
+ack_read(struct server *srv, int dstdir_fd)
+{
+	int64_t		 reply[2];
+	struct page	*page;
+	size_t		 off;
+	ssize_t		 sz;
+
+	for (off = 0; off < sizeof(reply); off += sz) {
+		sz = read(srv->fd, (char *)reply + off, sizeof(reply) - off);
+		if (sz == -1) {
+			if (errno == EINTR) {
+				sz = 0;
+				continue;
+			}
+			warn("read");
+			return -1;
+		}
+		if (sz == 0) {
+			warnx("mandocd died unexpectedly");
+			return -1;
+		}
+	}
+	page = srv->pages + srv->first;
+	if (reply[0] != 0)
+		warnx("%s: Formatting failed", page->path);
+	else if (reply[1] == 0)
+		warnx("%s: Empty output", page->path);
+	if (reply[0] != 0) {
+		if (unlinkat(dstdir_fd, page->tmpname, 0) == -1)
+			warn("unlinkat(%s)", page->tmpname);
+	} else if (renameat(dstdir_fd, page->tmpname,
+	    dstdir_fd, page->path) == -1) {
+		warn("renameat(%s)", page->path);
+		(void)unlinkat(dstdir_fd, page->tmpname, 0);
+	}
+	page_free(srv);
+	return 0;
+}
+
 ssize_t
 sock_fd_write(int fd, int fd0, int fd1, int fd2)
 {
@@ -78,8 +256,11 @@ sock_fd_write(int fd, int fd0, int fd1, int fd2)
 	struct cmsghdr	*cmsg;
 	int		*walk;
 	ssize_t		 sz;
-	unsigned char	 dummy[1] = {'\0'};
+	unsigned char	 dummy[1];
+
+	/* A non-zero byte asks mandocd(8) for an acknowledgement. */
 
+	dummy[0] = 'a';
 	iov.iov_base = dummy;
 	iov.iov_len = sizeof(dummy);
 
@@ -118,39 +299,120 @@ sock_fd_write(int fd, int fd0, int fd1, int fd2)
 	return sz;
 }
 
+/*
+ * Whether the file described by sb1 was modified
+ * at the same time as or later than the one described by sb2.
+ */
 int
-process_manpage(int srv_fd, int dstdir_fd, const char *path)
+is_newer(const struct stat *sb1, const struct stat *sb2)
 {
-	int	 in_fd, out_fd;
-	int	 irc;
+#if HAVE_ST_MTIM
+	if (sb1->st_mtim.tv_sec != sb2->st_mtim.tv_sec)
+		return sb1->st_mtim.tv_sec > sb2->st_mtim.tv_sec;
+	return sb1->st_mtim.tv_nsec >= sb2->st_mtim.tv_nsec;
+#else
+	return sb1->st_mtime >= sb2->st_mtime;
+#endif
+}
+
+/*
+ * Send one page to the next server in turn, first waiting
+ * until that server has room for one more page in flight.
+ * With -u, skip the page if the formatted version is not older
+ * than the source.  Write to a temporary file in the same directory,
+ * to be renamed when the page is acknowledged.
+ */
+int
+process_manpage(int dstdir_fd, const char *path, const struct stat *sb)
+{
+	struct stat	 dst_sb;
+	struct server	*srv;
+	struct page	*page;
+	const char	*base;
+	char		*tmpname;
+	int		 in_fd, out_fd;
+	int		 irc;
+
+	if (update && fstatat(dstdir_fd, path, &dst_sb,
+	    AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(dst_sb.st_mode) &&
+	    is_newer(&dst_sb, sb))
+		return 0;
+
+	srv = servers + nextserver;
+	if (srv->busy == window && ack_read(srv, dstdir_fd) == -1)
+		return -1;
 
 	if ((in_fd = open(path, O_RDONLY)) == -1) {
 		warn("open(%s)", path);
 		return 0;
 	}
 
-	if ((out_fd = openat(dstdir_fd, path,
+	if ((base = strrchr(path, '/')) == NULL)
+		base = path;
+	else
+		base++;
+	mandoc_asprintf(&tmpname, "%.*s" TMP_PREFIX "%s",
+	    (int)(base - path), path, base);
+
+	if ((out_fd = openat(dstdir_fd, tmpname,
 	    O_WRONLY | O_NOFOLLOW | O_CREAT | O_TRUNC,
 	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
-		warn("openat(%s)", path);
+		warn("openat(%s)", tmpname);
 		close(in_fd);
+		free(tmpname);
 		return 0;
 	}
 
-	irc = sock_fd_write(srv_fd, in_fd, out_fd, STDERR_FILENO);
+	irc = sock_fd_write(srv->fd, in_fd, out_fd, STDERR_FILENO);
 
 	close(in_fd);
 	close(out_fd);
 
 	if (irc < 0) {
 		warn("sendmsg");
+		(void)unlinkat(dstdir_fd, tmpname, 0);
+		free(tmpname);
 		return -1;
 	}
+	page = srv->pages + (srv->first + srv->busy) % window;
+	page->path = mandoc_strdup(path);
+	page->tmpname = tmpname;
+	srv->busy++;
+	nextserver = (nextserver + 1) % nservers;
 	return 0;
 }
 
+/*
+ * Remove temporary files left behind in an existing
+ * output directory by an earlier run that was interrupted.
+ */
+void
+clean_dir(int dstdir_fd, const char *path)
+{
+	DIR		*dirp;
+	struct dirent	*dp;
+	int		 fd;
+
+	if ((fd = openat(dstdir_fd, *path == '\0' ? "." : path,
+	    O_RDONLY | O_DIRECTORY)) == -1) {
+		warn("openat(%s)", path);
+		return;
+	}
+	if ((dirp = fdopendir(fd)) == NULL) {
+		warn("fdopendir(%s)", path);
+		close(fd);
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL)
+		if (strncmp(dp->d_name, TMP_PREFIX,
+		    sizeof(TMP_PREFIX) - 1) == 0 &&
+		    unlinkat(fd, dp->d_name, 0) == -1)
+			warn("unlinkat(%s/%s)", path, dp->d_name);
+	closedir(dirp);
+}
+
 int
-process_tree(int srv_fd, int dstdir_fd)
+process_tree(int dstdir_fd)
 {
 	FTS		*ftsp;
 	FTSENT		*entry;
@@ -170,18 +432,23 @@ process_tree(int srv_fd, int dstdir_fd)
 		path = entry->fts_path + 2;
 		switch (entry->fts_info) {
 		case FTS_F:
-			if (process_manpage(srv_fd, dstdir_fd, path) == -1) {
+			if (process_manpage(dstdir_fd, path,
+			    entry->fts_statp) == -1) {
 				fts_close(ftsp);
 				return -1;
 			}
 			break;
 		case FTS_D:
-			if (*path != '\0' &&
-			    mkdirat(dstdir_fd, path, S_IRWXU | S_IRGRP |
-			      S_IXGRP | S_IROTH | S_IXOTH) == -1 &&
-			    errno != EEXIST) {
-				warn("mkdirat(%s)", path);
-				(void)fts_set(ftsp, entry, FTS_SKIP);
+			if (*path == '\0')
+				clean_dir(dstdir_fd, path);
+			else if (mkdirat(dstdir_fd, path, S_IRWXU | S_IRGRP |
+			    S_IXGRP | S_IROTH | S_IXOTH) == -1) {
+				if (errno == EEXIST)
+					clean_dir(dstdir_fd, path);
+				else {
+					warn("mkdirat(%s)", path);
+					(void)fts_set(ftsp, entry, FTS_SKIP);
+				}
 			}
 			break;
 		case FTS_DP:
@@ -199,22 +466,39 @@ process_tree(int srv_fd, int dstdir_fd)
 int
 main(int argc, char **argv)
 {
-	const char	*defos, *outtype;
-	int		 srv_fds[2];
+	const char	*defos, *errstr, *outtype;
 	int		 dstdir_fd;
-	int		 opt;
-	pid_t		 pid;
+	int		 opt, rc;
 
 	defos = NULL;
 	outtype = "ascii";
-	while ((opt = getopt(argc, argv, "I:T:")) != -1) {
+	nservers = 1;
+	window = 16;
+	while ((opt = getopt(argc, argv, "I:j:T:uw:")) != -1) {
 		switch (opt) {
 		case 'I':
 			defos = optarg;
 			break;
+		case 'j':
+			nservers = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL) {
+				warnx("-j %s: %s", optarg, errstr);
+				usage();
+			}
+			break;
 		case 'T':
 			outtype = optarg;
 			break;
+		case 'u':
+			update = 1;
+			break;
+		case 'w':
+			window = strtonum(optarg, 1, 100, &errstr);
+			if (errstr != NULL) {
+				warnx("-w %s: %s", optarg, errstr);
+				usage();
+			}
+			break;
 		default:
 			usage();
 		}
@@ -227,20 +511,7 @@ main(int argc, char **argv)
 	if (argc != 2)
 		usage();
 
-	if (socketpair(AF_LOCAL, SOCK_STREAM, AF_UNSPEC, srv_fds) == -1)
-		err(1, "socketpair");
-
-	pid = fork();
-	switch (pid) {
-	case -1:
-		err(1, "fork");
-	case 0:
-		close(srv_fds[0]);
-		run_mandocd(srv_fds[1], outtype, defos);
-	default:
-		break;
-	}
-	close(srv_fds[1]);
+	servers_start(outtype, defos);
 
 	if ((dstdir_fd = open(argv[1], O_RDONLY | O_DIRECTORY)) == -1)
 		err(1, "open(%s)", argv[1]);
@@ -248,13 +519,16 @@ main(int argc, char **argv)
 	if (chdir(argv[0]) == -1)
 		err(1, "chdir(%s)", argv[0]);
 
-	return process_tree(srv_fds[0], dstdir_fd) == -1 ? 1 : 0;
+	rc = process_tree(dstdir_fd);
+	if (servers_stop(dstdir_fd) == -1)
+		rc = -1;
+	return rc == -1 ? 1 : 0;
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-I os=name] [-T output] "
-	    "srcdir dstdir\n", BINM_CATMAN);
+	fprintf(stderr, "usage: %s [-u] [-I os=name] [-j jobs] "
+	    "[-T output] [-w window] srcdir dstdir\n", BINM_CATMAN);
 	exit(1);
 }
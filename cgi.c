@@ -20,19 +20,27 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #if HAVE_ERR
 #include <err.h>
 #endif
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mandoc_aux.h"
@@ -61,6 +69,8 @@ struct	req {
 	struct query	  q;
 	char		**p; /* array of available manpaths */
 	size_t		  psz; /* number of available manpaths */
+	const char	 *ifnonematch; /* HTTP If-None-Match header */
+	const char	 *ifmodsince; /* HTTP If-Modified-Since header */
 	int		  isquery; /* QUERY_STRING used, not PATH_INFO */
 };
 
@@ -69,12 +79,88 @@ enum	focus {
 	FOCUS_QUERY
 };
 
+/*
+ * A manual page to be shown, parsed before the HTTP header is sent
+ * such that the validators can depend on the files it includes.
+ */
+struct	page {
+	struct manoutput conf; /* HTML output options */
+	struct mparse	*mp; /* parser holding the page, or NULL */
+	char		*key; /* to store the output in the cache */
+	uint64_t	 hash; /* of the key */
+	int		 fd; /* cached output, or -1 */
+	int		 ownmp; /* mp to be freed rather than reset */
+	int		 sofiles; /* files included with .so */
+};
+
+/*
+ * The subset of the FastCGI protocol used in server mode.
+ */
+#define	FCGI_VERSION_1		1
+#define	FCGI_BEGIN_REQUEST	1
+#define	FCGI_ABORT_REQUEST	2
+#define	FCGI_END_REQUEST	3
+#define	FCGI_PARAMS		4
+#define	FCGI_STDIN		5
+#define	FCGI_STDOUT		6
+#define	FCGI_GET_VALUES		9
+#define	FCGI_GET_VALUES_RESULT	10
+#define	FCGI_UNKNOWN_TYPE	11
+#define	FCGI_RESPONDER		1	/* the only role supported */
+#define	FCGI_KEEP_CONN		1	/* flag in FCGI_BEGIN_REQUEST */
+#define	FCGI_REQUEST_COMPLETE	0	/* protocol status */
+#define	FCGI_CANT_MPX_CONN	1
+#define	FCGI_UNKNOWN_ROLE	3
+#define	FCGI_PARAMS_MAX		65536	/* refuse requests with more */
+#define	FCGI_IDLE		10	/* seconds before closing a connection */
+
+#define	FNV_OFFSET	0xcbf29ce484222325ULL
+#define	FNV_PRIME	0x100000001b3ULL
+
+#ifdef CACHE_DIR
+#ifndef CACHE_SIZE
+#define	CACHE_SIZE	(16 * 1024 * 1024)
+#endif
+#define	CACHE_FORMAT	2	/* increment when the key changes */
+#define	CACHE_TRIM	64	/* trim after about one in so many stores */
+#define	PLEDGE_CACHE	" wpath cpath fattr"
+
+/*
+ * One file in the page cache, for cache_trim().
+ */
+struct	cache_entry {
+	time_t		 mtime; /* time of the last use */
+	off_t		 size;
+	char		 name[17]; /* 16 hexadecimal digits */
+};
+
+static	int		 cache_begin(const char *, char *);
+static	int		 cache_cmp(const void *, const void *);
+static	int		 cache_end(int, const char *, uint64_t, size_t);
+static	int		 cache_get(const char *, uint64_t);
+static	void		 cache_trim(void);
+#else
+#define	PLEDGE_CACHE	""
+#endif
+
+static	void		 fcgi_conn(int, struct req *);
+static	int		 fcgi_end(int, int, int, int);
+static	int		 fcgi_len(const unsigned char **,
+				const unsigned char *, size_t *);
+static	int		 fcgi_read(int, void *, size_t);
+static	int		 fcgi_respond(int, int, struct req *,
+				const unsigned char *, size_t);
+static	int		 fcgi_write(int, int, int, const void *, size_t);
+static	uint64_t	 fnv_add(uint64_t, const void *, size_t);
+static	int		 handle_request(struct req *,
+				const char *, const char *);
 static	void		 html_print(const char *);
 static	void		 html_putchar(char);
 static	int		 http_decode(char *);
 static	void		 http_encode(const char *);
 static	void		 parse_manpath_conf(struct req *);
-static	void		 parse_path_info(struct req *, const char *);
+static	struct mparse	*parser_alloc(const char *);
+static	int		 parse_path_info(struct req *, const char *);
 static	void		 parse_query_string(struct req *, const char *);
 static	void		 pg_error_badrequest(const char *);
 static	void		 pg_error_internal(void);
@@ -85,16 +171,31 @@ static	void		 pg_redirect(const struct req *, const char *);
 static	void		 pg_search(const struct req *);
 static	void		 pg_searchres(const struct req *,
 				struct manpage *, size_t);
+static	void		 page_free(struct page *);
+static	void		 page_html(struct page *);
+static	void		 page_parse(const struct req *, const char *,
+				struct page *);
 static	void		 pg_show(struct req *, const char *);
 static	void		 resp_begin_html(int, const char *, const char *);
 static	void		 resp_begin_http(int, const char *);
 static	void		 resp_catman(const struct req *, const char *);
 static	void		 resp_copy(const char *);
+static	void		 resp_copyfd(int);
 static	void		 resp_end_html(void);
-static	void		 resp_format(const struct req *, const char *);
+static	void		 resp_format(struct page *);
 static	void		 resp_searchform(const struct req *, enum focus);
-static	void		 resp_show(const struct req *, const char *);
+static	void		 resp_show(const struct req *, const char *,
+				struct page *);
+static	int		 resp_validate(const struct req *, const char *,
+				const struct page *);
+static	int		 serve(struct req *, int, size_t);
+static	void		 server_done(int);
+static	int		 server_listen(const char *);
+static	pid_t		 server_spawn(struct req *, int);
+static	void		 server_worker(struct req *, int)
+				__attribute__((__noreturn__));
 static	void		 set_query_attr(char **, char **);
+static	int		 timer_set(time_t);
 static	int		 validate_arch(const char *);
 static	int		 validate_filename(const char *);
 static	int		 validate_manpath(const struct req *, const char *);
@@ -102,6 +203,11 @@ static	int		 validate_urifrag(const char *);
 
 static	const char	 *scriptname = SCRIPT_NAME;
 
+static	struct mparse	**parsers; /* Server mode: one for each manpath. */
+static	char		  resp_etag[20]; /* Validators of the page shown, */
+static	char		  resp_lastmod[32]; /* or empty strings. */
+static	volatile sig_atomic_t server_stop; /* Server mode: signal caught. */
+
 static	const int sec_prios[] = {1, 4, 5, 8, 6, 3, 7, 2, 9};
 static	const char *const sec_numbers[] = {
     "0", "1", "2", "3", "3p", "4", "5", "6", "7", "8", "9"
@@ -340,6 +446,10 @@ resp_begin_http(int code, const char *msg)
 
 	if (200 != code)
 		printf("Status: %d %s\r\n", code, msg);
+	if (*resp_etag != '\0')
+		printf("ETag: %s\r\n", resp_etag);
+	if (*resp_lastmod != '\0')
+		printf("Last-Modified: %s\r\n", resp_lastmod);
 
 	printf("Content-Type: text/html; charset=utf-8\r\n"
 	     "Cache-Control: no-cache\r\n"
@@ -354,18 +464,28 @@ resp_begin_http(int code, const char *msg)
 static void
 resp_copy(const char *filename)
 {
-	char	 buf[4096];
-	ssize_t	 sz;
 	int	 fd;
 
 	if ((fd = open(filename, O_RDONLY)) != -1) {
-		fflush(stdout);
-		while ((sz = read(fd, buf, sizeof(buf))) > 0)
-			write(STDOUT_FILENO, buf, sz);
+		resp_copyfd(fd);
 		close(fd);
 	}
 }
 
+/*
+ * Copy the rest of a file from its current offset to the output.
+ */
+static void
+resp_copyfd(int fd)
+{
+	char	 buf[4096];
+	ssize_t	 sz;
+
+	fflush(stdout);
+	while ((sz = read(fd, buf, sizeof(buf))) > 0)
+		write(STDOUT_FILENO, buf, sz);
+}
+
 static void
 resp_begin_html(int code, const char *msg, const char *file)
 {
@@ -608,6 +728,7 @@ pg_redirect(const struct req *req, const char *name)
 static void
 pg_searchres(const struct req *req, struct manpage *r, size_t sz)
 {
+	struct page	 pg;
 	char		*arch, *archend;
 	const char	*sec;
 	size_t		 i, iuse;
@@ -709,7 +830,9 @@ pg_searchres(const struct req *req, struct manpage *r, size_t sz)
 
 	if (req->q.equal || sz == 1) {
 		puts("<hr>");
-		resp_show(req, r[iuse].file);
+		page_parse(req, r[iuse].file, &pg);
+		resp_show(req, r[iuse].file, &pg);
+		page_free(&pg);
 	}
 
 	resp_end_html();
@@ -852,51 +975,405 @@ resp_catman(const struct req *req, const char *file)
 	fclose(f);
 }
 
+static struct mparse *
+parser_alloc(const char *manpath)
+{
+	return mparse_alloc(MPARSE_SO | MPARSE_UTF8 | MPARSE_LATIN1 |
+	    MPARSE_VALIDATE, MANDOC_OS_OTHER, manpath);
+}
+
+/*
+ * Prepare a page for resp_format().  In server mode, the character
+ * table and one parser for each manpath are set up once and reused.
+ * With CACHE_DIR, the formatted page is looked up in the cache,
+ * keyed by the identity of the file, the output options, and the
+ * mandoc version, and it is only parsed if it is not found.
+ */
 static void
-resp_format(const struct req *req, const char *file)
+page_parse(const struct req *req, const char *file, struct page *pg)
 {
-	struct manoutput conf;
-	struct mparse	*mp;
-	struct roff_meta *meta;
-	void		*vp;
+	size_t		 ip;
 	int		 fd;
 	int		 usepath;
+#ifdef CACHE_DIR
+	struct stat	 sb;
+#endif
 
-	if (-1 == (fd = open(file, O_RDONLY, 0))) {
-		puts("<p>You specified an invalid manual file.</p>");
-		return;
-	}
+	memset(pg, 0, sizeof(*pg));
+	pg->fd = -1;
 
-	mchars_alloc();
-	mp = mparse_alloc(MPARSE_SO | MPARSE_UTF8 | MPARSE_LATIN1 |
-	    MPARSE_VALIDATE, MANDOC_OS_OTHER, req->q.manpath);
-	mparse_readfd(mp, fd, file);
-	close(fd);
-	meta = mparse_result(mp);
+	if ('.' == file[0] && '/' == file[1])
+		file += 2;
+	if ('c' == *file || -1 == (fd = open(file, O_RDONLY, 0)))
+		return;
 
-	memset(&conf, 0, sizeof(conf));
-	conf.fragment = 1;
-	conf.style = mandoc_strdup(CSS_DIR "/mandoc.css");
+	pg->conf.fragment = 1;
+	pg->conf.style = mandoc_strdup(CSS_DIR "/mandoc.css");
 	usepath = strcmp(req->q.manpath, req->p[0]);
-	mandoc_asprintf(&conf.man, "/%s%s%s%s%%N.%%S",
+	mandoc_asprintf(&pg->conf.man, "/%s%s%s%s%%N.%%S",
 	    scriptname, *scriptname == '\0' ? "" : "/",
 	    usepath ? req->q.manpath : "", usepath ? "/" : "");
 
-	vp = html_alloc(&conf);
+#ifdef CACHE_DIR
+	if (fstat(fd, &sb) == 0) {
+		mandoc_asprintf(&pg->key, "%d %s %s %s/%s %llu %lld %lld\n",
+		    CACHE_FORMAT, VERSION, pg->conf.man,
+		    req->q.manpath, file, (unsigned long long)sb.st_ino,
+		    (long long)sb.st_size, (long long)sb.st_mtime);
+		pg->hash = fnv_add(FNV_OFFSET, pg->key, strlen(pg->key));
+		if ((pg->fd = cache_get(pg->key, pg->hash)) != -1) {
+			close(fd);
+			return;
+		}
+	}
+#endif
+
+	if (parsers != NULL)
+		for (ip = 0; ip < req->psz; ip++)
+			if (strcmp(req->p[ip], req->q.manpath) == 0)
+				pg->mp = parsers[ip];
+	if (pg->mp == NULL) {
+		if (parsers == NULL)
+			mchars_alloc();
+		pg->mp = parser_alloc(req->q.manpath);
+		pg->ownmp = 1;
+	}
+	mparse_readfd(pg->mp, fd, file);
+	close(fd);
+	pg->sofiles = mparse_sofiles(pg->mp);
+}
+
+/*
+ * Show a page prepared by page_parse(), from the cache if possible.
+ * Pages including other files are not cached because changes
+ * of the included files would not be noticed.
+ */
+static void
+resp_format(struct page *pg)
+{
+#ifdef CACHE_DIR
+	char		 tmpname[] = CACHE_DIR "/.tmp.XXXXXXXXXX";
+	int		 savefd;
+#endif
+
+	if (pg->fd != -1) {
+		resp_copyfd(pg->fd);
+		return;
+	}
+	if (pg->mp == NULL) {
+		puts("<p>You specified an invalid manual file.</p>");
+		return;
+	}
+
+#ifdef CACHE_DIR
+	if (pg->key != NULL && pg->sofiles == 0 &&
+	    (savefd = cache_begin(pg->key, tmpname)) != -1) {
+		page_html(pg);
+		if (cache_end(savefd, tmpname, pg->hash,
+		    strlen(pg->key)) == 0)
+			return;
+
+		/* The page could not be stored; format it again. */
+	}
+#endif
+	page_html(pg);
+}
+
+static void
+page_html(struct page *pg)
+{
+	struct roff_meta *meta;
+	void		*vp;
+
+	meta = mparse_result(pg->mp);
+	vp = html_alloc(&pg->conf);
 	if (meta->macroset == MACROSET_MDOC)
 		html_mdoc(vp, meta);
 	else
 		html_man(vp, meta);
-
 	html_free(vp);
-	mparse_free(mp);
-	mchars_free();
-	free(conf.man);
-	free(conf.style);
 }
 
 static void
-resp_show(const struct req *req, const char *file)
+page_free(struct page *pg)
+{
+	if (pg->fd != -1)
+		close(pg->fd);
+	if (pg->ownmp) {
+		mparse_free(pg->mp);
+		if (parsers == NULL)
+			mchars_free();
+	} else if (pg->mp != NULL)
+		mparse_reset(pg->mp);
+	free(pg->key);
+	free(pg->conf.man);
+	free(pg->conf.style);
+}
+
+#ifdef CACHE_DIR
+/*
+ * Cached pages are stored in files named after the hash of the key.
+ * Each file starts with the key, such that collisions are detected,
+ * and its modification time is the time it was last used.
+ * If the page is cached, return the file positioned after the key,
+ * or -1 otherwise.
+ */
+static int
+cache_get(const char *key, uint64_t hash)
+{
+	char		 fname[sizeof(CACHE_DIR) + 17];
+	char		*buf;
+	size_t		 keysz;
+	int		 fd, irc;
+
+	(void)snprintf(fname, sizeof(fname), "%s/%016llx",
+	    CACHE_DIR, (unsigned long long)hash);
+	if ((fd = open(fname, O_RDONLY)) == -1)
+		return -1;
+	keysz = strlen(key);
+	buf = mandoc_malloc(keysz);
+	irc = read(fd, buf, keysz) == (ssize_t)keysz &&
+	    memcmp(buf, key, keysz) == 0;
+	free(buf);
+	if (irc == 0) {
+		close(fd);
+		return -1;
+	}
+	(void)futimens(fd, NULL);
+	return fd;
+}
+
+/*
+ * Redirect the output to a new temporary file in the cache,
+ * starting with the key.  Return the original output,
+ * or -1 if the page cannot be cached.
+ */
+static int
+cache_begin(const char *key, char *tmpname)
+{
+	int	 fd, savefd;
+
+	if ((fd = mkstemp(tmpname)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", tmpname);
+		return -1;
+	}
+	fflush(stdout);
+	if ((savefd = dup(STDOUT_FILENO)) == -1 ||
+	    dup2(fd, STDOUT_FILENO) == -1) {
+		warn("dup");
+		if (savefd != -1)
+			close(savefd);
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+	close(fd);
+	fputs(key, stdout);
+	return savefd;
+}
+
+/*
+ * Restore the original output.  If the page was completely written,
+ * move the temporary file into place, copy the formatted page
+ * to the output, and return 0.  Otherwise, discard the temporary
+ * file and return -1, such that the page can be formatted again,
+ * unless the original output cannot be restored.
+ */
+static int
+cache_end(int savefd, const char *tmpname, uint64_t hash, size_t keysz)
+{
+	char	 fname[sizeof(CACHE_DIR) + 17];
+	int	 fd;
+
+	fd = -1;
+	if (fflush(stdout) == EOF)
+		warn("%s", tmpname);
+	else if ((fd = open(tmpname, O_RDONLY)) == -1)
+		warn("%s", tmpname);
+	if (dup2(savefd, STDOUT_FILENO) == -1) {
+		/*
+		 * The rest of this response goes to the temporary
+		 * file and is lost, but in server mode, the next
+		 * request starts over with the same output file.
+		 */
+		warn("dup2");
+		if (fd != -1)
+			close(fd);
+		close(savefd);
+		unlink(tmpname);
+		return 0;
+	}
+	close(savefd);
+	if (fd == -1) {
+		unlink(tmpname);
+		return -1;
+	}
+
+	(void)snprintf(fname, sizeof(fname), "%s/%016llx",
+	    CACHE_DIR, (unsigned long long)hash);
+	if (rename(tmpname, fname) == -1) {
+		warn("rename %s", fname);
+		unlink(tmpname);
+	}
+	if (lseek(fd, keysz, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+	resp_copyfd(fd);
+	close(fd);
+
+	/*
+	 * Scanning the cache is expensive, so only do it after
+	 * about one in CACHE_TRIM stores.  The hash is as good
+	 * as a random number and needs no state across processes.
+	 */
+
+	if (hash % CACHE_TRIM == 0)
+		cache_trim();
+	return 0;
+}
+
+static int
+cache_cmp(const void *vp1, const void *vp2)
+{
+	const struct cache_entry *e1, *e2;
+
+	e1 = vp1;
+	e2 = vp2;
+	return e1->mtime < e2->mtime ? -1 : e1->mtime > e2->mtime;
+}
+
+/*
+ * When the cache exceeds CACHE_SIZE, remove the pages used least
+ * recently until it is a quarter below the limit.  Also remove
+ * temporary files left behind by requests that were killed.
+ */
+static void
+cache_trim(void)
+{
+	struct stat		 sb;
+	struct cache_entry	*entries;
+	struct dirent		*de;
+	DIR			*dp;
+	off_t			 total;
+	time_t			 now;
+	size_t			 i, entriesz, entriesmax;
+
+	if ((dp = opendir(CACHE_DIR)) == NULL) {
+		warn("%s", CACHE_DIR);
+		return;
+	}
+	now = time(NULL);
+	entries = NULL;
+	entriesz = entriesmax = 0;
+	total = 0;
+	while ((de = readdir(dp)) != NULL) {
+		if (fstatat(dirfd(dp), de->d_name, &sb,
+		    AT_SYMLINK_NOFOLLOW) == -1 || ! S_ISREG(sb.st_mode))
+			continue;
+		if (strncmp(de->d_name, ".tmp.", 5) == 0) {
+			if (sb.st_mtime < now - 60)
+				(void)unlinkat(dirfd(dp), de->d_name, 0);
+			continue;
+		}
+		if (strlen(de->d_name) != sizeof(entries->name) - 1)
+			continue;
+		if (entriesz == entriesmax) {
+			entriesmax = entriesmax == 0 ? 64 : entriesmax * 2;
+			entries = mandoc_reallocarray(entries,
+			    entriesmax, sizeof(*entries));
+		}
+		entries[entriesz].mtime = sb.st_mtime;
+		entries[entriesz].size = sb.st_size;
+		memcpy(entries[entriesz].name, de->d_name,
+		    sizeof(entries->name));
+		entriesz++;
+		total += sb.st_size;
+	}
+	if (total > CACHE_SIZE) {
+		qsort(entries, entriesz, sizeof(*entries), cache_cmp);
+		for (i = 0; i < entriesz && total > CACHE_SIZE / 4 * 3; i++)
+			if (unlinkat(dirfd(dp), entries[i].name, 0) == 0)
+				total -= entries[i].size;
+	}
+	closedir(dp);
+	free(entries);
+}
+#endif
+
+/*
+ * Update a 64-bit FNV-1a hash.
+ */
+static uint64_t
+fnv_add(uint64_t hash, const void *buf, size_t sz)
+{
+	const unsigned char	*cp;
+
+	for (cp = buf; sz > 0; cp++, sz--)
+		hash = (hash ^ *cp) * FNV_PRIME;
+	return hash;
+}
+
+/*
+ * Set the validators of the page shown, such that clients can
+ * revalidate it with conditional requests.  They depend on the
+ * manual page file, on the header and footer files, and on the
+ * mandoc version.  Pages including other files get no validators.
+ * Return 1 if the copy of the client is still valid.
+ */
+static int
+resp_validate(const struct req *req, const char *file,
+    const struct page *pg)
+{
+	const char	*fnames[3];
+	struct stat	 sb;
+	struct tm	*tm;
+	int64_t		 v[4];
+	uint64_t	 hash;
+	time_t		 mtime;
+	int		 i;
+
+	if (pg->sofiles > 0)
+		return 0;
+	fnames[0] = file;
+	fnames[1] = MAN_DIR "/header.html";
+	fnames[2] = MAN_DIR "/footer.html";
+	hash = fnv_add(FNV_OFFSET, VERSION, strlen(VERSION));
+	mtime = 0;
+	for (i = 0; i < 3; i++) {
+		if (stat(fnames[i], &sb) == -1) {
+			if (i == 0)
+				return 0;
+			memset(v, 0, sizeof(v));
+		} else {
+			v[0] = sb.st_dev;
+			v[1] = sb.st_ino;
+			v[2] = sb.st_size;
+			v[3] = sb.st_mtime;
+			if (mtime < sb.st_mtime)
+				mtime = sb.st_mtime;
+		}
+		hash = fnv_add(hash, v, sizeof(v));
+	}
+	(void)snprintf(resp_etag, sizeof(resp_etag), "\"%016llx\"",
+	    (unsigned long long)hash);
+	if ((tm = gmtime(&mtime)) == NULL ||
+	    strftime(resp_lastmod, sizeof(resp_lastmod),
+	    "%a, %d %b %Y %H:%M:%S GMT", tm) == 0)
+		*resp_lastmod = '\0';
+
+	/* If-None-Match takes precedence over If-Modified-Since. */
+
+	if (req->ifnonematch != NULL)
+		return strcmp(req->ifnonematch, "*") == 0 ||
+		    strstr(req->ifnonematch, resp_etag) != NULL;
+	return req->ifmodsince != NULL && *resp_lastmod != '\0' &&
+	    strcmp(req->ifmodsince, resp_lastmod) == 0;
+}
+
+static void
+resp_show(const struct req *req, const char *file, struct page *pg)
 {
 
 	if ('.' == file[0] && '/' == file[1])
@@ -905,12 +1382,13 @@ resp_show(const struct req *req, const char *file)
 	if ('c' == *file)
 		resp_catman(req, file);
 	else
-		resp_format(req, file);
+		resp_format(pg);
 }
 
 static void
 pg_show(struct req *req, const char *fullpath)
 {
+	struct page	 pg;
 	char		*manpath;
 	const char	*file;
 
@@ -949,9 +1427,16 @@ pg_show(struct req *req, const char *fullpath)
 		return;
 	}
 
+	page_parse(req, file, &pg);
+	if (resp_validate(req, file, &pg)) {
+		resp_begin_http(304, "Not Modified");
+		page_free(&pg);
+		return;
+	}
 	resp_begin_html(200, NULL, file);
 	resp_searchform(req, FOCUS_NONE);
-	resp_show(req, file);
+	resp_show(req, file, &pg);
+	page_free(&pg);
 	resp_end_html();
 }
 
@@ -983,6 +1468,9 @@ pg_search(const struct req *req)
 	search.outkey = "Nd";
 	search.argmode = req->q.equal ? ARG_NAME : ARG_EXPR;
 	search.firstmatch = 1;
+	search.parallel = 0;
+	search.cache = 1;
+	search.limit = 0;
 
 	paths.sz = 1;
 	paths.paths = mandoc_malloc(sizeof(char *));
@@ -1037,14 +1525,127 @@ pg_search(const struct req *req)
 	free(paths.paths);
 }
 
+/*
+ * Parse and validate one request, then dispatch it to one of the
+ * three different pages.  The list of manpaths must already be set up.
+ * The query is freed before returning.
+ */
+static int
+handle_request(struct req *req, const char *path, const char *querystring)
+{
+	int		 rc;
+
+	memset(&req->q, 0, sizeof(req->q));
+	req->q.equal = 1;
+	req->isquery = 0;
+	*resp_etag = *resp_lastmod = '\0';
+	rc = EXIT_FAILURE;
+
+	/* Parse the path info and the query string. */
+
+	if (path == NULL)
+		path = "";
+	else if (*path == '/')
+		path++;
+
+	if (*path != '\0') {
+		if (parse_path_info(req, path) == 0)
+			goto out;
+		if (req->q.manpath == NULL || req->q.sec == NULL ||
+		    *req->q.query == '\0' || access(path, F_OK) == -1)
+			path = "";
+	} else if (querystring != NULL)
+		parse_query_string(req, querystring);
+
+	/* Validate parsed data and add defaults. */
+
+	if (req->q.manpath == NULL)
+		req->q.manpath = mandoc_strdup(req->p[0]);
+	else if ( ! validate_manpath(req, req->q.manpath)) {
+		pg_error_badrequest(
+		    "You specified an invalid manpath.");
+		goto out;
+	}
+
+	if (req->q.arch != NULL && validate_arch(req->q.arch) == 0) {
+		pg_error_badrequest(
+		    "You specified an invalid architecture.");
+		goto out;
+	}
+
+	/* Dispatch to the three different pages. */
+
+	if ('\0' != *path)
+		pg_show(req, path);
+	else if (NULL != req->q.query)
+		pg_search(req);
+	else
+		pg_index(req);
+	rc = EXIT_SUCCESS;
+
+out:
+	free(req->q.manpath);
+	free(req->q.arch);
+	free(req->q.sec);
+	free(req->q.query);
+	return rc;
+}
+
+/*
+ * Poor man's ReDoS mitigation: limit the CPU time of one request.
+ * With an argument of 0, remove the limit.
+ */
+static int
+timer_set(time_t sec)
+{
+	struct itimerval itimer;
+
+	itimer.it_value.tv_sec = sec;
+	itimer.it_value.tv_usec = 0;
+	itimer.it_interval.tv_sec = sec;
+	itimer.it_interval.tv_usec = 0;
+	if (setitimer(ITIMER_VIRTUAL, &itimer, NULL) == -1) {
+		warn("setitimer");
+		return -1;
+	}
+	return 0;
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
 	struct req	 req;
-	struct itimerval itimer;
-	const char	*path;
-	const char	*querystring;
-	int		 i;
+	const char	*errstr, *sockname;
+	size_t		 jobs;
+	int		 ch, i, rc, sockfd;
+
+	/*
+	 * Command line arguments are only used in server mode.
+	 * In CGI mode, the server might pass parts of the
+	 * QUERY_STRING as arguments, so ignore them.
+	 */
+
+	sockname = NULL;
+	sockfd = -1;
+	jobs = 1;
+	if (getenv("GATEWAY_INTERFACE") == NULL) {
+		while ((ch = getopt(argc, argv, "j:s:")) != -1) {
+			switch (ch) {
+			case 'j':
+				jobs = strtonum(optarg, 1, 256, &errstr);
+				if (errstr != NULL)
+					errx(1, "-j %s: %s", optarg, errstr);
+				break;
+			case 's':
+				sockname = optarg;
+				break;
+			default:
+				goto usage;
+			}
+		}
+		if (optind < argc || (sockname == NULL && optind > 1))
+			goto usage;
+	}
 
 #if HAVE_PLEDGE
 	/*
@@ -1053,23 +1654,21 @@ main(void)
 	 * up front, but it's probably not worth the complication
 	 * of the code it would cause: it would require scattering
 	 * pledge() calls in multiple low-level resp_*() functions.
+	 * In server mode, the workers need to create temporary files.
 	 */
 
-	if (pledge("stdio rpath", NULL) == -1) {
+	if (pledge(sockname == NULL ? "stdio rpath" PLEDGE_CACHE :
+	    "stdio rpath wpath cpath fattr proc unix", NULL) == -1) {
 		warn("pledge");
 		pg_error_internal();
 		return EXIT_FAILURE;
 	}
 #endif
 
-	/* Poor man's ReDoS mitigation. */
-
-	itimer.it_value.tv_sec = 2;
-	itimer.it_value.tv_usec = 0;
-	itimer.it_interval.tv_sec = 2;
-	itimer.it_interval.tv_usec = 0;
-	if (setitimer(ITIMER_VIRTUAL, &itimer, NULL) == -1) {
-		warn("setitimer");
+	if (sockname != NULL) {
+		if ((sockfd = server_listen(sockname)) == -1)
+			return EXIT_FAILURE;
+	} else if (timer_set(2) == -1) {
 		pg_error_internal();
 		return EXIT_FAILURE;
 	}
@@ -1087,63 +1686,520 @@ main(void)
 	}
 
 	memset(&req, 0, sizeof(struct req));
-	req.q.equal = 1;
 	parse_manpath_conf(&req);
 
-	/* Parse the path info and the query string. */
+	if (sockfd != -1)
+		rc = serve(&req, sockfd, jobs);
+	else {
+		req.ifnonematch = getenv("HTTP_IF_NONE_MATCH");
+		req.ifmodsince = getenv("HTTP_IF_MODIFIED_SINCE");
+		rc = handle_request(&req, getenv("PATH_INFO"),
+		    getenv("QUERY_STRING"));
+	}
 
-	if ((path = getenv("PATH_INFO")) == NULL)
-		path = "";
-	else if (*path == '/')
-		path++;
+	for (i = 0; i < (int)req.psz; i++)
+		free(req.p[i]);
+	free(req.p);
+	return rc;
 
-	if (*path != '\0') {
-		parse_path_info(&req, path);
-		if (req.q.manpath == NULL || req.q.sec == NULL ||
-		    *req.q.query == '\0' || access(path, F_OK) == -1)
-			path = "";
-	} else if ((querystring = getenv("QUERY_STRING")) != NULL)
-		parse_query_string(&req, querystring);
+usage:
+	fputs("usage: man.cgi [-j jobs] -s socket\n", stderr);
+	return EXIT_FAILURE;
+}
 
-	/* Validate parsed data and add defaults. */
+/*
+ * Server mode: create the local socket to accept FastCGI
+ * connections on, replacing a stale socket left behind.
+ */
+static int
+server_listen(const char *sockname)
+{
+	struct sockaddr_un	 sun;
+	struct stat		 sb;
+	int			 fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, sockname, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		warnx("%s: %s", sockname, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	if (lstat(sockname, &sb) == 0 && S_ISSOCK(sb.st_mode) &&
+	    unlink(sockname) == -1) {
+		warn("unlink %s", sockname);
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(fd, 128) == -1) {
+		warn("%s", sockname);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-	if (req.q.manpath == NULL)
-		req.q.manpath = mandoc_strdup(req.p[0]);
-	else if ( ! validate_manpath(&req, req.q.manpath)) {
-		pg_error_badrequest(
-		    "You specified an invalid manpath.");
-		return EXIT_FAILURE;
+static void
+server_done(int signum)
+{
+	server_stop = 1;
+}
+
+/*
+ * Server mode: set up the character table and the parsers once,
+ * then run a pool of worker processes accepting connections.
+ * Workers that die, for example by exceeding the CPU time limit,
+ * are replaced; only a termination signal stops the server.
+ */
+static int
+serve(struct req *req, int sockfd, size_t jobs)
+{
+	struct sigaction	 sa;
+	pid_t			*pids, pid;
+	size_t			 i;
+	int			 rc, status;
+
+	mchars_alloc();
+	parsers = mandoc_reallocarray(NULL, req->psz, sizeof(*parsers));
+	for (i = 0; i < req->psz; i++)
+		parsers[i] = parser_alloc(req->p[i]);
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = server_done;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	rc = EXIT_SUCCESS;
+	pids = mandoc_reallocarray(NULL, jobs, sizeof(*pids));
+	for (i = 0; i < jobs; i++)
+		pids[i] = -1;
+
+	while (server_stop == 0) {
+		for (i = 0; i < jobs; i++)
+			if (pids[i] == -1)
+				pids[i] = server_spawn(req, sockfd);
+		if ((pid = wait(&status)) == -1) {
+			if (errno == ECHILD)
+				sleep(1);  /* Every fork(2) failed. */
+			else if (errno != EINTR) {
+				warn("wait");
+				rc = EXIT_FAILURE;
+				break;
+			}
+			continue;
+		}
+		for (i = 0; i < jobs; i++)
+			if (pids[i] == pid)
+				break;
+		if (i == jobs)
+			continue;
+		pids[i] = -1;
+		if (server_stop)
+			break;
+		if (WIFSIGNALED(status) && WTERMSIG(status) == SIGVTALRM)
+			warnx("request exceeded the time limit");
+		else {
+			warnx("worker process %d died", (int)pid);
+
+			/* Do not replace it in a tight loop. */
+
+			sleep(1);
+		}
 	}
 
-	if (req.q.arch != NULL && validate_arch(req.q.arch) == 0) {
-		pg_error_badrequest(
-		    "You specified an invalid architecture.");
-		return EXIT_FAILURE;
+	for (i = 0; i < jobs; i++)
+		if (pids[i] != -1)
+			kill(pids[i], SIGTERM);
+	for (i = 0; i < jobs; i++)
+		if (pids[i] != -1)
+			while (waitpid(pids[i], &status, 0) == -1 &&
+			    errno == EINTR)
+				continue;
+	free(pids);
+	close(sockfd);
+	for (i = 0; i < req->psz; i++)
+		mparse_free(parsers[i]);
+	free(parsers);
+	parsers = NULL;
+	mchars_free();
+	return rc;
+}
+
+static pid_t
+server_spawn(struct req *req, int sockfd)
+{
+	pid_t	 pid;
+
+	if ((pid = fork()) == -1)
+		warn("fork");
+	else if (pid == 0)
+		server_worker(req, sockfd);
+	return pid;
+}
+
+/*
+ * Server mode: one worker process.  Each response is written
+ * to a temporary file on standard output and then sent to the
+ * client in FastCGI records.
+ */
+static void
+server_worker(struct req *req, int sockfd)
+{
+	struct timeval	 tv;
+	FILE		*tmp;
+	int		 fd;
+
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((tmp = tmpfile()) == NULL) {
+		warn("tmpfile");
+		_exit(EXIT_FAILURE);
+	}
+	if (dup2(fileno(tmp), STDOUT_FILENO) == -1) {
+		warn("dup2");
+		_exit(EXIT_FAILURE);
 	}
+#if HAVE_PLEDGE
+	if (pledge("stdio rpath unix" PLEDGE_CACHE, NULL) == -1) {
+		warn("pledge");
+		_exit(EXIT_FAILURE);
+	}
+#endif
 
-	/* Dispatch to the three different pages. */
+	for (;;) {
+		if ((fd = accept(sockfd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			warn("accept");
+			_exit(EXIT_FAILURE);
+		}
 
-	if ('\0' != *path)
-		pg_show(&req, path);
-	else if (NULL != req.q.query)
-		pg_search(&req);
-	else
-		pg_index(&req);
+		/*
+		 * Do not let idle kept-alive connections occupy
+		 * the worker while other connections are waiting.
+		 */
 
-	free(req.q.manpath);
-	free(req.q.arch);
-	free(req.q.sec);
-	free(req.q.query);
-	for (i = 0; i < (int)req.psz; i++)
-		free(req.p[i]);
-	free(req.p);
-	return EXIT_SUCCESS;
+		tv.tv_sec = FCGI_IDLE;
+		tv.tv_usec = 0;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+		    &tv, sizeof(tv)) == -1)
+			warn("setsockopt");
+		fcgi_conn(fd, req);
+		close(fd);
+	}
 }
 
 /*
- * Translate PATH_INFO to a query.
+ * Read exactly sz bytes.
+ * Return 1 on success, 0 at the end of file, or -1 on error.
+ */
+static int
+fcgi_read(int fd, void *buf, size_t sz)
+{
+	ssize_t	 rsz;
+	size_t	 off;
+
+	for (off = 0; off < sz; off += rsz) {
+		if ((rsz = read(fd, (char *)buf + off, sz - off)) == -1) {
+			if (errno == EINTR) {
+				rsz = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (rsz == 0)
+			return off == 0 ? 0 : -1;
+	}
+	return 1;
+}
+
+/*
+ * Write one record of at most 65535 bytes of content.
+ */
+static int
+fcgi_write(int fd, int type, int id, const void *buf, size_t sz)
+{
+	unsigned char	 hdr[8];
+	struct iovec	 iov[2];
+	ssize_t		 wsz;
+	size_t		 off;
+
+	hdr[0] = FCGI_VERSION_1;
+	hdr[1] = type;
+	hdr[2] = id >> 8;
+	hdr[3] = id & 0xff;
+	hdr[4] = sz >> 8;
+	hdr[5] = sz & 0xff;
+	hdr[6] = 0;	/* padding length */
+	hdr[7] = 0;	/* reserved */
+
+	for (off = 0; off < sizeof(hdr) + sz; off += wsz) {
+		if (off < sizeof(hdr)) {
+			iov[0].iov_base = hdr + off;
+			iov[0].iov_len = sizeof(hdr) - off;
+			iov[1].iov_base = (void *)buf;
+			iov[1].iov_len = sz;
+			wsz = writev(fd, iov, 2);
+		} else
+			wsz = write(fd, (const char *)buf +
+			    (off - sizeof(hdr)), sz - (off - sizeof(hdr)));
+		if (wsz == -1) {
+			if (errno == EINTR) {
+				wsz = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+fcgi_end(int fd, int id, int appstatus, int protostatus)
+{
+	unsigned char	 body[8];
+
+	body[0] = appstatus >> 24;
+	body[1] = appstatus >> 16;
+	body[2] = appstatus >> 8;
+	body[3] = appstatus;
+	body[4] = protostatus;
+	body[5] = body[6] = body[7] = 0;
+	return fcgi_write(fd, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+/*
+ * Decode the length of a name or a value in FCGI_PARAMS.
+ */
+static int
+fcgi_len(const unsigned char **pp, const unsigned char *end, size_t *sz)
+{
+	const unsigned char	*p;
+
+	p = *pp;
+	if (p == end)
+		return -1;
+	if ((*p & 0x80) == 0) {
+		*sz = *p;
+		*pp = p + 1;
+		return 0;
+	}
+	if (end - p < 4)
+		return -1;
+	*sz = (size_t)(p[0] & 0x7f) << 24 | (size_t)p[1] << 16 |
+	    (size_t)p[2] << 8 | p[3];
+	*pp = p + 4;
+	return 0;
+}
+
+/*
+ * Answer one request after all its parameters have been received.
+ */
+static int
+fcgi_respond(int fd, int id, struct req *req,
+    const unsigned char *params, size_t psz)
+{
+	static const char *const names[] = { "PATH_INFO",
+	    "QUERY_STRING", "HTTP_IF_NONE_MATCH", "HTTP_IF_MODIFIED_SINCE" };
+	char			 buf[16384];
+	char			*vals[4];
+	const unsigned char	*p, *end;
+	size_t			 i, namesz, valsz;
+	ssize_t			 sz;
+	int			 rc, status;
+
+	/* Extract the CGI variables man.cgi(8) uses. */
+
+	rc = -1;
+	memset(vals, 0, sizeof(vals));
+	end = params + psz;
+	for (p = params; p < end; p += namesz + valsz) {
+		if (fcgi_len(&p, end, &namesz) == -1 ||
+		    fcgi_len(&p, end, &valsz) == -1 ||
+		    (size_t)(end - p) < namesz ||
+		    (size_t)(end - p) - namesz < valsz)
+			goto out;
+		for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+			if (namesz != strlen(names[i]) ||
+			    memcmp(p, names[i], namesz) != 0)
+				continue;
+			free(vals[i]);
+			vals[i] = mandoc_strndup((const char *)p + namesz,
+			    valsz);
+		}
+	}
+	req->ifnonematch = vals[2];
+	req->ifmodsince = vals[3];
+
+	/* Produce the response on standard output. */
+
+	if (ftruncate(STDOUT_FILENO, 0) == -1 ||
+	    lseek(STDOUT_FILENO, 0, SEEK_SET) == -1) {
+		warn("temporary file");
+		goto out;
+	}
+	if (chdir(MAN_DIR) == -1) {
+		warn("MAN_DIR: %s", MAN_DIR);
+		pg_error_internal();
+		status = EXIT_FAILURE;
+	} else if (timer_set(2) == -1) {
+		pg_error_internal();
+		status = EXIT_FAILURE;
+	} else {
+		status = handle_request(req, vals[0], vals[1]);
+		timer_set(0);
+	}
+	fflush(stdout);
+
+	/* Send it to the client. */
+
+	if (lseek(STDOUT_FILENO, 0, SEEK_SET) == -1) {
+		warn("temporary file");
+		goto out;
+	}
+	while ((sz = read(STDOUT_FILENO, buf, sizeof(buf))) > 0)
+		if (fcgi_write(fd, FCGI_STDOUT, id, buf, sz) == -1)
+			goto out;
+	if (sz == -1) {
+		warn("temporary file");
+		goto out;
+	}
+	if (fcgi_write(fd, FCGI_STDOUT, id, NULL, 0) == -1 ||
+	    fcgi_end(fd, id, status, FCGI_REQUEST_COMPLETE) == -1)
+		goto out;
+	rc = 0;
+
+out:
+	req->ifnonematch = req->ifmodsince = NULL;
+	for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++)
+		free(vals[i]);
+	return rc;
+}
+
+/*
+ * Read FastCGI records from one connection and answer the requests
+ * one after the other until the connection is closed.
+ * Multiplexing several requests on one connection is not supported.
  */
 static void
+fcgi_conn(int fd, struct req *req)
+{
+	unsigned char	 hdr[8], body[8];
+	unsigned char	*content, *params;
+	size_t		 csz, psz;
+	int		 type, id, reqid, keep, gotparams, gotstdin;
+
+	content = mandoc_malloc(65535 + 255);
+	params = NULL;
+	psz = 0;
+	reqid = keep = gotparams = gotstdin = 0;
+
+	while (fcgi_read(fd, hdr, sizeof(hdr)) == 1) {
+		if (hdr[0] != FCGI_VERSION_1)
+			break;
+		type = hdr[1];
+		id = hdr[2] << 8 | hdr[3];
+		csz = hdr[4] << 8 | hdr[5];
+		if (fcgi_read(fd, content, csz + hdr[6]) != 1)
+			break;
+
+		/* Management records. */
+
+		if (id == 0) {
+			if (type == FCGI_GET_VALUES) {
+				if (fcgi_write(fd, FCGI_GET_VALUES_RESULT,
+				    0, NULL, 0) == -1)
+					break;
+				continue;
+			}
+			memset(body, 0, sizeof(body));
+			body[0] = type;
+			if (fcgi_write(fd, FCGI_UNKNOWN_TYPE, 0,
+			    body, sizeof(body)) == -1)
+				break;
+			continue;
+		}
+
+		/* Application records. */
+
+		if (type == FCGI_BEGIN_REQUEST) {
+			if (csz < 8)
+				break;
+			if (reqid != 0) {
+				if (fcgi_end(fd, id, 0,
+				    FCGI_CANT_MPX_CONN) == -1)
+					break;
+				continue;
+			}
+			keep = content[2] & FCGI_KEEP_CONN;
+			if ((content[0] << 8 | content[1]) !=
+			    FCGI_RESPONDER) {
+				if (fcgi_end(fd, id, 0,
+				    FCGI_UNKNOWN_ROLE) == -1 || keep == 0)
+					break;
+				continue;
+			}
+			reqid = id;
+			psz = 0;
+			gotparams = gotstdin = 0;
+			continue;
+		}
+		if (id != reqid)
+			continue;
+		switch (type) {
+		case FCGI_ABORT_REQUEST:
+			reqid = 0;
+			if (fcgi_end(fd, id, 0,
+			    FCGI_REQUEST_COMPLETE) == -1 || keep == 0)
+				goto out;
+			continue;
+		case FCGI_PARAMS:
+			if (csz == 0) {
+				gotparams = 1;
+				break;
+			}
+			if (psz + csz > FCGI_PARAMS_MAX) {
+				warnx("FastCGI parameters too long");
+				goto out;
+			}
+			params = mandoc_realloc(params, psz + csz);
+			memcpy(params + psz, content, csz);
+			psz += csz;
+			break;
+		case FCGI_STDIN:
+			/* The request body is not used. */
+			if (csz == 0)
+				gotstdin = 1;
+			break;
+		default:
+			break;
+		}
+		if (gotparams && gotstdin) {
+			reqid = 0;
+			if (fcgi_respond(fd, id, req, params, psz) == -1 ||
+			    keep == 0)
+				break;
+		}
+	}
+out:
+	free(content);
+	free(params);
+}
+
+/*
+ * Translate PATH_INFO to a query.
+ * Return 0 after reporting an error to the client.
+ */
+static int
 parse_path_info(struct req *req, const char *path)
 {
 	const char	*name, *sec, *end;
@@ -1171,7 +2227,7 @@ parse_path_info(struct req *req, const char *path)
 
 	/* Handle the case of name[.section] only. */
 	if (name == path)
-		return;
+		return 1;
 
 	/* Optional manpath. */
 	end = strchr(path, '/');
@@ -1179,7 +2235,7 @@ parse_path_info(struct req *req, const char *path)
 	if (validate_manpath(req, req->q.manpath)) {
 		path = end + 1;
 		if (name == path)
-			return;
+			return 1;
 	} else {
 		free(req->q.manpath);
 		req->q.manpath = NULL;
@@ -1193,7 +2249,7 @@ parse_path_info(struct req *req, const char *path)
 		req->q.sec = mandoc_strndup(path, end - path);
 		path = end + 1;
 		if (name == path)
-			return;
+			return 1;
 	}
 
 	/* Optional architecture. */
@@ -1201,14 +2257,15 @@ parse_path_info(struct req *req, const char *path)
 	if (end + 1 != name) {
 		pg_error_badrequest(
 		    "You specified too many directory components.");
-		exit(EXIT_FAILURE);
+		return 0;
 	}
 	req->q.arch = mandoc_strndup(path, end - path);
 	if (validate_arch(req->q.arch) == 0) {
 		pg_error_badrequest(
 		    "You specified an invalid directory component.");
-		exit(EXIT_FAILURE);
+		return 0;
 	}
+	return 1;
 }
 
 /*
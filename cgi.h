@@ -0,0 +1,7 @@
+/* Example compile-time configuration file for man.cgi(8). */
+
+#define	SCRIPT_NAME "cgi-bin/man.cgi"
+#define	MAN_DIR "/man"
+#define	CSS_DIR ""
+#define	CUSTOMIZE_TITLE "Manual pages with mandoc"
+#define	COMPAT_OLDURI Yes
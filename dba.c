@@ -27,9 +27,11 @@
 #elif HAVE_NTOHL
 #include <arpa/inet.h>
 #endif
+#include <ctype.h>
 #include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -41,21 +43,133 @@
 #include "dba_array.h"
 #include "dba.h"
 
+/*
+ * When the macro tables use more memory than this,
+ * they are written to a temporary file as a sorted run.
+ */
+#define	MACRO_MEM_MAX	(32 * 1024 * 1024)
+
 struct macro_entry {
 	struct dba_array	*pages;
 	char			 value[];
 };
 
+/*
+ * One run of macro tables on disk.  For each macro, the entries are
+ * sorted by value, and each entry consists of the value, the number
+ * of pages, and the page pointers.  The pages stay in memory, and
+ * the pointers are raw addresses, so a run is only meaningful to
+ * the process that wrote it.  Only the macro tables are bounded
+ * in this way: the pages table and the data for the trigram,
+ * cross reference, and file indexes still stay in memory.
+ */
+struct macro_run {
+	FILE			*fp;
+	long			 off[MACRO_MAX];  /* Start of each table. */
+	int32_t			 ne[MACRO_MAX];   /* Entries in each table. */
+};
+
+/* Reading position in one macro table of one run. */
+struct macro_cursor {
+	struct macro_run	*run;
+	char			*value;	/* Current value or NULL at the end. */
+	size_t			 valsz;
+	struct dba_array	**pages;
+	int32_t			 np;	/* Pages of the current value. */
+	int32_t			 maxnp;
+	int32_t			 left;	/* Entries not yet read. */
+};
+
+/*
+ * Iterator over one macro table in order of values, either
+ * in memory or merging the runs on disk.  Entries having the same
+ * value in several runs are combined, keeping the page order.
+ */
+struct macro_iter {
+	struct macro_entry	**entries; /* The table in memory, sorted. */
+	unsigned int		  ie, ne;
+	struct macro_cursor	 *cur;	/* Or one cursor for each run. */
+	int32_t			  ncur;
+	int32_t			  im;
+	char			 *value; /* The current entry. */
+	size_t			  valsz;
+	struct dba_array	**pages;
+	int32_t			  np;
+	int32_t			  maxnp;
+	int			  error; /* errno of a failed read, or 0 */
+};
+
+struct file_entry {
+	struct dba_fprint	 fp;
+	char			 name[];
+};
+
+struct list_entry {
+	int32_t			 pos;	/* Position of the list on disk. */
+	char			 key[];	/* The strings, each ending in 0x01. */
+};
+
+struct name_entry {
+	const char		*name;	/* Including the class byte. */
+	struct dba_array	*page;
+	int32_t			 pos;	/* Position of the name on disk. */
+};
+
+struct trigram_entry {
+	struct dba_array	*pages;
+	struct dba_array	*last;	/* The page added most recently. */
+	int32_t			 pos;	/* Position of the pages on disk. */
+	char			 key[4];
+};
+
+struct xref_name {
+	struct dba_array	*pages;	/* The pages having that name. */
+	struct dba_array	*last;	/* The page added most recently. */
+	char			 key[];	/* The name, in lower case. */
+};
+
+struct xref_pair {
+	int32_t			 to;	/* Position of the referenced page. */
+	int32_t			 from;	/* Position of the referring page. */
+};
+
 static void	*prepend(const char *, char);
-static void	 dba_pages_write(struct dba_array *);
+static void	 dba_pages_write(struct dba_array *, struct dba_array *);
+static int32_t	 dba_list_write(struct ohash *, struct dba_array *);
+static void	 dba_files_writelst(struct dba_array *);
 static int	 compare_names(const void *, const void *);
 static int	 compare_strings(const void *, const void *);
 
 static struct macro_entry
-		*get_macro_entry(struct ohash *, const char *, int32_t);
-static void	 dba_macros_write(struct dba_array *);
-static void	 dba_macro_write(struct ohash *);
+		*get_macro_entry(struct dba *, int32_t, const char *, int32_t);
+static int	 dba_macros_spill(struct dba *);
+static int	 macro_run_write(FILE *, struct macro_entry **,
+			unsigned int);
+static int	 dba_macros_write(struct dba *);
+static int	 dba_macro_write(struct dba *, int32_t);
 static int	 compare_entries(const void *, const void *);
+static struct macro_entry
+		**macro_sort(struct ohash *, unsigned int *);
+static void	 macro_iter_start(struct macro_iter *, struct dba *,
+			int32_t);
+static void	 macro_iter_rewind(struct macro_iter *);
+static int	 macro_iter_next(struct macro_iter *);
+static int	 macro_iter_end(struct macro_iter *);
+static int	 macro_cursor_read(struct macro_cursor *);
+
+static void	 dba_indexes_write(struct dba *, struct dba_array *);
+static void	 dba_names_write(struct dba_array *);
+static int	 compare_name_entries(const void *, const void *);
+static void	 dba_trigrams_write(struct dba_array *);
+static void	 trigram_add(struct ohash *, struct dba_array *,
+			const char *);
+static int	 compare_trigram_entries(const void *, const void *);
+static void	 dba_xrefs_write(struct dba *);
+static void	 dba_files_write(struct dba *);
+static void	 dba_digests_write(struct dba *);
+static char	*xref_key(const char *, size_t);
+static int	 xref_sect(struct dba_array *, const char *);
+static int	 compare_xref_pairs(const void *, const void *);
 
 
 /*** top-level functions **********************************************/
@@ -76,6 +190,11 @@ dba_new(int32_t npages)
 		    offsetof(struct macro_entry, value));
 		dba_array_set(dba->macros, im, macro);
 	}
+	dba->files = mandoc_malloc(sizeof(*dba->files));
+	mandoc_ohash_init(dba->files, 6, offsetof(struct file_entry, name));
+	dba->runs = dba_array_new(1, DBA_GROW);
+	dba->msize = 0;
+	dba->fopts = 0;
 	return dba;
 }
 
@@ -85,8 +204,22 @@ dba_free(struct dba *dba)
 	struct dba_array	*page;
 	struct ohash		*macro;
 	struct macro_entry	*entry;
+	struct file_entry	*fe;
+	struct macro_run	*run;
 	unsigned int		 slot;
 
+	dba_array_FOREACH(dba->runs, run) {
+		fclose(run->fp);
+		free(run);
+	}
+	dba_array_free(dba->runs);
+
+	for (fe = ohash_first(dba->files, &slot); fe != NULL;
+	     fe = ohash_next(dba->files, &slot))
+		free(fe);
+	ohash_delete(dba->files);
+	free(dba->files);
+
 	dba_array_FOREACH(dba->macros, macro) {
 		for (entry = ohash_first(macro, &slot); entry != NULL;
 		     entry = ohash_next(macro, &slot)) {
@@ -118,27 +251,49 @@ dba_free(struct dba *dba)
  * - One pointer each to the macros table and to the final magic.
  * - The pages table.
  * - The macros table.
+ * - The table of indexes.
+ * - One pointer to the table of indexes.
  * - And at the very end, the magic integer again.
+ * With a NULL file name, nothing is written,
+ * but the digests are computed all the same.
+ * Return -1 with errno set if anything fails.
  */
 int
 dba_write(const char *fname, struct dba *dba)
 {
-	int	 save_errno;
-	int32_t	 pos_end, pos_macros, pos_macros_ptr;
+	struct dba_array	*names;
+	int			 save_errno;
+	int32_t			 pos_end, pos_indexes, pos_macros;
+	int32_t			 pos_macros_ptr;
 
 	if (dba_open(fname) == -1)
 		return -1;
+	names = dba_array_new(128, DBA_GROW);
 	dba_int_write(MANDOCDB_MAGIC);
 	dba_int_write(MANDOCDB_VERSION);
 	pos_macros_ptr = dba_skip(1, 2);
-	dba_pages_write(dba->pages);
+	dba_pages_write(dba->pages, names);
+	dba->digest[1] = dba_section();
 	pos_macros = dba_tell();
-	dba_macros_write(dba->macros);
+	if (dba_macros_write(dba) == -1) {
+		save_errno = errno;
+		dba_array_free(names);
+		dba_close();
+		if (fname != NULL)
+			unlink(fname);
+		errno = save_errno;
+		return -1;
+	}
+	dba->digest[2] = dba_section();
+	pos_indexes = dba_tell();
+	dba_indexes_write(dba, names);
+	dba_int_write(pos_indexes);
 	pos_end = dba_tell();
 	dba_int_write(MANDOCDB_MAGIC);
 	dba_seek(pos_macros_ptr);
 	dba_int_write(pos_macros);
 	dba_int_write(pos_end);
+	dba_array_free(names);
 	if (dba_close() == -1) {
 		save_errno = errno;
 		unlink(fname);
@@ -264,13 +419,21 @@ prepend(const char *instr, char inbyte)
  *   file names.  The description for each page ends with a NUL byte.
  *   For all the other lists, each string ends with a NUL byte,
  *   and the last string for a page ends with two NUL bytes.
+ *   Pages having the same sections or architectures share one list.
+ *   The file names are front coded, see dba_files_writelst().
  * - To assure alignment of following integers,
  *   the end is padded with NUL bytes up to a multiple of four bytes.
+ * While writing, remember where each name went, for the names index.
  */
 static void
-dba_pages_write(struct dba_array *pages)
+dba_pages_write(struct dba_array *pages, struct dba_array *names)
 {
+	struct ohash		 lists;
 	struct dba_array	*page, *entry;
+	struct name_entry	*ne;
+	struct list_entry	*le;
+	const char		*name;
+	unsigned int		 slot;
 	int32_t			 pos_pages, pos_end;
 
 	pos_pages = dba_array_writelen(pages, 5);
@@ -278,29 +441,38 @@ dba_pages_write(struct dba_array *pages)
 		dba_array_setpos(page, DBP_NAME, dba_tell());
 		entry = dba_array_get(page, DBP_NAME);
 		dba_array_sort(entry, compare_names);
-		dba_array_writelst(entry);
-	}
-	dba_array_FOREACH(pages, page) {
-		dba_array_setpos(page, DBP_SECT, dba_tell());
-		entry = dba_array_get(page, DBP_SECT);
-		dba_array_sort(entry, compare_strings);
-		dba_array_writelst(entry);
+		dba_array_FOREACH(entry, name) {
+			ne = mandoc_malloc(sizeof(*ne));
+			ne->name = name;
+			ne->page = page;
+			ne->pos = dba_tell();
+			dba_array_add(names, ne);
+			dba_str_write(name);
+		}
+		dba_char_write('\0');
 	}
+	mandoc_ohash_init(&lists, 6, offsetof(struct list_entry, key));
+	dba_array_FOREACH(pages, page)
+		dba_array_setpos(page, DBP_SECT,
+		    dba_list_write(&lists, dba_array_get(page, DBP_SECT)));
 	dba_array_FOREACH(pages, page) {
-		if ((entry = dba_array_get(page, DBP_ARCH)) != NULL) {
-			dba_array_setpos(page, DBP_ARCH, dba_tell());
-			dba_array_sort(entry, compare_strings);
-			dba_array_writelst(entry);
-		} else
+		if ((entry = dba_array_get(page, DBP_ARCH)) != NULL)
+			dba_array_setpos(page, DBP_ARCH,
+			    dba_list_write(&lists, entry));
+		else
 			dba_array_setpos(page, DBP_ARCH, 0);
 	}
+	for (le = ohash_first(&lists, &slot); le != NULL;
+	     le = ohash_next(&lists, &slot))
+		free(le);
+	ohash_delete(&lists);
 	dba_array_FOREACH(pages, page) {
 		dba_array_setpos(page, DBP_DESC, dba_tell());
 		dba_str_write(dba_array_get(page, DBP_DESC));
 	}
 	dba_array_FOREACH(pages, page) {
 		dba_array_setpos(page, DBP_FILE, dba_tell());
-		dba_array_writelst(dba_array_get(page, DBP_FILE));
+		dba_files_writelst(dba_array_get(page, DBP_FILE));
 	}
 	pos_end = dba_align();
 	dba_seek(pos_pages);
@@ -309,6 +481,94 @@ dba_pages_write(struct dba_array *pages)
 	dba_seek(pos_end);
 }
 
+/*
+ * Sort a list of sections or architectures and write it to disk,
+ * unless an identical list was already written.
+ * Return the position of the list on disk.
+ */
+static int32_t
+dba_list_write(struct ohash *lists, struct dba_array *entry)
+{
+	static char		*key = NULL;
+	static size_t		 keysz = 0;
+	struct list_entry	*le;
+	const char		*str, *end;
+	size_t			 len, sz;
+	unsigned int		 slot;
+	int32_t			 pos;
+
+	dba_array_sort(entry, compare_strings);
+
+	/*
+	 * Build the lookup key.  Lists containing the separator
+	 * byte cannot be represented unambiguously and are
+	 * written out without looking for a copy.
+	 */
+
+	sz = 0;
+	dba_array_FOREACH(entry, str) {
+		if (strchr(str, '\001') != NULL) {
+			pos = dba_tell();
+			dba_array_writelst(entry);
+			return pos;
+		}
+		len = strlen(str);
+		if (sz + len + 2 > keysz) {
+			keysz = sz + len + 2 > 2 * keysz ?
+			    sz + len + 2 : 2 * keysz;
+			key = mandoc_realloc(key, keysz);
+		}
+		memcpy(key + sz, str, len);
+		sz += len;
+		key[sz++] = '\001';
+	}
+	if (key == NULL)
+		key = mandoc_malloc(keysz = 1);
+	key[sz] = '\0';
+
+	end = NULL;
+	slot = ohash_qlookupi(lists, key, &end);
+	if ((le = ohash_find(lists, slot)) != NULL)
+		return le->pos;
+	le = mandoc_malloc(sizeof(*le) + sz + 1);
+	memcpy(le->key, key, sz + 1);
+	le->pos = pos = dba_tell();
+	ohash_insert(lists, slot, le);
+	dba_array_writelst(entry);
+	return pos;
+}
+
+/*
+ * Write the file names of one page to disk.
+ * The first name is written in full, including the form byte.
+ * Each following name is preceded by a byte containing one plus
+ * the number of leading bytes it shares with the previous name,
+ * at most 254, and only the remaining bytes are written.
+ * Like any list, the names end with two NUL bytes.
+ */
+static void
+dba_files_writelst(struct dba_array *files)
+{
+	const char	*file, *prev;
+	size_t		 len;
+
+	prev = NULL;
+	dba_array_FOREACH(files, file) {
+		if (prev == NULL) {
+			dba_str_write(file);
+			prev = *file < ' ' ? file + 1 : file;
+			continue;
+		}
+		for (len = 0; len < 254 && file[len] != '\0' &&
+		    file[len] == prev[len]; len++)
+			continue;
+		dba_char_write(len + 1);
+		dba_str_write(file + len);
+		prev = file;
+	}
+	dba_char_write('\0');
+}
+
 static int
 compare_names(const void *vp1, const void *vp2)
 {
@@ -331,6 +591,40 @@ compare_strings(const void *vp1, const void *vp2)
 	return strcmp(cp1, cp2);
 }
 
+/*** functions for handling file fingerprints *************************/
+
+/*
+ * Remember the fingerprint of a file, replacing any earlier one.
+ */
+void
+dba_file_add(struct dba *dba, const char *name, const struct dba_fprint *fp)
+{
+	struct file_entry	*fe;
+	const char		*end;
+	unsigned int		 slot;
+
+	end = NULL;
+	slot = ohash_qlookupi(dba->files, name, &end);
+	if ((fe = ohash_find(dba->files, slot)) == NULL) {
+		fe = mandoc_malloc(sizeof(*fe) + (end - name) + 1);
+		memcpy(fe->name, name, (end - name) + 1);
+		ohash_insert(dba->files, slot, fe);
+	}
+	fe->fp = *fp;
+}
+
+/*
+ * Return the fingerprint of a file, or NULL if there is none.
+ */
+const struct dba_fprint *
+dba_file_get(struct dba *dba, const char *name)
+{
+	struct file_entry	*fe;
+
+	fe = ohash_find(dba->files, ohash_qlookup(dba->files, name));
+	return fe == NULL ? NULL : &fe->fp;
+}
+
 /*** functions for handling macros ************************************/
 
 /*
@@ -338,12 +632,14 @@ compare_strings(const void *vp1, const void *vp2)
  * the macro value or add an empty one if it doesn't exist yet.
  */
 static struct macro_entry *
-get_macro_entry(struct ohash *macro, const char *value, int32_t np)
+get_macro_entry(struct dba *dba, int32_t im, const char *value, int32_t np)
 {
+	struct ohash		*macro;
 	struct macro_entry	*entry;
 	size_t			 len;
 	unsigned int		 slot;
 
+	macro = dba_array_get(dba->macros, im);
 	slot = ohash_qlookup(macro, value);
 	if ((entry = ohash_find(macro, slot)) == NULL) {
 		len = strlen(value) + 1;
@@ -351,6 +647,7 @@ get_macro_entry(struct ohash *macro, const char *value, int32_t np)
 		memcpy(&entry->value, value, len);
 		entry->pages = dba_array_new(np, DBA_GROW);
 		ohash_insert(macro, slot, entry);
+		dba->msize += sizeof(*entry) + len + 64;
 	}
 	return entry;
 }
@@ -359,8 +656,9 @@ get_macro_entry(struct ohash *macro, const char *value, int32_t np)
  * In addition to get_macro_entry(), add multiple page references,
  * converting them from the on-disk format (byte offsets in the file)
  * to page pointers in memory.
+ * Return -1 with errno set if spilling the tables to disk fails.
  */
-void
+int
 dba_macro_new(struct dba *dba, int32_t im, const char *value,
     const int32_t *pp)
 {
@@ -372,26 +670,114 @@ dba_macro_new(struct dba *dba, int32_t im, const char *value,
 	for (ip = pp; *ip; ip++)
 		np++;
 
-	entry = get_macro_entry(dba_array_get(dba->macros, im), value, np);
+	entry = get_macro_entry(dba, im, value, np);
 	for (ip = pp; *ip; ip++)
 		dba_array_add(entry->pages, dba_array_get(dba->pages,
 		    be32toh(*ip) / 5 / sizeof(*ip) - 1));
+	dba->msize += np * (sizeof(void *) + sizeof(int32_t));
+	return dba->msize > MACRO_MEM_MAX ? dba_macros_spill(dba) : 0;
 }
 
 /*
  * In addition to get_macro_entry(), add one page reference,
  * directly taking the in-memory page pointer as an argument.
+ * Return -1 with errno set if spilling the tables to disk fails.
  */
-void
-dba_macro_add(struct dba_array *macros, int32_t im, const char *value,
+int
+dba_macro_add(struct dba *dba, int32_t im, const char *value,
     struct dba_array *page)
 {
 	struct macro_entry	*entry;
 
 	if (*value == '\0')
-		return;
-	entry = get_macro_entry(dba_array_get(macros, im), value, 1);
+		return 0;
+	entry = get_macro_entry(dba, im, value, 1);
 	dba_array_add(entry->pages, page);
+	dba->msize += sizeof(void *) + sizeof(int32_t);
+	return dba->msize > MACRO_MEM_MAX ? dba_macros_spill(dba) : 0;
+}
+
+/*
+ * Write all macro tables to a temporary file as one sorted run
+ * and empty them, such that their memory use stays bounded.
+ * If that fails, return -1 with errno set and leave the tables
+ * in memory as they are, to be retried when they grew again.
+ */
+static int
+dba_macros_spill(struct dba *dba)
+{
+	struct macro_run	 *run;
+	struct macro_entry	**entries, *entry;
+	struct ohash		 *macro;
+	unsigned int		  ne, slot;
+	int32_t			  im;
+	int			  irc, save_errno;
+
+	dba->msize = 0;
+	run = mandoc_malloc(sizeof(*run));
+	if ((run->fp = tmpfile()) == NULL) {
+		free(run);
+		return -1;
+	}
+	for (im = 0; im < MACRO_MAX; im++) {
+		entries = macro_sort(dba_array_get(dba->macros, im), &ne);
+		run->ne[im] = ne;
+		irc = (run->off[im] = ftell(run->fp)) == -1 ? -1 :
+		    macro_run_write(run->fp, entries, ne);
+		free(entries);
+		if (irc == -1)
+			goto fail;
+	}
+	if (fflush(run->fp) == EOF)
+		goto fail;
+
+	/* Only empty the tables once the run is complete. */
+
+	for (im = 0; im < MACRO_MAX; im++) {
+		macro = dba_array_get(dba->macros, im);
+		for (entry = ohash_first(macro, &slot); entry != NULL;
+		     entry = ohash_next(macro, &slot)) {
+			dba_array_free(entry->pages);
+			free(entry);
+		}
+		ohash_delete(macro);
+		mandoc_ohash_init(macro, 4,
+		    offsetof(struct macro_entry, value));
+	}
+	dba_array_add(dba->runs, run);
+	return 0;
+
+fail:
+	save_errno = errno;
+	fclose(run->fp);
+	free(run);
+	errno = save_errno;
+	return -1;
+}
+
+/*
+ * Write the sorted entries of one macro table to a run.
+ */
+static int
+macro_run_write(FILE *fp, struct macro_entry **entries, unsigned int ne)
+{
+	struct dba_array	*page;
+	unsigned int		 ie;
+	int32_t			 np;
+
+	for (ie = 0; ie < ne; ie++) {
+		np = 0;
+		dba_array_FOREACH(entries[ie]->pages, page)
+			np++;
+		if (fputs(entries[ie]->value, fp) == EOF ||
+		    putc('\0', fp) == EOF ||
+		    fwrite(&np, sizeof(np), 1, fp) != 1)
+			return -1;
+		dba_array_FOREACH(entries[ie]->pages, page)
+			if (fwrite(&page, sizeof(page), 1, fp) != 1)
+				return -1;
+	}
+	return 0;
 }
 
 /*
@@ -400,22 +786,32 @@ dba_macro_add(struct dba_array *macros, int32_t im, const char *value,
  * - That number of pointers to the individual macro tables.
  * - The individual macro tables.
  */
-static void
-dba_macros_write(struct dba_array *macros)
+static int
+dba_macros_write(struct dba *dba)
 {
-	struct ohash		*macro;
 	int32_t			 im, pos_macros, pos_end;
 
-	pos_macros = dba_array_writelen(macros, 1);
-	im = 0;
-	dba_array_FOREACH(macros, macro) {
-		dba_array_setpos(macros, im++, dba_tell());
-		dba_macro_write(macro);
+	/* If anything was spilled, everything needs to be on disk. */
+
+	if (dba_array_get(dba->runs, 0) != NULL) {
+		for (im = 0; im < MACRO_MAX; im++)
+			if (ohash_entries(dba_array_get(dba->macros, im)))
+				break;
+		if (im < MACRO_MAX && dba_macros_spill(dba) == -1)
+			return -1;
+	}
+
+	pos_macros = dba_array_writelen(dba->macros, 1);
+	for (im = 0; im < MACRO_MAX; im++) {
+		dba_array_setpos(dba->macros, im, dba_tell());
+		if (dba_macro_write(dba, im) == -1)
+			return -1;
 	}
 	pos_end = dba_tell();
 	dba_seek(pos_macros);
-	dba_array_writepos(macros);
+	dba_array_writepos(dba->macros);
 	dba_seek(pos_end);
+	return 0;
 }
 
 /*
@@ -427,82 +823,731 @@ dba_macros_write(struct dba_array *macros)
  * - To assure alignment of following integers,
  *   padding with NUL bytes up to a multiple of four bytes.
  * - A list of pointers to pages, each list ending in a 0 integer.
+ * Entries without any pages left are omitted.  To avoid keeping
+ * the table in memory, it is read four times, once to count
+ * and once for each of the three parts.
+ * Return -1 with errno set if reading the runs fails.
  */
-static void
-dba_macro_write(struct ohash *macro)
+static int
+dba_macro_write(struct dba *dba, int32_t im)
 {
-	struct macro_entry	**entries, *entry;
-	struct dba_array	 *page;
-	int32_t			 *kpos, *dpos;
-	unsigned int		  ie, ne, slot;
-	int			  use;
-	int32_t			  addr, pos_macro, pos_end;
+	struct macro_iter	 it;
+	int32_t			 ip, ne, np, strsz;
+	int32_t			 kpos, dpos;
 
-	/* Temporary storage for filtering and sorting. */
+	/* Count the non-empty entries and the string table size. */
 
-	ne = ohash_entries(macro);
-	entries = mandoc_reallocarray(NULL, ne, sizeof(*entries));
-	kpos = mandoc_reallocarray(NULL, ne, sizeof(*kpos));
-	dpos = mandoc_reallocarray(NULL, ne, sizeof(*dpos));
-
-	/* Build a list of non-empty entries and sort it. */
-
-	ne = 0;
-	for (entry = ohash_first(macro, &slot); entry != NULL;
-	     entry = ohash_next(macro, &slot)) {
-		use = 0;
-		dba_array_FOREACH(entry->pages, page)
-			if (dba_array_getpos(page))
-				use = 1;
-		if (use)
-			entries[ne++] = entry;
+	macro_iter_start(&it, dba, im);
+	ne = strsz = 0;
+	while (macro_iter_next(&it)) {
+		for (ip = 0; ip < it.np; ip++)
+			if (dba_array_getpos(it.pages[ip]))
+				break;
+		if (ip == it.np)
+			continue;
+		ne++;
+		strsz += strlen(it.value) + 1;
 	}
-	qsort(entries, ne, sizeof(*entries), compare_entries);
 
-	/* Number of entries, and space for the pointer pairs. */
+	/* Number of entries, and the pointer pairs. */
 
 	dba_int_write(ne);
-	pos_macro = dba_skip(2, ne);
+	kpos = dba_tell() + ne * 2 * sizeof(int32_t);
+	dpos = (kpos + strsz + 3) & ~3;
+	macro_iter_rewind(&it);
+	while (macro_iter_next(&it)) {
+		np = 0;
+		for (ip = 0; ip < it.np; ip++)
+			if (dba_array_getpos(it.pages[ip]))
+				np++;
+		if (np == 0)
+			continue;
+		dba_int_write(kpos);
+		dba_int_write(dpos);
+		kpos += strlen(it.value) + 1;
+		dpos += (np + 1) * sizeof(int32_t);
+	}
 
 	/* String table. */
 
-	for (ie = 0; ie < ne; ie++) {
-		kpos[ie] = dba_tell();
-		dba_str_write(entries[ie]->value);
+	macro_iter_rewind(&it);
+	while (macro_iter_next(&it)) {
+		for (ip = 0; ip < it.np; ip++)
+			if (dba_array_getpos(it.pages[ip]))
+				break;
+		if (ip < it.np)
+			dba_str_write(it.value);
 	}
 	dba_align();
 
 	/* Pages table. */
 
+	macro_iter_rewind(&it);
+	while (macro_iter_next(&it)) {
+		np = 0;
+		for (ip = 0; ip < it.np; ip++) {
+			if (dba_array_getpos(it.pages[ip])) {
+				dba_int_write(dba_array_getpos(it.pages[ip]));
+				np++;
+			}
+		}
+		if (np)
+			dba_int_write(0);
+	}
+	return macro_iter_end(&it);
+}
+
+/*
+ * Return the entries of a macro table in memory, sorted by value.
+ */
+static struct macro_entry **
+macro_sort(struct ohash *macro, unsigned int *ne)
+{
+	struct macro_entry	**entries, *entry;
+	unsigned int		  slot;
+
+	entries = mandoc_reallocarray(NULL, ohash_entries(macro) + 1,
+	    sizeof(*entries));
+	*ne = 0;
+	for (entry = ohash_first(macro, &slot); entry != NULL;
+	     entry = ohash_next(macro, &slot))
+		entries[(*ne)++] = entry;
+	qsort(entries, *ne, sizeof(*entries), compare_entries);
+	return entries;
+}
+
+static int
+compare_entries(const void *vp1, const void *vp2)
+{
+	const struct macro_entry *ep1, *ep2;
+
+	ep1 = *(const struct macro_entry * const *)vp1;
+	ep2 = *(const struct macro_entry * const *)vp2;
+	return strcmp(ep1->value, ep2->value);
+}
+
+static void
+macro_iter_start(struct macro_iter *it, struct dba *dba, int32_t im)
+{
+	struct macro_run	*run;
+
+	memset(it, 0, sizeof(*it));
+	it->im = im;
+	dba_array_FOREACH(dba->runs, run)
+		it->ncur++;
+	if (it->ncur == 0) {
+		it->entries = macro_sort(dba_array_get(dba->macros, im),
+		    &it->ne);
+		return;
+	}
+	it->cur = mandoc_calloc(it->ncur, sizeof(*it->cur));
+	it->ncur = 0;
+	dba_array_FOREACH(dba->runs, run)
+		it->cur[it->ncur++].run = run;
+	macro_iter_rewind(it);
+}
+
+/*
+ * After a read error, the iterator behaves as if the table
+ * was at its end, and macro_iter_end() reports the error.
+ */
+static void
+macro_iter_rewind(struct macro_iter *it)
+{
+	struct macro_cursor	*cur;
+	int32_t			 ic;
+
+	it->ie = 0;
+	for (ic = 0; ic < it->ncur && it->error == 0; ic++) {
+		cur = it->cur + ic;
+		cur->left = cur->run->ne[it->im];
+		if (fseek(cur->run->fp, cur->run->off[it->im],
+		    SEEK_SET) == -1 || macro_cursor_read(cur) == -1)
+			it->error = errno;
+	}
+}
+
+/*
+ * Advance to the next value.  Its pages are in it->pages.
+ * Return 0 at the end of the table.
+ */
+static int
+macro_iter_next(struct macro_iter *it)
+{
+	struct macro_cursor	*cur;
+	const char		*value;
+	struct dba_array	*page;
+	size_t			 len;
+	int32_t			 ic;
+
+	it->np = 0;
+	if (it->error)
+		return 0;
+	if (it->ncur == 0) {
+		if (it->ie == it->ne)
+			return 0;
+		it->value = it->entries[it->ie]->value;
+		dba_array_FOREACH(it->entries[it->ie]->pages, page) {
+			if (it->np == it->maxnp) {
+				it->maxnp = it->maxnp ? it->maxnp * 2 : 16;
+				it->pages = mandoc_reallocarray(it->pages,
+				    it->maxnp, sizeof(*it->pages));
+			}
+			it->pages[it->np++] = page;
+		}
+		it->ie++;
+		return 1;
+	}
+
+	/* Find the smallest value and combine all its runs. */
+
+	value = NULL;
+	for (ic = 0; ic < it->ncur; ic++)
+		if (it->cur[ic].value != NULL && (value == NULL ||
+		    strcmp(it->cur[ic].value, value) < 0))
+			value = it->cur[ic].value;
+	if (value == NULL)
+		return 0;
+	len = strlen(value) + 1;
+	if (len > it->valsz) {
+		it->valsz = len;
+		it->value = mandoc_realloc(it->value, len);
+	}
+	memcpy(it->value, value, len);
+	for (ic = 0; ic < it->ncur; ic++) {
+		cur = it->cur + ic;
+		if (cur->value == NULL || strcmp(cur->value, it->value))
+			continue;
+		if (it->np + cur->np > it->maxnp) {
+			it->maxnp = it->np + cur->np;
+			it->pages = mandoc_reallocarray(it->pages,
+			    it->maxnp, sizeof(*it->pages));
+		}
+		memcpy(it->pages + it->np, cur->pages,
+		    cur->np * sizeof(*cur->pages));
+		it->np += cur->np;
+		if (macro_cursor_read(cur) == -1)
+			it->error = errno;
+	}
+	return 1;
+}
+
+/*
+ * Free the iterator.  Return -1 with errno set
+ * if any read failed while iterating.
+ */
+static int
+macro_iter_end(struct macro_iter *it)
+{
+	int32_t		 ic;
+
+	for (ic = 0; ic < it->ncur; ic++) {
+		free(it->cur[ic].value);
+		free(it->cur[ic].pages);
+	}
+	free(it->cur);
+	if (it->ncur > 0)
+		free(it->value);
+	free(it->entries);
+	free(it->pages);
+	if (it->error == 0)
+		return 0;
+	errno = it->error;
+	return -1;
+}
+
+/*
+ * Read the next entry of one run,
+ * or set the value to NULL at the end of the table.
+ * Return -1 with errno set on read errors.
+ */
+static int
+macro_cursor_read(struct macro_cursor *cur)
+{
+	size_t		 len;
+	int		 c;
+
+	if (cur->left == 0) {
+		free(cur->value);
+		cur->value = NULL;
+		cur->valsz = 0;
+		return 0;
+	}
+	cur->left--;
+	len = 0;
+	do {
+		if ((c = getc(cur->run->fp)) == EOF)
+			goto fail;
+		if (len == cur->valsz) {
+			cur->valsz = cur->valsz ? cur->valsz * 2 : 64;
+			cur->value = mandoc_realloc(cur->value, cur->valsz);
+		}
+		cur->value[len++] = c;
+	} while (c != '\0');
+	if (fread(&cur->np, sizeof(cur->np), 1, cur->run->fp) != 1)
+		goto fail;
+	if (cur->np > cur->maxnp) {
+		cur->maxnp = cur->np;
+		cur->pages = mandoc_reallocarray(cur->pages,
+		    cur->maxnp, sizeof(*cur->pages));
+	}
+	if (cur->np > 0 && fread(cur->pages, sizeof(*cur->pages),
+	    cur->np, cur->run->fp) != (size_t)cur->np)
+		goto fail;
+	return 0;
+
+fail:
+	/* A truncated run is an I/O error, too. */
+	if (!ferror(cur->run->fp))
+		errno = EIO;
+	return -1;
+}
+
+
+/*** functions for handling indexes ***********************************/
+
+/*
+ * Write the table of indexes to disk; the format is:
+ * - The number of indexes (actually, INDEX_MAX).
+ * - That number of pointers to the individual indexes.
+ * - The individual indexes.
+ */
+static void
+dba_indexes_write(struct dba *dba, struct dba_array *names)
+{
+	int32_t		 pos[INDEX_MAX];
+	int32_t		 ix, pos_indexes, pos_end;
+
+	dba_int_write(INDEX_MAX);
+	pos_indexes = dba_skip(1, INDEX_MAX);
+	pos[INDEX_NAME] = dba_tell();
+	dba_names_write(names);
+	dba->digest[3 + INDEX_NAME] = dba_section();
+	pos[INDEX_TRIGRAM] = dba_tell();
+	if (dba->fopts != -1 && dba->fopts & DBOPT_TRIGRAM)
+		dba_trigrams_write(dba->pages);
+	else
+		dba_int_write(0);
+	dba->digest[3 + INDEX_TRIGRAM] = dba_section();
+	pos[INDEX_XREF] = dba_tell();
+	dba_xrefs_write(dba);
+	dba->digest[3 + INDEX_XREF] = dba_section();
+	pos[INDEX_FILE] = dba_tell();
+	dba_files_write(dba);
+	dba->digest[3 + INDEX_FILE] = dba_section();
+	dba->digest[0] = dba_digest();
+	pos[INDEX_DIGEST] = dba_tell();
+	dba_digests_write(dba);
+	pos_end = dba_tell();
+	dba_seek(pos_indexes);
+	for (ix = 0; ix < INDEX_MAX; ix++)
+		dba_int_write(pos[ix]);
+	dba_seek(pos_end);
+}
+
+/*
+ * Write the names index to disk; the format is:
+ * - The number of entries in the index.
+ * - For each entry, two pointers, the first one to a name
+ *   in the pages table, pointing to its class byte,
+ *   and the second one to the page having that name.
+ * The entries are sorted by name, ignoring case.
+ */
+static void
+dba_names_write(struct dba_array *names)
+{
+	struct name_entry	*entry;
+	int32_t			 ne;
+
+	dba_array_sort(names, compare_name_entries);
+	ne = 0;
+	dba_array_FOREACH(names, entry)
+		ne++;
+	dba_int_write(ne);
+	dba_array_FOREACH(names, entry) {
+		dba_int_write(entry->pos);
+		dba_int_write(dba_array_getpos(entry->page));
+		free(entry);
+	}
+}
+
+static int
+compare_name_entries(const void *vp1, const void *vp2)
+{
+	const struct name_entry	*ep1, *ep2;
+	int			 diff;
+
+	ep1 = *(const struct name_entry * const *)vp1;
+	ep2 = *(const struct name_entry * const *)vp2;
+	if ((diff = strcasecmp(ep1->name + 1, ep2->name + 1)) != 0)
+		return diff;
+	if ((diff = dba_array_getpos(ep1->page) -
+	    dba_array_getpos(ep2->page)) != 0)
+		return diff;
+	return ep1->pos - ep2->pos;
+}
+
+/*
+ * Write the trigram index to disk; the format is:
+ * - The number of entries in the index.
+ * - For each entry, the value of the trigram
+ *   and one pointer to the list of pages.
+ * - For each entry, a list of pointers to pages,
+ *   in the order of the pages table, ending in a 0 integer.
+ * The entries are sorted by the value of the trigram.
+ * Only trigrams taken from names and descriptions are indexed.
+ * Since the index is bigger than the pages table, an empty one
+ * is written instead unless makewhatis -i was given.
+ */
+static void
+dba_trigrams_write(struct dba_array *pages)
+{
+	struct ohash		  trigrams;
+	struct trigram_entry	**entries, *entry;
+	struct dba_array	 *page, *entry_names;
+	const char		 *name;
+	unsigned int		  ie, ne, slot;
+	int32_t			  pos_trigrams, pos_end;
+
+	mandoc_ohash_init(&trigrams, 12,
+	    offsetof(struct trigram_entry, key));
+	dba_array_FOREACH(pages, page) {
+		entry_names = dba_array_get(page, DBP_NAME);
+		dba_array_FOREACH(entry_names, name)
+			trigram_add(&trigrams, page, name + 1);
+		trigram_add(&trigrams, page, dba_array_get(page, DBP_DESC));
+	}
+
+	ne = ohash_entries(&trigrams);
+	entries = mandoc_reallocarray(NULL, ne, sizeof(*entries));
+	ne = 0;
+	for (entry = ohash_first(&trigrams, &slot); entry != NULL;
+	     entry = ohash_next(&trigrams, &slot))
+		entries[ne++] = entry;
+	ohash_delete(&trigrams);
+	qsort(entries, ne, sizeof(*entries), compare_trigram_entries);
+
+	dba_int_write(ne);
+	pos_trigrams = dba_skip(2, ne);
 	for (ie = 0; ie < ne; ie++) {
-		dpos[ie] = dba_tell();
-		dba_array_FOREACH(entries[ie]->pages, page)
-			if ((addr = dba_array_getpos(page)))
-				dba_int_write(addr);
+		entry = entries[ie];
+		entry->pos = dba_tell();
+		dba_array_FOREACH(entry->pages, page)
+			dba_int_write(dba_array_getpos(page));
 		dba_int_write(0);
+		dba_array_free(entry->pages);
 	}
 	pos_end = dba_tell();
+	dba_seek(pos_trigrams);
+	for (ie = 0; ie < ne; ie++) {
+		entry = entries[ie];
+		dba_int_write(TRIGRAM_VALUE(entry->key));
+		dba_int_write(entry->pos);
+		free(entry);
+	}
+	dba_seek(pos_end);
+	free(entries);
+}
 
-	/* Fill in the pointer pairs. */
+/*
+ * Add the page to the list of pages of each trigram in the string.
+ */
+static void
+trigram_add(struct ohash *trigrams, struct dba_array *page, const char *cp)
+{
+	struct trigram_entry	*entry;
+	const char		*end;
+	char			 key[4];
+	unsigned int		 slot;
 
-	dba_seek(pos_macro);
-	for (ie = 0; ie < ne; ie++) {
-		dba_int_write(kpos[ie]);
-		dba_int_write(dpos[ie]);
+	for (; cp[0] != '\0' && cp[1] != '\0' && cp[2] != '\0'; cp++) {
+		if (TRIGRAM_CHAR(cp[2]) == 0) {
+			cp += 2;
+			continue;
+		}
+		if (TRIGRAM_CHAR(cp[1]) == 0) {
+			cp++;
+			continue;
+		}
+		if (TRIGRAM_CHAR(cp[0]) == 0)
+			continue;
+		key[0] = TRIGRAM_FOLD(cp[0]);
+		key[1] = TRIGRAM_FOLD(cp[1]);
+		key[2] = TRIGRAM_FOLD(cp[2]);
+		key[3] = '\0';
+		end = key + 3;
+		slot = ohash_qlookupi(trigrams, key, &end);
+		if ((entry = ohash_find(trigrams, slot)) == NULL) {
+			entry = mandoc_malloc(sizeof(*entry));
+			entry->pages = dba_array_new(4, DBA_GROW);
+			entry->last = NULL;
+			memcpy(entry->key, key, sizeof(entry->key));
+			ohash_insert(trigrams, slot, entry);
+		}
+		if (entry->last != page) {
+			dba_array_add(entry->pages, page);
+			entry->last = page;
+		}
+	}
+}
+
+static int
+compare_trigram_entries(const void *vp1, const void *vp2)
+{
+	const struct trigram_entry *ep1, *ep2;
+
+	ep1 = *(const struct trigram_entry * const *)vp1;
+	ep2 = *(const struct trigram_entry * const *)vp2;
+	return TRIGRAM_VALUE(ep1->key) - TRIGRAM_VALUE(ep2->key);
+}
+
+/*
+ * Write the cross reference index to disk; the format is:
+ * - The number of entries in the index.
+ * - For each entry, one pointer to a referenced page
+ *   and one pointer to the list of pages referring to it.
+ * - For each entry, a list of pointers to pages,
+ *   in the order of the pages table, ending in a 0 integer.
+ * The entries are sorted by the position of the referenced page.
+ * An .Xr macro refers to all pages having its first argument
+ * as a name, ignoring case, and its second argument, if any,
+ * as a section.  References of pages to themselves are omitted.
+ */
+static void
+dba_xrefs_write(struct dba *dba)
+{
+	struct ohash		  names;
+	struct xref_name	 *xn;
+	struct xref_pair	 *pairs;
+	struct macro_iter	  it;
+	struct dba_array	 *page, *target, *entry_names;
+	const char		 *name, *sect, *end;
+	char			 *key;
+	size_t			  len, ip, ir, np, maxp;
+	int32_t			  ipage;
+	unsigned int		  slot;
+	int32_t			 *lpos;
+	int32_t			  to, from, ie, ne, pos_xrefs, pos_end;
+
+	/* Look up pages by name; names only in the SYNOPSIS don't count. */
+
+	mandoc_ohash_init(&names, 8, offsetof(struct xref_name, key));
+	dba_array_FOREACH(dba->pages, page) {
+		entry_names = dba_array_get(page, DBP_NAME);
+		dba_array_FOREACH(entry_names, name) {
+			if (*name <= (char)(NAME_SYN & NAME_MASK))
+				continue;
+			len = strlen(name + 1);
+			key = xref_key(name + 1, len);
+			end = key + len;
+			slot = ohash_qlookupi(&names, key, &end);
+			if ((xn = ohash_find(&names, slot)) == NULL) {
+				xn = mandoc_malloc(sizeof(*xn) + len + 1);
+				xn->pages = dba_array_new(1, DBA_GROW);
+				xn->last = NULL;
+				memcpy(xn->key, key, len + 1);
+				ohash_insert(&names, slot, xn);
+			}
+			if (xn->last != page) {
+				dba_array_add(xn->pages, page);
+				xn->last = page;
+			}
+			free(key);
+		}
+	}
+
+	/* Resolve the .Xr values to pairs of pages. */
+
+	pairs = NULL;
+	np = maxp = 0;
+	macro_iter_start(&it, dba, KEY_Xr - 2);
+	while (macro_iter_next(&it)) {
+		len = strlen(it.value);
+		sect = NULL;
+		if (len > 2 && it.value[len - 1] == ')' &&
+		    (sect = strrchr(it.value, '(')) != NULL &&
+		    sect > it.value) {
+			len = sect - it.value;
+			sect++;
+		} else
+			sect = NULL;
+		key = xref_key(it.value, len);
+		end = key + len;
+		xn = ohash_find(&names, ohash_qlookupi(&names, key, &end));
+		free(key);
+		if (xn == NULL)
+			continue;
+		dba_array_FOREACH(xn->pages, target) {
+			if ((to = dba_array_getpos(target)) == 0 ||
+			    (sect != NULL && xref_sect(target, sect) == 0))
+				continue;
+			for (ipage = 0; ipage < it.np; ipage++) {
+				if ((from = dba_array_getpos(it.pages[ipage]))
+				    == 0 || from == to)
+					continue;
+				if (np == maxp) {
+					maxp = maxp ? maxp * 2 : 1024;
+					pairs = mandoc_reallocarray(pairs,
+					    maxp, sizeof(*pairs));
+				}
+				pairs[np].to = to;
+				pairs[np].from = from;
+				np++;
+			}
+		}
+	}
+	macro_iter_end(&it);
+	for (xn = ohash_first(&names, &slot); xn != NULL;
+	     xn = ohash_next(&names, &slot)) {
+		dba_array_free(xn->pages);
+		free(xn);
+	}
+	ohash_delete(&names);
+
+	/* Sort the pairs and drop duplicates. */
+
+	if (np > 0)
+		qsort(pairs, np, sizeof(*pairs), compare_xref_pairs);
+	ne = 0;
+	for (ip = ir = 0; ip < np; ip++) {
+		if (ir > 0 && pairs[ip].to == pairs[ir - 1].to &&
+		    pairs[ip].from == pairs[ir - 1].from)
+			continue;
+		if (ir == 0 || pairs[ip].to != pairs[ir - 1].to)
+			ne++;
+		pairs[ir++] = pairs[ip];
+	}
+	np = ir;
+
+	/* Write the index. */
+
+	dba_int_write(ne);
+	pos_xrefs = dba_skip(2, ne);
+	lpos = mandoc_reallocarray(NULL, ne, sizeof(*lpos));
+	for (ip = 0, ie = 0; ip < np; ip++) {
+		if (ip > 0 && pairs[ip].to != pairs[ip - 1].to)
+			dba_int_write(0);
+		if (ip == 0 || pairs[ip].to != pairs[ip - 1].to)
+			lpos[ie++] = dba_tell();
+		dba_int_write(pairs[ip].from);
+	}
+	if (np > 0)
+		dba_int_write(0);
+	pos_end = dba_tell();
+	dba_seek(pos_xrefs);
+	for (ip = 0, ie = 0; ip < np; ip++) {
+		if (ip > 0 && pairs[ip].to == pairs[ip - 1].to)
+			continue;
+		dba_int_write(pairs[ip].to);
+		dba_int_write(lpos[ie++]);
 	}
 	dba_seek(pos_end);
+	free(lpos);
+	free(pairs);
+}
 
-	free(entries);
-	free(kpos);
-	free(dpos);
+/*
+ * Return a copy of the first len bytes of the name,
+ * converted to lower case.
+ */
+static char *
+xref_key(const char *name, size_t len)
+{
+	char	*key;
+	size_t	 i;
+
+	key = mandoc_malloc(len + 1);
+	for (i = 0; i < len; i++)
+		key[i] = tolower((unsigned char)name[i]);
+	key[len] = '\0';
+	return key;
 }
 
+/*
+ * Return 1 if the page is in the given section, ignoring case.
+ */
 static int
-compare_entries(const void *vp1, const void *vp2)
+xref_sect(struct dba_array *page, const char *sect)
 {
-	const struct macro_entry *ep1, *ep2;
+	struct dba_array	*entry;
+	const char		*have;
+	size_t			 len;
 
-	ep1 = *(const struct macro_entry * const *)vp1;
-	ep2 = *(const struct macro_entry * const *)vp2;
-	return strcmp(ep1->value, ep2->value);
+	len = strlen(sect) - 1;		/* Without the closing parenthesis. */
+	entry = dba_array_get(page, DBP_SECT);
+	dba_array_FOREACH(entry, have)
+		if (strncasecmp(have, sect, len) == 0 && have[len] == '\0')
+			return 1;
+	return 0;
+}
+
+static int
+compare_xref_pairs(const void *vp1, const void *vp2)
+{
+	const struct xref_pair	*pp1, *pp2;
+
+	pp1 = vp1;
+	pp2 = vp2;
+	return pp1->to != pp2->to ? pp1->to - pp2->to :
+	    pp1->from - pp2->from;
+}
+
+/*
+ * Write the file fingerprints index to disk; the format is:
+ * - The options the database was built with.
+ * - The number of entries in the index.
+ * - For each entry, the inode number, size, modification time,
+ *   and content hash of the file.
+ * There is one entry for each file name in the pages table,
+ * in the same order, such that the names need not be repeated.
+ * Files without a fingerprint get an entry of four zeros.
+ */
+static void
+dba_files_write(struct dba *dba)
+{
+	struct file_entry	*fe;
+	struct dba_array	*page;
+	const char		*file;
+	int32_t			 ne;
+
+	ne = 0;
+	dba_array_FOREACH(dba->pages, page) {
+		dba_array_FOREACH(dba_array_get(page, DBP_FILE), file)
+			ne++;
+	}
+
+	dba_int_write(dba->fopts);
+	dba_int_write(ne);
+	dba_array_FOREACH(dba->pages, page) {
+		dba_array_FOREACH(dba_array_get(page, DBP_FILE), file) {
+			if (*file < ' ')
+				file++;
+			fe = ohash_find(dba->files,
+			    ohash_qlookup(dba->files, file));
+			dba_int_write(fe == NULL ? 0 : fe->fp.ino);
+			dba_int_write(fe == NULL ? 0 : fe->fp.size);
+			dba_int_write(fe == NULL ? 0 : fe->fp.mtime);
+			dba_int_write(fe == NULL ? 0 : fe->fp.hash);
+		}
+	}
+}
+
+/*
+ * Write the digests index to disk; the format is:
+ * - The number of digests (actually, DIGEST_MAX).
+ * - For each digest, two integers, the high and the low 32 bits.
+ * The first digest covers everything written before the index,
+ * the others cover the pages table, the macros table,
+ * and each index before this one.
+ */
+static void
+dba_digests_write(struct dba *dba)
+{
+	int		 id;
+
+	dba_int_write(DIGEST_MAX);
+	for (id = 0; id < DIGEST_MAX; id++) {
+		dba_int_write(dba->digest[id] >> 32);
+		dba_int_write(dba->digest[id] & 0xffffffff);
+	}
 }
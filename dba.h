@@ -26,11 +26,31 @@
 #define	DBP_FILE	4
 #define	DBP_MAX		5
 
+/* Options affecting the database content, stored in the database. */
+#define	DBOPT_QUICK	0x01 /* -Q */
+#define	DBOPT_UTF8	0x02 /* -T utf8 */
+#define	DBOPT_ALL	0x04 /* -a */
+#define	DBOPT_TRIGRAM	0x08 /* -i */
+#define	DBOPT_VERSION	0x7fffff00 /* hash of the mandoc version */
+
 struct dba_array;
+struct ohash;
 
 struct dba {
 	struct dba_array	*pages;
 	struct dba_array	*macros;
+	struct ohash		*files;	/* Fingerprints by file name. */
+	struct dba_array	*runs;	/* Macro tables spilled to disk. */
+	size_t			 msize;	/* Memory used by macro tables. */
+	int32_t			 fopts;	/* Options used for building. */
+	uint64_t		 digest[DIGEST_MAX]; /* Of dba_write(). */
+};
+
+struct dba_fprint {
+	int32_t			 ino;	/* Low bits of the inode number. */
+	int32_t			 size;	/* Low bits of the file size. */
+	int32_t			 mtime;	/* Low bits of the mtime. */
+	int32_t			 hash;	/* Hash of the file content. */
 };
 
 
@@ -44,7 +64,11 @@ struct dba_array *dba_page_new(struct dba_array *, const char *,
 void		 dba_page_add(struct dba_array *, int32_t, const char *);
 void		 dba_page_alias(struct dba_array *, const char *, uint64_t);
 
-void		 dba_macro_new(struct dba *, int32_t,
+void		 dba_file_add(struct dba *, const char *,
+			const struct dba_fprint *);
+const struct dba_fprint *dba_file_get(struct dba *, const char *);
+
+int		 dba_macro_new(struct dba *, int32_t,
 			const char *, const int32_t *);
-void		 dba_macro_add(struct dba_array *, int32_t,
+int		 dba_macro_add(struct dba *, int32_t,
 			const char *, struct dba_array *);
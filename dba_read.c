@@ -21,6 +21,8 @@
  */
 #include "config.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <regex.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -33,42 +35,107 @@
 #include "dba.h"
 #include "dbm.h"
 
+static void	 fprint_add(struct dba *, struct dbm *, int32_t,
+			const char *);
+
 
 struct dba *
 dba_read(const char *fname)
 {
+	char			 file[PATH_MAX];
 	struct dba		*dba;
 	struct dba_array	*page;
-	struct dbm_page		*pdata;
-	struct dbm_macro	*mdata;
+	struct dbm		*db;
+	struct dbm_page		 pdata;
+	struct dbm_macro	 mdata;
+	struct dbm_file		 fdata;
 	const char		*cp;
-	int32_t			 im, ip, iv, npages;
+	size_t			 len;
+	int32_t			 ifile, im, ip, iv, npages, version;
+	int			 save_errno;
 
-	if (dbm_open(fname) == -1)
+	if ((db = dbm_open(fname)) == NULL)
 		return NULL;
-	npages = dbm_page_count();
+	npages = dbm_page_count(db);
+	version = dbm_version(db);
 	dba = dba_new(npages < 128 ? 128 : npages);
+	ifile = 0;
 	for (ip = 0; ip < npages; ip++) {
-		pdata = dbm_page_get(ip);
-		page = dba_page_new(dba->pages, pdata->arch,
-		    pdata->desc, pdata->file + 1, *pdata->file);
-		for (cp = pdata->name; *cp != '\0'; cp = strchr(cp, '\0') + 1)
+		dbm_page_get(db, ip, &pdata);
+		page = dba_page_new(dba->pages, pdata.arch,
+		    pdata.desc, pdata.file + 1, *pdata.file);
+		for (cp = pdata.name; *cp != '\0'; cp = strchr(cp, '\0') + 1)
 			dba_page_add(page, DBP_NAME, cp);
-		for (cp = pdata->sect; *cp != '\0'; cp = strchr(cp, '\0') + 1)
+		for (cp = pdata.sect; *cp != '\0'; cp = strchr(cp, '\0') + 1)
 			dba_page_add(page, DBP_SECT, cp);
-		if ((cp = pdata->arch) != NULL)
+		if ((cp = pdata.arch) != NULL)
 			while (*(cp = strchr(cp, '\0') + 1) != '\0')
 				dba_page_add(page, DBP_ARCH, cp);
-		cp = pdata->file;
-		while (*(cp = strchr(cp, '\0') + 1) != '\0')
-			dba_page_add(page, DBP_FILE, cp);
+		if (version < 2) {
+			cp = pdata.file;
+			while (*(cp = strchr(cp, '\0') + 1) != '\0')
+				dba_page_add(page, DBP_FILE, cp);
+			continue;
+		}
+
+		/*
+		 * Since version 2, the file names are front coded
+		 * and the fingerprints are stored in the same order.
+		 */
+
+		strlcpy(file, pdata.file + 1, sizeof(file));
+		fprint_add(dba, db, ifile++, file);
+		cp = pdata.file;
+		while (*(cp = strchr(cp, '\0') + 1) != '\0') {
+			if ((len = (unsigned char)*cp - 1) > strlen(file))
+				len = strlen(file);
+			strlcpy(file + len, cp + 1, sizeof(file) - len);
+			dba_page_add(page, DBP_FILE, file);
+			fprint_add(dba, db, ifile++, file);
+		}
 	}
 	for (im = 0; im < MACRO_MAX; im++) {
-		for (iv = 0; iv < dbm_macro_count(im); iv++) {
-			mdata = dbm_macro_get(im, iv);
-			dba_macro_new(dba, im, mdata->value, mdata->pp);
+		for (iv = 0; iv < dbm_macro_count(db, im); iv++) {
+			dbm_macro_get(db, im, iv, &mdata);
+			if (dba_macro_new(dba, im,
+			    mdata.value, mdata.pp) == -1) {
+				save_errno = errno;
+				dba_free(dba);
+				dbm_close(db);
+				errno = save_errno;
+				return NULL;
+			}
+		}
+	}
+	dba->fopts = dbm_file_opts(db);
+	if (version < 2) {
+		for (ifile = 0; ifile < dbm_file_count(db); ifile++) {
+			dbm_file_get(db, ifile, &fdata);
+			fprint_add(dba, db, ifile, fdata.name);
 		}
 	}
-	dbm_close();
+	dbm_close(db);
 	return dba;
 }
+
+/*
+ * Copy fingerprint ifile from the database, unless it is missing.
+ */
+static void
+fprint_add(struct dba *dba, struct dbm *db, int32_t ifile, const char *name)
+{
+	struct dbm_file		 fdata;
+	struct dba_fprint	 fp;
+
+	if (ifile >= dbm_file_count(db))
+		return;
+	dbm_file_get(db, ifile, &fdata);
+	if (fdata.ino == 0 && fdata.size == 0 &&
+	    fdata.mtime == 0 && fdata.hash == 0)
+		return;
+	fp.ino = fdata.ino;
+	fp.size = fdata.size;
+	fp.mtime = fdata.mtime;
+	fp.hash = fdata.hash;
+	dba_file_add(dba, name, &fp);
+}
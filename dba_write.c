@@ -34,15 +34,34 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "dba_write.h"
 
 static FILE	*ofp;
+static int32_t	 opos;	/* Current position when not writing a file. */
+static uint64_t	 hsect;	/* Digest of the current section. */
+static uint64_t	 htotal; /* Digest of everything since dba_open(). */
 
+#define	FNV_OFFSET	0xcbf29ce484222325ULL
+#define	FNV_PRIME	0x100000001b3ULL
 
+static void	 dba_hash(const void *, size_t);
+
+
+/*
+ * Start writing a database file.  With a NULL file name,
+ * nothing is written, but positions and digests are computed.
+ */
 int
 dba_open(const char *fname)
 {
+	hsect = htotal = FNV_OFFSET;
+	opos = 0;
+	if (fname == NULL) {
+		ofp = NULL;
+		return 0;
+	}
 	ofp = fopen(fname, "w");
 	return ofp == NULL ? -1 : 0;
 }
@@ -50,6 +69,8 @@ dba_open(const char *fname)
 int
 dba_close(void)
 {
+	if (ofp == NULL)
+		return 0;
 	return fclose(ofp) == EOF ? -1 : 0;
 }
 
@@ -58,6 +79,8 @@ dba_tell(void)
 {
 	long		 pos;
 
+	if (ofp == NULL)
+		return opos;
 	if ((pos = ftell(ofp)) == -1)
 		err(1, "ftell");
 	if (pos >= INT32_MAX) {
@@ -70,7 +93,13 @@ dba_tell(void)
 void
 dba_seek(int32_t pos)
 {
-	if (fseek(ofp, pos, SEEK_SET) == -1)
+	int32_t		 i;
+
+	i = htobe32(pos);
+	dba_hash(&i, sizeof(i));
+	if (ofp == NULL)
+		opos = pos;
+	else if (fseek(ofp, pos, SEEK_SET) == -1)
 		err(1, "fseek(%d)", pos);
 }
 
@@ -97,23 +126,39 @@ dba_skip(int32_t nmemb, int32_t sz)
 	assert(nmemb > 0);
 	assert(nmemb <= 5);
 	pos = dba_tell();
-	for (i = 0; i < sz; i++)
-		if (nmemb - fwrite(&out, sizeof(out[0]), nmemb, ofp))
+	for (i = 0; i < sz; i++) {
+		dba_hash(&out, nmemb * sizeof(out[0]));
+		if (ofp == NULL)
+			opos += nmemb * sizeof(out[0]);
+		else if (nmemb - fwrite(&out, sizeof(out[0]), nmemb, ofp))
 			err(1, "fwrite");
+	}
 	return pos;
 }
 
 void
 dba_char_write(int c)
 {
-	if (putc(c, ofp) == EOF)
+	unsigned char	 uc;
+
+	uc = c;
+	dba_hash(&uc, 1);
+	if (ofp == NULL)
+		opos++;
+	else if (putc(c, ofp) == EOF)
 		err(1, "fputc");
 }
 
 void
 dba_str_write(const char *str)
 {
-	if (fputs(str, ofp) == EOF)
+	size_t		 len;
+
+	len = strlen(str);
+	dba_hash(str, len);
+	if (ofp == NULL)
+		opos += len;
+	else if (fputs(str, ofp) == EOF)
 		err(1, "fputs");
 	dba_char_write('\0');
 }
@@ -122,6 +167,48 @@ void
 dba_int_write(int32_t i)
 {
 	i = htobe32(i);
-	if (fwrite(&i, sizeof(i), 1, ofp) != 1)
+	dba_hash(&i, sizeof(i));
+	if (ofp == NULL)
+		opos += sizeof(i);
+	else if (fwrite(&i, sizeof(i), 1, ofp) != 1)
 		err(1, "fwrite");
 }
+
+/*
+ * Return the digest of everything written since the previous call,
+ * or since dba_open(), and start a new section.
+ */
+uint64_t
+dba_section(void)
+{
+	uint64_t	 h;
+
+	h = hsect;
+	hsect = FNV_OFFSET;
+	return h;
+}
+
+/*
+ * Return the digest of everything written since dba_open().
+ * Equal digests mean that the same sequence of writes
+ * and seeks occurred, so the files are equal, too.
+ */
+uint64_t
+dba_digest(void)
+{
+	return htotal;
+}
+
+/*
+ * Update the digests using the 64-bit FNV-1a hash function.
+ */
+static void
+dba_hash(const void *vp, size_t sz)
+{
+	const unsigned char	*cp;
+
+	for (cp = vp; sz > 0; cp++, sz--) {
+		hsect = (hsect ^ *cp) * FNV_PRIME;
+		htotal = (htotal ^ *cp) * FNV_PRIME;
+	}
+}
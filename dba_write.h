@@ -28,3 +28,5 @@ int32_t	 dba_skip(int32_t, int32_t);
 void	 dba_char_write(int);
 void	 dba_str_write(const char *);
 void	 dba_int_write(int32_t);
+uint64_t dba_section(void);
+uint64_t dba_digest(void);
@@ -16,9 +16,16 @@
  *
  * Map-based version of the mandoc database, for read-only access.
  * The interface is defined in "dbm.h".
+ * Any number of databases can be open at the same time, and
+ * any number of iterations can run on each of them in parallel.
+ * Once opened, a database is never modified, such that different
+ * threads may use it, as long as each uses its own iterators.
  */
 #include "config.h"
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include <assert.h>
 #if HAVE_ENDIAN
 #include <endian.h>
@@ -31,12 +38,17 @@
 #include <err.h>
 #endif
 #include <errno.h>
+#include <limits.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <regex.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "mandoc_aux.h"
 #include "mansearch.h"
 #include "dbm_map.h"
 #include "dbm.h"
@@ -46,6 +58,36 @@ struct macro {
 	int32_t	pages;
 };
 
+struct name {
+	int32_t	name;
+	int32_t	page;
+};
+
+struct trigram {
+	int32_t	value;
+	int32_t	pages;
+};
+
+struct xref {
+	int32_t	page;
+	int32_t	pages;
+};
+
+struct file {
+	int32_t	name;
+	int32_t	ino;
+	int32_t	size;
+	int32_t	mtime;
+	int32_t	hash;
+};
+
+struct fprint {
+	int32_t	ino;
+	int32_t	size;
+	int32_t	mtime;
+	int32_t	hash;
+};
+
 struct page {
 	int32_t	name;
 	int32_t	sect;
@@ -60,19 +102,74 @@ enum iter {
 	ITER_SECT,
 	ITER_ARCH,
 	ITER_DESC,
-	ITER_MACRO
+	ITER_MACRO,
+	ITER_INDEX,
+	ITER_TRIGRAM,
+	ITER_XREF
+};
+
+struct dbm {
+	struct dbm_map	 map;
+	struct macro	*macros[MACRO_MAX];
+	int32_t		 nvals[MACRO_MAX];
+	struct page	*pages;
+	int32_t		 npages;
+	struct name	*names;
+	int32_t		 nnames;
+	struct trigram	*trigrams;
+	int32_t		 ntrigrams;
+	struct xref	*xrefs;
+	int32_t		 nxrefs;
+	struct file	*files;		/* Version 1 only. */
+	struct fprint	*fprints;	/* Version 2 and later. */
+	int32_t		 nfiles;
+	int32_t		 fopts;		/* Options used for building. */
+	const int32_t	*digests;
+	int32_t		 ndigests;
+	char		*fname;		/* Path name, for the cache only. */
+	struct dbm	*next;		/* Next database in the cache. */
+	int		 refs;		/* Users of the cached database. */
+	int		 cached;	/* Still in the cache, not stale. */
+};
+
+struct dbm_iter {
+	struct dbm		*db;
+	const struct dbm_match	*match;
+	const char		*cp;
+	const int32_t		*pp;
+	struct dbm_res		*found;	/* Pages collected up front. */
+	int32_t			 nfound, ifound, maxfound;
+	int32_t			 im, ip, iv, nv;
+	enum iter		 iteration;
+	enum iter		 titer;	/* What ITER_TRIGRAM inspects. */
 };
 
-static struct macro	*macros[MACRO_MAX];
-static int32_t		 nvals[MACRO_MAX];
-static struct page	*pages;
-static int32_t		 npages;
-static enum iter	 iteration;
+static struct dbm	*cache;
+#if HAVE_PTHREAD
+static pthread_mutex_t	 cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-static struct dbm_res	 page_bytitle(enum iter, const struct dbm_match *);
-static struct dbm_res	 page_byarch(const struct dbm_match *);
-static struct dbm_res	 page_bymacro(int32_t, const struct dbm_match *);
-static char		*macro_bypage(int32_t, int32_t);
+static void		 cache_lock(void);
+static void		 cache_unlock(void);
+static int32_t		*index_get(struct dbm *, const char *, int32_t);
+static struct dbm_res	 page_bytitle(struct dbm_iter *, enum iter,
+				const struct dbm_match *);
+static struct dbm_res	 page_byindex(struct dbm_iter *,
+				const struct dbm_match *);
+static int		 compare_res(const void *, const void *);
+static struct dbm_res	 page_bytrigram(struct dbm_iter *, enum iter,
+				const struct dbm_match *);
+static int		 trigram_collect(struct dbm_iter *,
+				const struct dbm_match *);
+static void		 found_add(struct dbm_iter *, int32_t, int32_t);
+static struct dbm_res	 page_byxref(struct dbm_iter *, int32_t);
+static struct dbm_res	 page_bylist(struct dbm_iter *, enum iter,
+				const struct dbm_match *);
+static struct dbm_res	 page_bymacro(struct dbm_iter *, int32_t,
+				const struct dbm_match *);
+static int32_t		 macro_search(struct dbm *, int32_t,
+				const char *, size_t, int);
+static char		*macro_bypage(struct dbm_iter *, int32_t, int32_t);
 
 
 /*** top level functions **********************************************/
@@ -80,25 +177,30 @@ static char		*macro_bypage(int32_t, int32_t);
 /*
  * Open a disk-based mandoc database for read-only access.
  * Map the pages and macros[] arrays.
- * Return 0 on success.  Return -1 and set errno on failure.
+ * Return the database on success.
+ * Return NULL and set errno on failure.
  */
-int
+struct dbm *
 dbm_open(const char *fname)
 {
+	struct dbm	*db;
 	const int32_t	*mp, *ep;
 	int32_t		 im;
 
-	if (dbm_map(fname) == -1)
-		return -1;
+	db = mandoc_calloc(1, sizeof(*db));
+	if (dbm_map(&db->map, fname) == -1) {
+		free(db);
+		return NULL;
+	}
 
-	if ((npages = be32toh(*dbm_getint(4))) < 0) {
+	if ((db->npages = be32toh(*dbm_getint(&db->map, 4))) < 0) {
 		warnx("dbm_open(%s): Invalid number of pages: %d",
-		    fname, npages);
+		    fname, db->npages);
 		goto fail;
 	}
-	pages = (struct page *)dbm_getint(5);
+	db->pages = (struct page *)dbm_getint(&db->map, 5);
 
-	if ((mp = dbm_get(*dbm_getint(2))) == NULL) {
+	if ((mp = dbm_get(&db->map, *dbm_getint(&db->map, 2))) == NULL) {
 		warnx("dbm_open(%s): Invalid offset of macros array", fname);
 		goto fail;
 	}
@@ -108,121 +210,372 @@ dbm_open(const char *fname)
 		goto fail;
 	}
 	for (im = 0; im < MACRO_MAX; im++) {
-		if ((ep = dbm_get(*++mp)) == NULL) {
+		if ((ep = dbm_get(&db->map, *++mp)) == NULL) {
 			warnx("dbm_open(%s): Invalid offset of macro %d",
 			    fname, im);
 			goto fail;
 		}
-		nvals[im] = be32toh(*ep);
-		macros[im] = (struct macro *)++ep;
+		db->nvals[im] = be32toh(*ep);
+		db->macros[im] = (struct macro *)++ep;
 	}
-	return 0;
+
+	/* The indexes are optional. */
+
+	if ((ep = index_get(db, fname, INDEX_NAME)) == (int32_t *)-1)
+		goto fail;
+	else if (ep != NULL) {
+		db->nnames = be32toh(*ep);
+		db->names = (struct name *)++ep;
+	}
+	if ((ep = index_get(db, fname, INDEX_TRIGRAM)) == (int32_t *)-1)
+		goto fail;
+	else if (ep != NULL) {
+		db->ntrigrams = be32toh(*ep);
+		db->trigrams = (struct trigram *)++ep;
+	}
+	if ((ep = index_get(db, fname, INDEX_XREF)) == (int32_t *)-1)
+		goto fail;
+	else if (ep != NULL) {
+		db->nxrefs = be32toh(*ep);
+		db->xrefs = (struct xref *)++ep;
+	}
+	db->fopts = -1;
+	if ((ep = index_get(db, fname, INDEX_FILE)) == (int32_t *)-1)
+		goto fail;
+	else if (ep != NULL) {
+		db->fopts = be32toh(*ep);
+		db->nfiles = be32toh(*++ep);
+		if (db->map.version < 2)
+			db->files = (struct file *)++ep;
+		else
+			db->fprints = (struct fprint *)++ep;
+	}
+	if ((ep = index_get(db, fname, INDEX_DIGEST)) == (int32_t *)-1)
+		goto fail;
+	else if (ep != NULL) {
+		db->ndigests = be32toh(*ep);
+		db->digests = ++ep;
+	}
+	return db;
 
 fail:
-	dbm_unmap();
+	dbm_unmap(&db->map);
+	free(db);
 	errno = EFTYPE;
-	return -1;
+	return NULL;
 }
 
 void
-dbm_close(void)
+dbm_close(struct dbm *db)
 {
-	dbm_unmap();
+	if (db == NULL)
+		return;
+	dbm_unmap(&db->map);
+	free(db->fname);
+	free(db);
+}
+
+/*
+ * For long-running processes, keep databases open between searches.
+ * Return a database from the cache if the file did not change
+ * since it was mapped; otherwise, open it and add it to the cache.
+ * Since makewhatis(8) replaces the file with rename(2),
+ * a changed file always has a new inode number or modification time,
+ * the latter compared in nanoseconds where the system provides them.
+ * Relative names are resolved first because the same relative name
+ * refers to different files when the caller changes directories.
+ * Return NULL and set errno on failure.
+ */
+struct dbm *
+dbm_cache_get(const char *relname)
+{
+	char		  fname[PATH_MAX];
+	struct stat	  st;
+	struct dbm	 *db, *odb, **dbp;
+
+	if (realpath(relname, fname) == NULL ||
+	    stat(fname, &st) == -1)
+		return NULL;
+
+	cache_lock();
+	for (dbp = &cache; (db = *dbp) != NULL; dbp = &db->next) {
+		if (strcmp(db->fname, fname) != 0)
+			continue;
+		if (dbm_map_same(&db->map, &st)) {
+			db->refs++;
+			cache_unlock();
+			return db;
+		}
+
+		/* Stale; close it as soon as nobody uses it any longer. */
+
+		*dbp = db->next;
+		db->cached = 0;
+		if (db->refs == 0)
+			dbm_close(db);
+		break;
+	}
+	cache_unlock();
+
+	if ((db = dbm_open(fname)) == NULL)
+		return NULL;
+	db->fname = mandoc_strdup(fname);
+	db->refs = 1;
+	db->cached = 1;
+
+	/*
+	 * Another thread may have mapped the same file meanwhile.
+	 * Then use its entry and drop this one, such that no
+	 * duplicate stays in the cache.  If its entry is stale,
+	 * replace it instead.
+	 */
+
+	cache_lock();
+	for (dbp = &cache; (odb = *dbp) != NULL; dbp = &odb->next) {
+		if (strcmp(odb->fname, fname) != 0)
+			continue;
+		if (odb->map.dev == db->map.dev &&
+		    odb->map.ino == db->map.ino &&
+		    odb->map.mtime == db->map.mtime &&
+		    odb->map.mtime_nsec == db->map.mtime_nsec &&
+		    odb->map.size == db->map.size) {
+			odb->refs++;
+			cache_unlock();
+			db->cached = 0;
+			dbm_close(db);
+			return odb;
+		}
+		*dbp = odb->next;
+		odb->cached = 0;
+		if (odb->refs == 0)
+			dbm_close(odb);
+		break;
+	}
+	db->next = cache;
+	cache = db;
+	cache_unlock();
+	return db;
+}
+
+/*
+ * Release a database obtained from dbm_cache_get().
+ */
+void
+dbm_cache_put(struct dbm *db)
+{
+	if (db == NULL)
+		return;
+	cache_lock();
+	assert(db->refs > 0);
+	if (--db->refs == 0 && db->cached == 0)
+		dbm_close(db);
+	cache_unlock();
+}
+
+static void
+cache_lock(void)
+{
+#if HAVE_PTHREAD
+	int	 irc;
+
+	if ((irc = pthread_mutex_lock(&cache_mutex)) != 0) {
+		errno = irc;
+		err(1, "pthread_mutex_lock");
+	}
+#endif
+}
+
+static void
+cache_unlock(void)
+{
+#if HAVE_PTHREAD
+	int	 irc;
+
+	if ((irc = pthread_mutex_unlock(&cache_mutex)) != 0) {
+		errno = irc;
+		err(1, "pthread_mutex_unlock");
+	}
+#endif
+}
+
+/*
+ * Look up one index in the table of indexes, if the database has one.
+ * Return NULL if the index is missing or -1 if the database is corrupt.
+ */
+static int32_t *
+index_get(struct dbm *db, const char *fname, int32_t ix)
+{
+	int32_t		*ip, *ep;
+
+	ip = dbm_getint(&db->map,
+	    be32toh(*dbm_getint(&db->map, 3)) / sizeof(*ip) - 1);
+	if (*ip == 0)
+		return NULL;
+	if ((ip = dbm_get(&db->map, *ip)) == NULL) {
+		warnx("dbm_open(%s): Invalid offset of indexes table",
+		    fname);
+		return (int32_t *)-1;
+	}
+	if (ix >= (int32_t)be32toh(*ip) || ip[ix + 1] == 0)
+		return NULL;
+	if ((ep = dbm_get(&db->map, ip[ix + 1])) == NULL) {
+		warnx("dbm_open(%s): Invalid offset of index %d",
+		    fname, ix);
+		return (int32_t *)-1;
+	}
+	return ep;
+}
+
+/*
+ * Create an iterator over the pages or macros of a database.
+ * Each iterator can only run one iteration at a time.
+ */
+struct dbm_iter *
+dbm_iter_new(struct dbm *db)
+{
+	struct dbm_iter	*it;
+
+	it = mandoc_calloc(1, sizeof(*it));
+	it->db = db;
+	it->iteration = ITER_NONE;
+	it->im = MACRO_MAX;
+	return it;
+}
+
+void
+dbm_iter_free(struct dbm_iter *it)
+{
+	if (it == NULL)
+		return;
+	free(it->found);
+	free(it);
 }
 
 
 /*** functions for handling pages *************************************/
 
 int32_t
-dbm_page_count(void)
+dbm_page_count(const struct dbm *db)
 {
-	return npages;
+	return db->npages;
 }
 
 /*
  * Give the caller pointers to the data for one manual page.
  */
-struct dbm_page *
-dbm_page_get(int32_t ip)
+void
+dbm_page_get(const struct dbm *db, int32_t ip, struct dbm_page *res)
 {
-	static struct dbm_page	 res;
+	const struct page	*page;
 
 	assert(ip >= 0);
-	assert(ip < npages);
-	res.name = dbm_get(pages[ip].name);
-	if (res.name == NULL)
-		res.name = "(NULL)\0";
-	res.sect = dbm_get(pages[ip].sect);
-	if (res.sect == NULL)
-		res.sect = "(NULL)\0";
-	res.arch = pages[ip].arch ? dbm_get(pages[ip].arch) : NULL;
-	res.desc = dbm_get(pages[ip].desc);
-	if (res.desc == NULL)
-		res.desc = "(NULL)";
-	res.file = dbm_get(pages[ip].file);
-	if (res.file == NULL)
-		res.file = " (NULL)\0";
-	res.addr = dbm_addr(pages + ip);
-	return &res;
+	assert(ip < db->npages);
+	page = db->pages + ip;
+	res->name = dbm_get(&db->map, page->name);
+	if (res->name == NULL)
+		res->name = "(NULL)\0";
+	res->sect = dbm_get(&db->map, page->sect);
+	if (res->sect == NULL)
+		res->sect = "(NULL)\0";
+	res->arch = page->arch ? dbm_get(&db->map, page->arch) : NULL;
+	res->desc = dbm_get(&db->map, page->desc);
+	if (res->desc == NULL)
+		res->desc = "(NULL)";
+	res->file = dbm_get(&db->map, page->file);
+	if (res->file == NULL)
+		res->file = " (NULL)\0";
+	res->addr = dbm_addr(&db->map, page);
 }
 
 /*
  * Functions to start filtered iterations over manual pages.
  */
 void
-dbm_page_byname(const struct dbm_match *match)
+dbm_page_byname(struct dbm_iter *it, const struct dbm_match *match)
 {
 	assert(match != NULL);
-	page_bytitle(ITER_NAME, match);
+	if (it->db->nnames > 0 &&
+	    (match->type == DBM_EXACT || match->prefix != NULL))
+		page_byindex(it, match);
+	else if (trigram_collect(it, match) == 0)
+		page_bytrigram(it, ITER_NAME, match);
+	else
+		page_bytitle(it, ITER_NAME, match);
 }
 
 void
-dbm_page_bysect(const struct dbm_match *match)
+dbm_page_bysect(struct dbm_iter *it, const struct dbm_match *match)
 {
 	assert(match != NULL);
-	page_bytitle(ITER_SECT, match);
+	page_bylist(it, ITER_SECT, match);
 }
 
 void
-dbm_page_byarch(const struct dbm_match *match)
+dbm_page_byarch(struct dbm_iter *it, const struct dbm_match *match)
 {
 	assert(match != NULL);
-	page_byarch(match);
+	page_bylist(it, ITER_ARCH, match);
 }
 
 void
-dbm_page_bydesc(const struct dbm_match *match)
+dbm_page_bydesc(struct dbm_iter *it, const struct dbm_match *match)
 {
 	assert(match != NULL);
-	page_bytitle(ITER_DESC, match);
+	if (trigram_collect(it, match) == 0)
+		page_bytrigram(it, ITER_DESC, match);
+	else
+		page_bytitle(it, ITER_DESC, match);
 }
 
 void
-dbm_page_bymacro(int32_t im, const struct dbm_match *match)
+dbm_page_bymacro(struct dbm_iter *it, int32_t im,
+    const struct dbm_match *match)
 {
 	assert(im >= 0);
 	assert(im < MACRO_MAX);
 	assert(match != NULL);
-	page_bymacro(im, match);
+	page_bymacro(it, im, match);
+}
+
+/*
+ * Iterate the manual pages referring to manual page ip with .Xr.
+ * Return -1 if the database has no cross reference index.
+ */
+int
+dbm_page_byxref(struct dbm_iter *it, int32_t ip)
+{
+	assert(ip >= 0);
+	assert(ip < it->db->npages);
+	if (it->db->xrefs == NULL)
+		return -1;
+	page_byxref(it, ip);
+	return 0;
 }
 
 /*
  * Return the number of the next manual page in the current iteration.
  */
 struct dbm_res
-dbm_page_next(void)
+dbm_page_next(struct dbm_iter *it)
 {
 	struct dbm_res			 res = {-1, 0};
 
-	switch(iteration) {
+	switch(it->iteration) {
 	case ITER_NONE:
 		return res;
+	case ITER_SECT:
 	case ITER_ARCH:
-		return page_byarch(NULL);
+		return page_bylist(it, it->iteration, NULL);
 	case ITER_MACRO:
-		return page_bymacro(0, NULL);
+		return page_bymacro(it, 0, NULL);
+	case ITER_INDEX:
+		return page_byindex(it, NULL);
+	case ITER_TRIGRAM:
+		return page_bytrigram(it, ITER_NONE, NULL);
+	case ITER_XREF:
+		return page_byxref(it, -1);
 	default:
-		return page_bytitle(iteration, NULL);
+		return page_bytitle(it, it->iteration, NULL);
 	}
 }
 
@@ -230,251 +583,642 @@ dbm_page_next(void)
  * Functions implementing the iteration over manual pages.
  */
 static struct dbm_res
-page_bytitle(enum iter arg_iter, const struct dbm_match *arg_match)
+page_bytitle(struct dbm_iter *it, enum iter arg_iter,
+    const struct dbm_match *arg_match)
 {
-	static const struct dbm_match	*match;
-	static const char		*cp;
-	static int32_t			 ip;
-	struct dbm_res			 res = {-1, 0};
+	struct dbm		*db;
+	struct dbm_res		 res = {-1, 0};
 
-	assert(arg_iter == ITER_NAME || arg_iter == ITER_DESC ||
-	    arg_iter == ITER_SECT);
+	assert(arg_iter == ITER_NAME || arg_iter == ITER_DESC);
+	db = it->db;
 
 	/* Initialize for a new iteration. */
 
 	if (arg_match != NULL) {
-		iteration = arg_iter;
-		match = arg_match;
-		switch (iteration) {
+		it->iteration = arg_iter;
+		it->match = arg_match;
+		switch (it->iteration) {
 		case ITER_NAME:
-			cp = dbm_get(pages[0].name);
-			break;
-		case ITER_SECT:
-			cp = dbm_get(pages[0].sect);
+			it->cp = dbm_get(&db->map, db->pages[0].name);
 			break;
 		case ITER_DESC:
-			cp = dbm_get(pages[0].desc);
+			it->cp = dbm_get(&db->map, db->pages[0].desc);
 			break;
 		default:
 			abort();
 		}
-		if (cp == NULL) {
-			iteration = ITER_NONE;
-			match = NULL;
-			cp = NULL;
-			ip = npages;
+		if (it->cp == NULL) {
+			it->iteration = ITER_NONE;
+			it->match = NULL;
+			it->cp = NULL;
+			it->ip = db->npages;
 		} else
-			ip = 0;
+			it->ip = 0;
 		return res;
 	}
 
 	/* Search for a name. */
 
-	while (ip < npages) {
-		if (iteration == ITER_NAME)
-			cp++;
-		if (dbm_match(match, cp))
+	while (it->ip < db->npages) {
+		if (it->iteration == ITER_NAME)
+			it->cp++;
+		if (dbm_match(it->match, it->cp))
 			break;
-		cp = strchr(cp, '\0') + 1;
-		if (iteration == ITER_DESC)
-			ip++;
-		else if (*cp == '\0') {
-			cp++;
-			ip++;
+		it->cp = strchr(it->cp, '\0') + 1;
+		if (it->iteration == ITER_DESC)
+			it->ip++;
+		else if (*it->cp == '\0') {
+			it->cp++;
+			it->ip++;
 		}
 	}
 
 	/* Reached the end without a match. */
 
-	if (ip == npages) {
-		iteration = ITER_NONE;
-		match = NULL;
-		cp = NULL;
+	if (it->ip == db->npages) {
+		it->iteration = ITER_NONE;
+		it->match = NULL;
+		it->cp = NULL;
 		return res;
 	}
 
 	/* Found a match; save the quality for later retrieval. */
 
-	res.page = ip;
-	res.bits = iteration == ITER_NAME ? cp[-1] : 0;
+	res.page = it->ip;
+	res.bits = it->iteration == ITER_NAME ? it->cp[-1] : 0;
 
 	/* Skip the remaining names of this page. */
 
-	if (++ip < npages) {
+	if (++it->ip < db->npages) {
 		do {
-			cp++;
-		} while (cp[-1] != '\0' ||
-		    (iteration != ITER_DESC && cp[-2] != '\0'));
+			it->cp++;
+		} while (it->cp[-1] != '\0' ||
+		    (it->iteration != ITER_DESC && it->cp[-2] != '\0'));
 	}
 	return res;
 }
 
+/*
+ * Look up exact names and name prefixes in the names index.
+ * Unlike page_bytitle(), collect all matching pages up front,
+ * such that each page is returned only once, in the usual order,
+ * and with the quality of its best matching name.
+ */
 static struct dbm_res
-page_byarch(const struct dbm_match *arg_match)
+page_byindex(struct dbm_iter *it, const struct dbm_match *arg_match)
 {
-	static const struct dbm_match	*match;
-	struct dbm_res			 res = {-1, 0};
-	static int32_t			 ip;
-	const char			*cp;
+	struct dbm		*db;
+	struct dbm_res		 res = {-1, 0};
+	const char		*key, *cp;
+	size_t			 len;
+	int32_t			 lo, hi, mid, ie, ir;
+	int			 exact;
+
+	/* Return the next page found during initialization. */
+
+	if (arg_match == NULL) {
+		if (it->ifound < it->nfound)
+			return it->found[it->ifound++];
+		it->iteration = ITER_NONE;
+		return res;
+	}
+
+	db = it->db;
+	it->iteration = ITER_INDEX;
+	it->nfound = it->ifound = 0;
+	exact = arg_match->type == DBM_EXACT;
+	key = exact ? arg_match->str : arg_match->prefix;
+	len = strlen(key);
+
+	/* Find the first name that might match. */
+
+	lo = 0;
+	hi = db->nnames;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((cp = dbm_get(&db->map, db->names[mid].name)) == NULL)
+			return res;
+		if ((exact ? strcasecmp(cp + 1, key) :
+		    strncasecmp(cp + 1, key, len)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Collect all pages having a matching name. */
+
+	for (ie = lo; ie < db->nnames; ie++) {
+		if ((cp = dbm_get(&db->map, db->names[ie].name)) == NULL ||
+		    (exact ? strcasecmp(cp + 1, key) :
+		     strncasecmp(cp + 1, key, len)) != 0)
+			break;
+		if (dbm_match(arg_match, cp + 1))
+			found_add(it, (struct page *)dbm_get(&db->map,
+			    db->names[ie].page) - db->pages, *cp);
+	}
+
+	/* Sort by page, keeping only the best name of each page. */
+
+	qsort(it->found, it->nfound, sizeof(*it->found), compare_res);
+	for (ie = ir = 0; ie < it->nfound; ie++)
+		if (ir == 0 || it->found[ie].page != it->found[ir - 1].page)
+			it->found[ir++] = it->found[ie];
+	it->nfound = ir;
+	return res;
+}
+
+static int
+compare_res(const void *vp1, const void *vp2)
+{
+	const struct dbm_res	*rp1, *rp2;
+
+	rp1 = vp1;
+	rp2 = vp2;
+	return rp1->page != rp2->page ? rp1->page - rp2->page :
+	    rp2->bits - rp1->bits;
+}
+
+/*
+ * Iterate the candidate pages found in the trigram index,
+ * checking the names or descriptions of these pages only.
+ * The results are the same as those of page_bytitle().
+ */
+static struct dbm_res
+page_bytrigram(struct dbm_iter *it, enum iter arg_iter,
+    const struct dbm_match *arg_match)
+{
+	struct dbm		*db;
+	struct dbm_res		 res = {-1, 0};
+	const char		*cp;
+	int32_t			 ip;
 
 	/* Initialize for a new iteration. */
 
 	if (arg_match != NULL) {
-		iteration = ITER_ARCH;
-		match = arg_match;
-		ip = 0;
+		assert(arg_iter == ITER_NAME || arg_iter == ITER_DESC);
+		it->iteration = ITER_TRIGRAM;
+		it->titer = arg_iter;
+		it->match = arg_match;
+		it->ifound = 0;
+		return res;
+	}
+
+	/* Search the candidates for a name or description. */
+
+	db = it->db;
+	while (it->ifound < it->nfound) {
+		ip = it->found[it->ifound++].page;
+		if (it->titer == ITER_DESC) {
+			if ((cp = dbm_get(&db->map,
+			    db->pages[ip].desc)) != NULL &&
+			    dbm_match(it->match, cp)) {
+				res.page = ip;
+				return res;
+			}
+			continue;
+		}
+		if ((cp = dbm_get(&db->map, db->pages[ip].name)) == NULL)
+			continue;
+		for (; *cp != '\0'; cp = strchr(cp, '\0') + 1) {
+			if (dbm_match(it->match, cp + 1)) {
+				res.page = ip;
+				res.bits = *cp;
+				return res;
+			}
+		}
+	}
+
+	/* Reached the end without a match. */
+
+	it->iteration = ITER_NONE;
+	it->match = NULL;
+	return res;
+}
+
+/*
+ * Collect the pages containing all trigrams of the literal string
+ * that the match requires, in the order of the pages table.
+ * Return -1 if the trigram index cannot be used.
+ */
+static int
+trigram_collect(struct dbm_iter *it, const struct dbm_match *match)
+{
+	struct dbm	*db;
+	const int32_t	*pp;
+	const char	*cp;
+	int32_t		 value, lo, hi, mid, ip, ie, ir;
+	int		 used;
+
+	db = it->db;
+	cp = match->type == DBM_REGEX ? match->lit : match->str;
+	if (db->ntrigrams == 0 || cp == NULL)
+		return -1;
+
+	used = 0;
+	it->nfound = it->ifound = 0;
+	for (; cp[0] != '\0' && cp[1] != '\0' && cp[2] != '\0'; cp++) {
+		if (TRIGRAM_CHAR(cp[0]) == 0 || TRIGRAM_CHAR(cp[1]) == 0 ||
+		    TRIGRAM_CHAR(cp[2]) == 0)
+			continue;
+
+		/* Find the list of pages containing the trigram. */
+
+		value = TRIGRAM_VALUE(cp);
+		lo = 0;
+		hi = db->ntrigrams;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if ((int32_t)be32toh(db->trigrams[mid].value) < value)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == db->ntrigrams ||
+		    (int32_t)be32toh(db->trigrams[lo].value) != value ||
+		    (pp = dbm_get(&db->map, db->trigrams[lo].pages)) == NULL) {
+			it->nfound = 0;
+			return 0;
+		}
+
+		/* Intersect it with the pages found so far. */
+
+		if (used++ == 0) {
+			while (*pp != 0)
+				found_add(it, (struct page *)
+				    dbm_get(&db->map, *pp++) - db->pages, 0);
+			continue;
+		}
+		ie = ir = 0;
+		while (*pp != 0 && ie < it->nfound) {
+			ip = (struct page *)dbm_get(&db->map, *pp) - db->pages;
+			if (ip < it->found[ie].page)
+				pp++;
+			else if (ip > it->found[ie].page)
+				ie++;
+			else {
+				it->found[ir++] = it->found[ie++];
+				pp++;
+			}
+		}
+		if ((it->nfound = ir) == 0)
+			break;
+	}
+	return used ? 0 : -1;
+}
+
+static void
+found_add(struct dbm_iter *it, int32_t ip, int32_t bits)
+{
+	if (it->nfound == it->maxfound) {
+		it->maxfound = it->maxfound ? it->maxfound * 2 : 64;
+		it->found = mandoc_reallocarray(it->found,
+		    it->maxfound, sizeof(*it->found));
+	}
+	it->found[it->nfound].page = ip;
+	it->found[it->nfound].bits = bits;
+	it->nfound++;
+}
+
+static struct dbm_res
+page_byxref(struct dbm_iter *it, int32_t arg_ip)
+{
+	struct dbm		*db;
+	struct dbm_res		 res = {-1, 0};
+	int32_t			 addr, lo, hi, mid;
+
+	db = it->db;
+
+	/* Initialize for a new iteration. */
+
+	if (arg_ip >= 0) {
+		it->iteration = ITER_XREF;
+		it->pp = NULL;
+		addr = be32toh(dbm_addr(&db->map, db->pages + arg_ip));
+		lo = 0;
+		hi = db->nxrefs;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if ((int32_t)be32toh(db->xrefs[mid].page) < addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < db->nxrefs &&
+		    (int32_t)be32toh(db->xrefs[lo].page) == addr)
+			it->pp = dbm_get(&db->map, db->xrefs[lo].pages);
 		return res;
 	}
 
-	/* Search for an architecture. */
+	/* Return the next referring page. */
 
-	for ( ; ip < npages; ip++)
-		if (pages[ip].arch)
-			for (cp = dbm_get(pages[ip].arch);
-			    *cp != '\0';
-			    cp = strchr(cp, '\0') + 1)
-				if (dbm_match(match, cp)) {
-					res.page = ip++;
-					return res;
-				}
+	if (it->pp != NULL && *it->pp != 0) {
+		res.page = (struct page *)dbm_get(&db->map, *it->pp++) -
+		    db->pages;
+		return res;
+	}
+
+	/* Reached the end. */
+
+	it->iteration = ITER_NONE;
+	it->pp = NULL;
+	return res;
+}
+
+/*
+ * Iterate the pages by section or by architecture.
+ * Pages may share lists, so follow the pointer of each page
+ * rather than walking the lists in order.
+ */
+static struct dbm_res
+page_bylist(struct dbm_iter *it, enum iter arg_iter,
+    const struct dbm_match *arg_match)
+{
+	struct dbm		*db;
+	struct dbm_res		 res = {-1, 0};
+	const char		*cp;
+	int32_t			 pos;
+
+	/* Initialize for a new iteration. */
+
+	if (arg_match != NULL) {
+		assert(arg_iter == ITER_SECT || arg_iter == ITER_ARCH);
+		it->iteration = arg_iter;
+		it->match = arg_match;
+		it->ip = 0;
+		return res;
+	}
+
+	/* Search for a section or an architecture. */
+
+	db = it->db;
+	for ( ; it->ip < db->npages; it->ip++) {
+		pos = it->iteration == ITER_SECT ?
+		    db->pages[it->ip].sect : db->pages[it->ip].arch;
+		if (pos == 0 || (cp = dbm_get(&db->map, pos)) == NULL)
+			continue;
+		for ( ; *cp != '\0'; cp = strchr(cp, '\0') + 1)
+			if (dbm_match(it->match, cp)) {
+				res.page = it->ip++;
+				return res;
+			}
+	}
 
 	/* Reached the end without a match. */
 
-	iteration = ITER_NONE;
-	match = NULL;
+	it->iteration = ITER_NONE;
+	it->match = NULL;
 	return res;
 }
 
 static struct dbm_res
-page_bymacro(int32_t arg_im, const struct dbm_match *arg_match)
+page_bymacro(struct dbm_iter *it, int32_t arg_im,
+    const struct dbm_match *arg_match)
 {
-	static const struct dbm_match	*match;
-	static const int32_t		*pp;
-	static const char		*cp;
-	static int32_t			 im, iv;
-	struct dbm_res			 res = {-1, 0};
+	struct dbm		*db;
+	struct dbm_res		 res = {-1, 0};
+	const char		*key;
+	size_t			 len;
 
-	assert(im >= 0);
-	assert(im < MACRO_MAX);
+	db = it->db;
 
 	/* Initialize for a new iteration. */
 
 	if (arg_match != NULL) {
-		iteration = ITER_MACRO;
-		match = arg_match;
-		im = arg_im;
-		cp = nvals[im] ? dbm_get(macros[im]->value) : NULL;
-		pp = NULL;
-		iv = -1;
+		it->iteration = ITER_MACRO;
+		it->match = arg_match;
+		it->im = arg_im;
+		it->pp = NULL;
+
+		/*
+		 * The values are sorted with strcmp(3), so binary
+		 * search can find the range of values having the
+		 * exact value or the case-sensitive prefix required.
+		 */
+
+		if (arg_match->type == DBM_EXACT) {
+			key = arg_match->str;
+			len = strlen(key) + 1;
+		} else if (arg_match->prefix != NULL &&
+		    arg_match->icase == 0) {
+			key = arg_match->prefix;
+			len = strlen(key);
+		} else
+			key = NULL;
+		if (key == NULL) {
+			it->iv = -1;
+			it->nv = db->nvals[it->im];
+		} else {
+			it->iv = macro_search(db, it->im, key, len, 0) - 1;
+			it->nv = macro_search(db, it->im, key, len, 1);
+		}
 		return res;
 	}
-	if (iteration != ITER_MACRO)
+	if (it->iteration != ITER_MACRO)
 		return res;
 
+	assert(it->im >= 0);
+	assert(it->im < MACRO_MAX);
+
 	/* Find the next matching macro value. */
 
-	while (pp == NULL || *pp == 0) {
-		if (++iv == nvals[im]) {
-			iteration = ITER_NONE;
+	while (it->pp == NULL || *it->pp == 0) {
+		if (++it->iv >= it->nv) {
+			it->iteration = ITER_NONE;
 			return res;
 		}
-		if (iv)
-			cp = strchr(cp, '\0') + 1;
-		if (dbm_match(match, cp))
-			pp = dbm_get(macros[im][iv].pages);
+		it->cp = dbm_get(&db->map, db->macros[it->im][it->iv].value);
+		if (it->cp != NULL && dbm_match(it->match, it->cp))
+			it->pp = dbm_get(&db->map,
+			    db->macros[it->im][it->iv].pages);
 	}
 
 	/* Found a matching page. */
 
-	res.page = (struct page *)dbm_get(*pp++) - pages;
+	res.page = (struct page *)dbm_get(&db->map, *it->pp++) - db->pages;
 	return res;
 }
 
+/*
+ * Return the number of the first value of the macro
+ * that is larger than the key or, if upper is 0, not smaller,
+ * comparing at most len bytes.
+ */
+static int32_t
+macro_search(struct dbm *db, int32_t im, const char *key, size_t len,
+    int upper)
+{
+	const char	*cp;
+	int32_t		 lo, hi, mid;
+	int		 cmp;
+
+	lo = 0;
+	hi = db->nvals[im];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((cp = dbm_get(&db->map, db->macros[im][mid].value)) == NULL)
+			return lo;
+		cmp = strncmp(cp, key, len);
+		if (cmp < 0 || (upper && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 
 /*** functions for handling macros ************************************/
 
 int32_t
-dbm_macro_count(int32_t im)
+dbm_macro_count(const struct dbm *db, int32_t im)
 {
 	assert(im >= 0);
 	assert(im < MACRO_MAX);
-	return nvals[im];
+	return db->nvals[im];
 }
 
-struct dbm_macro *
-dbm_macro_get(int32_t im, int32_t iv)
+void
+dbm_macro_get(const struct dbm *db, int32_t im, int32_t iv,
+    struct dbm_macro *macro)
 {
-	static struct dbm_macro macro;
-
 	assert(im >= 0);
 	assert(im < MACRO_MAX);
 	assert(iv >= 0);
-	assert(iv < nvals[im]);
-	macro.value = dbm_get(macros[im][iv].value);
-	macro.pp = dbm_get(macros[im][iv].pages);
-	return &macro;
+	assert(iv < db->nvals[im]);
+	macro->value = dbm_get(&db->map, db->macros[im][iv].value);
+	macro->pp = dbm_get(&db->map, db->macros[im][iv].pages);
 }
 
 /*
  * Filtered iteration over macro entries.
  */
 void
-dbm_macro_bypage(int32_t im, int32_t ip)
+dbm_macro_bypage(struct dbm_iter *it, int32_t im, int32_t ip)
 {
 	assert(im >= 0);
 	assert(im < MACRO_MAX);
 	assert(ip != 0);
-	macro_bypage(im, ip);
+	macro_bypage(it, im, ip);
 }
 
 char *
-dbm_macro_next(void)
+dbm_macro_next(struct dbm_iter *it)
 {
-	return macro_bypage(MACRO_MAX, 0);
+	return macro_bypage(it, MACRO_MAX, 0);
 }
 
 static char *
-macro_bypage(int32_t arg_im, int32_t arg_ip)
+macro_bypage(struct dbm_iter *it, int32_t arg_im, int32_t arg_ip)
 {
-	static const int32_t	*pp;
-	static int32_t		 im, ip, iv;
+	struct dbm	*db;
+
+	db = it->db;
 
 	/* Initialize for a new iteration. */
 
 	if (arg_im < MACRO_MAX && arg_ip != 0) {
-		im = arg_im;
-		ip = arg_ip;
-		pp = dbm_get(macros[im]->pages);
-		iv = 0;
+		it->im = arg_im;
+		it->ip = arg_ip;
+		it->pp = dbm_get(&db->map, db->macros[it->im]->pages);
+		it->iv = 0;
 		return NULL;
 	}
-	if (im >= MACRO_MAX)
+	if (it->im >= MACRO_MAX)
 		return NULL;
 
 	/* Search for the next value. */
 
-	while (iv < nvals[im]) {
-		if (*pp == ip)
+	while (it->iv < db->nvals[it->im]) {
+		if (*it->pp == it->ip)
 			break;
-		if (*pp == 0)
-			iv++;
-		pp++;
+		if (*it->pp == 0)
+			it->iv++;
+		it->pp++;
 	}
 
 	/* Reached the end without a match. */
 
-	if (iv == nvals[im]) {
-		im = MACRO_MAX;
-		ip = 0;
-		pp = NULL;
+	if (it->iv == db->nvals[it->im]) {
+		it->im = MACRO_MAX;
+		it->ip = 0;
+		it->pp = NULL;
 		return NULL;
 	}
 
 	/* Found a match; skip the remaining pages of this entry. */
 
-	if (++iv < nvals[im])
-		while (*pp++ != 0)
+	if (++it->iv < db->nvals[it->im])
+		while (*it->pp++ != 0)
 			continue;
 
-	return dbm_get(macros[im][iv - 1].value);
+	return dbm_get(&db->map, db->macros[it->im][it->iv - 1].value);
+}
+
+/*** functions for handling file fingerprints *************************/
+
+/*
+ * Return the makewhatis(8) options the database was built with,
+ * or -1 if it has no file fingerprints.
+ */
+int32_t
+dbm_file_opts(const struct dbm *db)
+{
+	return db->fopts;
+}
+
+int32_t
+dbm_file_count(const struct dbm *db)
+{
+	return db->nfiles;
+}
+
+/*
+ * Since version 2, the fingerprints are stored in the order
+ * of the file names in the pages table, and the name is NULL.
+ */
+void
+dbm_file_get(const struct dbm *db, int32_t ifile, struct dbm_file *file)
+{
+	assert(ifile >= 0);
+	assert(ifile < db->nfiles);
+	if (db->files == NULL) {
+		file->name = NULL;
+		file->ino = be32toh(db->fprints[ifile].ino);
+		file->size = be32toh(db->fprints[ifile].size);
+		file->mtime = be32toh(db->fprints[ifile].mtime);
+		file->hash = be32toh(db->fprints[ifile].hash);
+		return;
+	}
+	file->name = dbm_get(&db->map, db->files[ifile].name);
+	file->ino = be32toh(db->files[ifile].ino);
+	file->size = be32toh(db->files[ifile].size);
+	file->mtime = be32toh(db->files[ifile].mtime);
+	file->hash = be32toh(db->files[ifile].hash);
+}
+
+/*
+ * Return the version of the database format.
+ */
+int32_t
+dbm_version(const struct dbm *db)
+{
+	return db->map.version;
+}
+
+
+/*** functions for handling digests ***********************************/
+
+/*
+ * Copy up to DIGEST_MAX digests of the database to the array
+ * and return the number copied, or 0 if there are none.
+ */
+int
+dbm_digest(const struct dbm *db, uint64_t *digest)
+{
+	int		 id;
+
+	for (id = 0; id < db->ndigests && id < DIGEST_MAX; id++)
+		digest[id] = (uint64_t)be32toh(db->digests[2 * id]) << 32 |
+		    be32toh(db->digests[2 * id + 1]);
+	return id;
 }
@@ -28,6 +28,9 @@ enum dbm_mtype {
 struct dbm_match {
 	regex_t		*re;
 	const char	*str;
+	char		*prefix;  /* Literal prefix of an anchored regex. */
+	char		*lit;	  /* Literal substring of a regex. */
+	int		 icase;	  /* The regex ignores case. */
 	enum dbm_mtype	 type;
 };
 
@@ -50,19 +53,43 @@ struct dbm_macro {
 	const int32_t	*pp;
 };
 
-int		 dbm_open(const char *);
-void		 dbm_close(void);
+struct dbm_file {
+	const char	*name;
+	int32_t		 ino;
+	int32_t		 size;
+	int32_t		 mtime;
+	int32_t		 hash;
+};
+
+struct dbm;
+struct dbm_iter;
+
+struct dbm	*dbm_open(const char *);
+void		 dbm_close(struct dbm *);
+struct dbm	*dbm_cache_get(const char *);
+void		 dbm_cache_put(struct dbm *);
+struct dbm_iter	*dbm_iter_new(struct dbm *);
+void		 dbm_iter_free(struct dbm_iter *);
+
+int32_t		 dbm_page_count(const struct dbm *);
+void		 dbm_page_get(const struct dbm *, int32_t, struct dbm_page *);
+void		 dbm_page_byname(struct dbm_iter *, const struct dbm_match *);
+void		 dbm_page_bysect(struct dbm_iter *, const struct dbm_match *);
+void		 dbm_page_byarch(struct dbm_iter *, const struct dbm_match *);
+void		 dbm_page_bydesc(struct dbm_iter *, const struct dbm_match *);
+void		 dbm_page_bymacro(struct dbm_iter *, int32_t,
+			const struct dbm_match *);
+int		 dbm_page_byxref(struct dbm_iter *, int32_t);
+struct dbm_res	 dbm_page_next(struct dbm_iter *);
 
-int32_t		 dbm_page_count(void);
-struct dbm_page	*dbm_page_get(int32_t);
-void		 dbm_page_byname(const struct dbm_match *);
-void		 dbm_page_bysect(const struct dbm_match *);
-void		 dbm_page_byarch(const struct dbm_match *);
-void		 dbm_page_bydesc(const struct dbm_match *);
-void		 dbm_page_bymacro(int32_t, const struct dbm_match *);
-struct dbm_res	 dbm_page_next(void);
+int32_t		 dbm_macro_count(const struct dbm *, int32_t);
+void		 dbm_macro_get(const struct dbm *, int32_t, int32_t,
+			struct dbm_macro *);
+void		 dbm_macro_bypage(struct dbm_iter *, int32_t, int32_t);
+char		*dbm_macro_next(struct dbm_iter *);
 
-int32_t		 dbm_macro_count(int32_t);
-struct dbm_macro *dbm_macro_get(int32_t, int32_t);
-void		 dbm_macro_bypage(int32_t, int32_t);
-char		*dbm_macro_next(void);
+int32_t		 dbm_file_opts(const struct dbm *);
+int32_t		 dbm_file_count(const struct dbm *);
+void		 dbm_file_get(const struct dbm *, int32_t, struct dbm_file *);
+int32_t		 dbm_version(const struct dbm *);
+int		 dbm_digest(const struct dbm *, uint64_t *);
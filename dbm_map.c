@@ -46,25 +46,22 @@
 #include "dbm_map.h"
 #include "dbm.h"
 
-static struct stat	 st;
-static char		*dbm_base;
-static int		 ifd;
-static int32_t		 max_offset;
-
 /*
  * Open a disk-based database for read-only access.
  * Validate the file format as far as it is not mandoc-specific.
  * Return 0 on success.  Return -1 and set errno on failure.
  */
 int
-dbm_map(const char *fname)
+dbm_map(struct dbm_map *map, const char *fname)
 {
+	struct stat	 st;
 	int		 save_errno;
 	const int32_t	*magic;
 
-	if ((ifd = open(fname, O_RDONLY)) == -1)
+	map->base = MAP_FAILED;
+	if ((map->fd = open(fname, O_RDONLY)) == -1)
 		return -1;
-	if (fstat(ifd, &st) == -1)
+	if (fstat(map->fd, &st) == -1)
 		goto fail;
 	if (st.st_size < 5) {
 		warnx("dbm_map(%s): File too short", fname);
@@ -75,12 +72,21 @@ dbm_map(const char *fname)
 		errno = EFBIG;
 		goto fail;
 	}
-	if ((dbm_base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
-	    ifd, 0)) == MAP_FAILED)
+	map->size = st.st_size;
+	map->mtime = st.st_mtime;
+#if HAVE_ST_MTIM
+	map->mtime_nsec = st.st_mtim.tv_nsec;
+#else
+	map->mtime_nsec = 0;
+#endif
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	if ((map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED,
+	    map->fd, 0)) == MAP_FAILED)
 		goto fail;
-	magic = dbm_getint(0);
+	magic = dbm_getint(map, 0);
 	if (be32toh(*magic) != MANDOCDB_MAGIC) {
-		if (strncmp(dbm_base, "SQLite format 3", 15))
+		if (strncmp(map->base, "SQLite format 3", 15))
 			warnx("dbm_map(%s): "
 			    "Bad initial magic %x (expected %x)",
 			    fname, be32toh(*magic), MANDOCDB_MAGIC);
@@ -91,21 +97,22 @@ dbm_map(const char *fname)
 		errno = EFTYPE;
 		goto fail;
 	}
-	magic = dbm_getint(1);
-	if (be32toh(*magic) != MANDOCDB_VERSION) {
-		warnx("dbm_map(%s): Bad version number %d (expected %d)",
-		    fname, be32toh(*magic), MANDOCDB_VERSION);
+	magic = dbm_getint(map, 1);
+	map->version = be32toh(*magic);
+	if (map->version < 1 || map->version > MANDOCDB_VERSION) {
+		warnx("dbm_map(%s): Bad version number %d (expected 1 to %d)",
+		    fname, map->version, MANDOCDB_VERSION);
 		errno = EFTYPE;
 		goto fail;
 	}
-	max_offset = be32toh(*dbm_getint(3)) + sizeof(int32_t);
-	if (st.st_size != max_offset) {
+	map->max_offset = be32toh(*dbm_getint(map, 3)) + sizeof(int32_t);
+	if (st.st_size != map->max_offset) {
 		warnx("dbm_map(%s): Inconsistent file size %lld (expected %d)",
-		    fname, (long long)st.st_size, max_offset);
+		    fname, (long long)st.st_size, map->max_offset);
 		errno = EFTYPE;
 		goto fail;
 	}
-	if ((magic = dbm_get(*dbm_getint(3))) == NULL) {
+	if ((magic = dbm_get(map, *dbm_getint(map, 3))) == NULL) {
 		errno = EFTYPE;
 		goto fail;
 	}
@@ -119,19 +126,36 @@ dbm_map(const char *fname)
 
 fail:
 	save_errno = errno;
-	close(ifd);
+	if (map->base != MAP_FAILED)
+		munmap(map->base, map->size);
+	close(map->fd);
 	errno = save_errno;
 	return -1;
 }
 
 void
-dbm_unmap(void)
+dbm_unmap(struct dbm_map *map)
 {
-	if (munmap(dbm_base, st.st_size) == -1)
+	if (munmap(map->base, map->size) == -1)
 		warn("dbm_unmap: munmap");
-	if (close(ifd) == -1)
+	if (close(map->fd) == -1)
 		warn("dbm_unmap: close");
-	dbm_base = (char *)-1;
+	map->base = (char *)-1;
+}
+
+/*
+ * Return 1 if the file described by st is still the one mapped,
+ * judging by its identity, size, and modification time.
+ */
+int
+dbm_map_same(const struct dbm_map *map, const struct stat *st)
+{
+#if HAVE_ST_MTIM
+	if (map->mtime_nsec != st->st_mtim.tv_nsec)
+		return 0;
+#endif
+	return map->dev == st->st_dev && map->ino == st->st_ino &&
+	    map->mtime == st->st_mtime && (off_t)map->size == st->st_size;
 }
 
 /*
@@ -140,19 +164,19 @@ dbm_unmap(void)
  * and return a pointer to that place in the file.
  */
 void *
-dbm_get(int32_t offset)
+dbm_get(const struct dbm_map *map, int32_t offset)
 {
 	offset = be32toh(offset);
 	if (offset < 0) {
 		warnx("dbm_get: Database corrupt: offset %d", offset);
 		return NULL;
 	}
-	if (offset >= max_offset) {
+	if (offset >= map->max_offset) {
 		warnx("dbm_get: Database corrupt: offset %d > %d",
-		    offset, max_offset);
+		    offset, map->max_offset);
 		return NULL;
 	}
-	return dbm_base + offset;
+	return map->base + offset;
 }
 
 /*
@@ -161,9 +185,9 @@ dbm_get(int32_t offset)
  * Get a pointer to one with the number "offset".
  */
 int32_t *
-dbm_getint(int32_t offset)
+dbm_getint(const struct dbm_map *map, int32_t offset)
 {
-	return (int32_t *)dbm_base + offset;
+	return (int32_t *)map->base + offset;
 }
 
 /*
@@ -173,9 +197,9 @@ dbm_getint(int32_t offset)
  * that would be used to refer to that place in the file.
  */
 int32_t
-dbm_addr(const void *p)
+dbm_addr(const struct dbm_map *map, const void *p)
 {
-	return htobe32((const char *)p - dbm_base);
+	return htobe32((const char *)p - map->base);
 }
 
 int
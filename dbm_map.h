@@ -20,10 +20,24 @@
  */
 
 struct dbm_match;
+struct stat;
 
-int		 dbm_map(const char *);
-void		 dbm_unmap(void);
-void		*dbm_get(int32_t);
-int32_t		*dbm_getint(int32_t);
-int32_t		 dbm_addr(const void *);
+struct	dbm_map {
+	char		*base;		/* Start of the mapped file. */
+	size_t		 size;		/* Size of the mapped file. */
+	time_t		 mtime;		/* Modification time of the file, */
+	long		 mtime_nsec;	/* in seconds and nanoseconds. */
+	dev_t		 dev;		/* Device of the file. */
+	ino_t		 ino;		/* Inode number of the file. */
+	int32_t		 max_offset;	/* Offset of the end of the file. */
+	int32_t		 version;	/* Format version of the file. */
+	int		 fd;
+};
+
+int		 dbm_map(struct dbm_map *, const char *);
+void		 dbm_unmap(struct dbm_map *);
+int		 dbm_map_same(const struct dbm_map *, const struct stat *);
+void		*dbm_get(const struct dbm_map *, int32_t);
+int32_t		*dbm_getint(const struct dbm_map *, int32_t);
+int32_t		 dbm_addr(const struct dbm_map *, const void *);
 int		 dbm_match(const struct dbm_match *, const char *);
@@ -127,10 +127,12 @@ main(int argc, char *argv[])
 	struct mansearch search;	/* Search options. */
 	struct manpage	*res;		/* Complete list of search results. */
 	struct manpage	*resn;		/* Search results for one name. */
+	struct manhits	*hits;		/* Unbuilt results for one name. */
 	struct mparse	*mp;		/* Opaque parser object. */
 	const char	*conf_file;	/* -C: alternate config file. */
 	const char	*os_s;		/* -I: Operating system for display. */
 	const char	*progname, *sec;
+	const char	*errstr;	/* -n: parse error. */
 	char		*defpaths;	/* -M: override manpaths. */
 	char		*auxpaths;	/* -m: additional manpaths. */
 	char		*oarg;		/* -O: output option string. */
@@ -213,7 +215,7 @@ main(int argc, char *argv[])
 	outmode = OUTMODE_DEF;
 
 	while ((c = getopt(argc, argv,
-	    "aC:cfhI:iK:klM:m:O:S:s:T:VW:w")) != -1) {
+	    "aC:cfhI:iK:klM:m:n:O:S:s:T:VW:w")) != -1) {
 		if (c == 'i' && search.argmode == ARG_EXPR) {
 			optind--;
 			break;
@@ -274,6 +276,14 @@ main(int argc, char *argv[])
 		case 'm':
 			auxpaths = optarg;
 			break;
+		case 'n':
+			search.limit = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL) {
+				mandoc_msg(MANDOCERR_BADARG_BAD, 0, 0,
+				    "-n %s", optarg);
+				return mandoc_msg_getrc();
+			}
+			break;
 		case 'O':
 			oarg = optarg;
 			break;
@@ -452,9 +462,18 @@ main(int argc, char *argv[])
 
 	/* Read the configuration file. */
 
-	if (search.argmode != ARG_FILE)
+	if (search.argmode != ARG_FILE) {
 		manconf_parse(&conf, conf_file, defpaths, auxpaths);
 
+		/*
+		 * Threads only help when several trees must be
+		 * searched; man(1) without -a stops at the first hit.
+		 */
+
+		search.parallel = search.firstmatch == 0 &&
+		    conf.manpath.sz > 1;
+	}
+
 	/* man(1): Resolve each name individually. */
 
 	if (search.argmode == ARG_NAME) {
@@ -473,8 +492,19 @@ main(int argc, char *argv[])
 			return (int)mandoc_msg_getrc();
 		}
 		for (res = NULL, ressz = 0; argc > 0; argc--, argv++) {
-			(void)mansearch(&search, &conf.manpath,
-			    1, argv, &resn, &resnsz);
+
+			/*
+			 * man(1) only needs the file names,
+			 * so do not build the other strings.
+			 */
+
+			resnsz = 0;
+			if ((hits = mansearch_hits(&search, &conf.manpath,
+			    1, argv)) != NULL) {
+				resnsz = manhits_take(hits,
+				    MANPAGE_FILE, &resn);
+				manhits_free(hits);
+			}
 			if (resnsz == 0)
 				(void)fs_search(&search, &conf.manpath,
 				    *argv, &resn, &resnsz);
@@ -675,13 +705,13 @@ usage(enum argmode argmode)
 		break;
 	case ARG_WORD:
 		fputs("usage: whatis [-afk] [-C file] "
-		    "[-M path] [-m path] [-O outkey] [-S arch]\n"
-		    "\t      [-s section] name ...\n", stderr);
+		    "[-M path] [-m path] [-n limit] [-O outkey]\n"
+		    "\t      [-S arch] [-s section] name ...\n", stderr);
 		break;
 	case ARG_EXPR:
 		fputs("usage: apropos [-afk] [-C file] "
-		    "[-M path] [-m path] [-O outkey] [-S arch]\n"
-		    "\t       [-s section] expression ...\n", stderr);
+		    "[-M path] [-m path] [-n limit] [-O outkey]\n"
+		    "\t       [-S arch] [-s section] expression ...\n", stderr);
 		break;
 	}
 	exit((int)MANDOCLEVEL_BADARG);
@@ -995,6 +1025,9 @@ check_xr(void)
 		search.outkey = NULL;
 		search.argmode = ARG_NAME;
 		search.firstmatch = 1;
+		search.parallel = 0;
+		search.cache = 0;
+		search.limit = 0;
 		if (mansearch(&search, &paths, 1, &xr->name, NULL, &sz))
 			continue;
 		if (fs_search(&search, &paths, xr->name, NULL, &sz) != -1)
@@ -311,6 +311,7 @@ enum mandocerr	  mandoc_msg_getmin(void);
 void		  mandoc_msg_setmin(enum mandocerr);
 enum mandoclevel  mandoc_msg_getrc(void);
 void		  mandoc_msg_setrc(enum mandoclevel);
+void		  mandoc_msg_resetrc(void);
 void		  mandoc_msg(enum mandocerr, int, int, const char *, ...)
 			__attribute__((__format__ (__printf__, 4, 5)));
 void		  mandoc_msg_summary(void);
@@ -324,6 +324,16 @@ mandoc_msg_setrc(enum mandoclevel level)
 		rc = level;
 }
 
+/*
+ * Start over with a clean slate, for example before
+ * processing the next request in a long-running server.
+ */
+void
+mandoc_msg_resetrc(void)
+{
+	rc = MANDOCLEVEL_OK;
+}
+
 void
 mandoc_msg(enum mandocerr t, int line, int col, const char *fmt, ...)
 {
@@ -30,6 +30,8 @@
 #define	MPARSE_LATIN1	(1 << 5)  /* accept ISO-LATIN-1 input */
 #define	MPARSE_VALIDATE	(1 << 6)  /* call validation functions */
 #define	MPARSE_COMMENT	(1 << 7)  /* save comments in the tree */
+#define	MPARSE_STATS	(1 << 8)  /* measure the time spent reading */
+#define	MPARSE_HASH	(1 << 9)  /* hash the content of the file */
 
 
 struct	roff_meta;
@@ -40,5 +42,8 @@ void		  mparse_copy(const struct mparse *);
 void		  mparse_free(struct mparse *);
 int		  mparse_open(struct mparse *, const char *);
 void		  mparse_readfd(struct mparse *, int, const char *);
+double		  mparse_readtime(const struct mparse *);
 void		  mparse_reset(struct mparse *);
 struct roff_meta *mparse_result(struct mparse *);
+int		  mparse_sofiles(const struct mparse *);
+int		  mparse_hash(const struct mparse *, unsigned int *);
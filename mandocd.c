@@ -23,10 +23,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #if HAVE_ERR
 #include <err.h>
 #endif
+#include <errno.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -49,13 +51,15 @@ enum	outt {
 };
 
 static	void	  process(struct mparse *, enum outt, void *);
-static	int	  read_fds(int, int *);
+static	int	  read_fds(int, int *, int *);
+static	int	  serve(int, const char *, enum outt);
+static	int	  workers_run(int, const char *, enum outt, int);
 static	void	  usage(void) __attribute__((__noreturn__));
 
 
 #define NUM_FDS 3
 static int
-read_fds(int clientfd, int *fds)
+read_fds(int clientfd, int *fds, int *ack)
 {
 	struct msghdr	 msg;
 	struct iovec	 iov[1];
@@ -110,28 +114,23 @@ read_fds(int clientfd, int *fds)
 	for (cnt = 0; cnt < NUM_FDS; cnt++)
 		fds[cnt] = *walk++;
 
+	*ack = dummy[0] != '\0';
 	return 1;
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct manoutput	 options;
-	struct mparse		*parser;
-	void			*formatter;
 	const char		*defos;
 	const char		*errstr;
 	int			 clientfd;
-	int			 old_stdin;
-	int			 old_stdout;
-	int			 old_stderr;
-	int			 fds[3];
-	int			 state, opt;
+	int			 njobs, state, opt;
 	enum outt		 outtype;
 
 	defos = NULL;
+	njobs = 1;
 	outtype = OUTT_ASCII;
-	while ((opt = getopt(argc, argv, "I:T:")) != -1) {
+	while ((opt = getopt(argc, argv, "I:j:T:")) != -1) {
 		switch (opt) {
 		case 'I':
 			if (strncmp(optarg, "os=", 3) == 0)
@@ -141,6 +140,13 @@ main(int argc, char *argv[])
 				usage();
 			}
 			break;
+		case 'j':
+			njobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL) {
+				warnx("-j %s: %s", optarg, errstr);
+				usage();
+			}
+			break;
 		case 'T':
 			if (strcmp(optarg, "ascii") == 0)
 				outtype = OUTT_ASCII;
@@ -171,10 +177,77 @@ main(int argc, char *argv[])
 		errx(1, "file descriptor %s %s", argv[1], errstr);
 
 	mchars_alloc();
+	state = njobs == 1 ? serve(clientfd, defos, outtype) :
+	    workers_run(clientfd, defos, outtype, njobs);
+	mchars_free();
+	return state == -1 ? 1 : 0;
+}
+
+/*
+ * Fork the worker processes for -j and wait for them to exit.
+ * All workers read requests from the same socket, and each
+ * request is received by exactly one of them.  Each worker has
+ * its own parser and formatter and redirects its own stdio.
+ */
+static int
+workers_run(int clientfd, const char *defos, enum outt outtype, int njobs)
+{
+	int		 nworkers, state, status;
+
+	fflush(stdout);
+	fflush(stderr);
+	state = 1;
+	for (nworkers = 0; nworkers < njobs; nworkers++) {
+		switch (fork()) {
+		case -1:
+			warn("fork");
+			state = -1;
+			break;
+		case 0:
+			state = serve(clientfd, defos, outtype);
+			mchars_free();
+			exit(state == -1 ? 1 : 0);
+		default:
+			continue;
+		}
+		break;
+	}
+	close(clientfd);
+	while (nworkers > 0) {
+		if (wait(&status) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("wait");
+			return -1;
+		}
+		nworkers--;
+		if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0)
+			state = -1;
+	}
+	return state;
+}
+
+/*
+ * Format the manuals received on clientfd until the socket is closed.
+ */
+static int
+serve(int clientfd, const char *defos, enum outt outtype)
+{
+	struct manoutput	 options;
+	struct mparse		*parser;
+	void			*formatter;
+	int64_t			 reply[2];
+	int			 old_stdin;
+	int			 old_stdout;
+	int			 old_stderr;
+	int			 fds[3];
+	int			 ack, state;
+
 	parser = mparse_alloc(MPARSE_SO | MPARSE_UTF8 | MPARSE_LATIN1 |
 	    MPARSE_VALIDATE, MANDOC_OS_OTHER, defos);
 
 	memset(&options, 0, sizeof(options));
+	formatter = NULL;
 	switch (outtype) {
 	case OUTT_ASCII:
 		formatter = ascii_alloc(&options);
@@ -198,7 +271,7 @@ main(int argc, char *argv[])
 		state = -1;  /* error */
 	}
 
-	while (state == 1 && (state = read_fds(clientfd, fds)) == 1) {
+	while (state == 1 && (state = read_fds(clientfd, fds, &ack)) == 1) {
 		if (dup2(fds[0], STDIN_FILENO) == -1 ||
 		    dup2(fds[1], STDOUT_FILENO) == -1 ||
 		    dup2(fds[2], STDERR_FILENO) == -1) {
@@ -211,6 +284,7 @@ main(int argc, char *argv[])
 		close(fds[1]);
 		close(fds[2]);
 
+		mandoc_msg_resetrc();
 		process(parser, outtype, formatter);
 		mparse_reset(parser);
 		if (outtype == OUTT_HTML)
@@ -218,6 +292,9 @@ main(int argc, char *argv[])
 
 		fflush(stdout);
 		fflush(stderr);
+		reply[0] = mandoc_msg_getrc();
+		reply[1] = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+
 		/* Close file descriptors by restoring the old ones. */
 		if (dup2(old_stderr, STDERR_FILENO) == -1 ||
 		    dup2(old_stdout, STDOUT_FILENO) == -1 ||
@@ -226,6 +303,17 @@ main(int argc, char *argv[])
 			state = -1;
 			break;
 		}
+
+		/*
+		 * If the parent asked for it, report completion,
+		 * the message level, and the size of the output.
+		 */
+		if (ack && write(clientfd, reply, sizeof(reply)) !=
+		    sizeof(reply)) {
+			warn("write");
+			state = -1;
+			break;
+		}
 	}
 
 	close(clientfd);
@@ -239,8 +327,7 @@ main(int argc, char *argv[])
 		break;
 	}
 	mparse_free(parser);
-	mchars_free();
-	return state == -1 ? 1 : 0;
+	return state;
 }
 
 static void
@@ -277,6 +364,7 @@ process(struct mparse *parser, enum outt outtype, void *formatter)
 void
 usage(void)
 {
-	fprintf(stderr, "usage: mandocd [-I os=name] [-T output] socket_fd\n");
+	fprintf(stderr, "usage: mandocd [-I os=name] [-j jobs] [-T output] "
+	    "socket_fd\n");
 	exit(1);
 }
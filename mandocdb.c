@@ -21,8 +21,8 @@
 #include "config.h"
 
 #include <sys/types.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <ctype.h>
@@ -37,6 +37,10 @@
 #include "compat_fts.h"
 #endif
 #include <limits.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <regex.h>
 #if HAVE_SANDBOX_INIT
 #include <sandbox.h>
 #endif
@@ -46,7 +50,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "mandoc_aux.h"
 #include "mandoc_ohash.h"
@@ -56,9 +62,11 @@
 #include "man.h"
 #include "mandoc_parse.h"
 #include "manconf.h"
+#include "main.h"
 #include "mansearch.h"
 #include "dba_array.h"
 #include "dba.h"
+#include "dbm.h"
 
 extern const char *const mansearch_keynames[];
 
@@ -70,12 +78,37 @@ enum	op {
 	OP_TEST /* change no databases, report potential problems */
 };
 
+enum	outt {
+	OUTT_ASCII = 0, /* -c with -F ascii */
+	OUTT_UTF8, /* -c with -F utf8 */
+	OUTT_HTML /* -c with -F html */
+};
+
 struct	str {
 	const struct mpage *mpage; /* if set, the owning parse */
 	uint64_t	 mask; /* bitmask in sequence */
+	unsigned int	 order; /* of insertion, for -j */
 	char		 key[]; /* rendered text */
 };
 
+#define	ARENA_SIZE	(64 * 1024) /* default size of arena blocks */
+#define	TMP_PREFIX	".makewhatis." /* for -c output not yet complete */
+
+struct	arena {
+	struct arena	*next; /* older block */
+	size_t		 size; /* usable bytes in data */
+	size_t		 used; /* bytes handed out from data */
+	uint64_t	 data[]; /* storage for the keys of one page */
+};
+
+enum	mpres {
+	MPAGE_DONE, /* parsed, to be added to the database */
+	MPAGE_SO, /* .so link to another manual page */
+	MPAGE_SKIP, /* not to be added */
+	MPAGE_RETRY, /* result of a worker unusable, parse again */
+	MPAGE_FAIL /* worker process failed */
+};
+
 struct	inodev {
 	ino_t		 st_ino;
 	dev_t		 st_dev;
@@ -91,6 +124,9 @@ struct	mpage {
 	struct mpage	*next;    /* singly linked list */
 	struct mlink	*mlinks;  /* singly linked list */
 	int		 name_head_done;
+	int		 sofiles; /* content includes other files */
+	int		 hashed;  /* hash is valid */
+	unsigned int	 hash;    /* of the parsed file content */
 	enum form	 form;    /* format from file content */
 };
 
@@ -102,6 +138,12 @@ struct	mlink {
 	char		*fsec;    /* section from file name suffix */
 	struct mlink	*next;    /* singly linked list */
 	struct mpage	*mpage;   /* parent */
+	struct dba_array *dbpage; /* unchanged page in the old database */
+	struct dba_fprint fprint; /* fingerprint of the file */
+	time_t		 mtime;   /* modification time of the file */
+	long		 mtime_nsec; /* nanoseconds of mtime, or 0 */
+	int		 hashed;  /* fprint.hash is valid */
+	int		 noreuse; /* never keep its page, see dbreuse() */
 	int		 gzip;	  /* filename has a .gz suffix */
 	enum form	 dform;   /* format from directory */
 	enum form	 fform;   /* format from file name suffix */
@@ -110,18 +152,93 @@ struct	mlink {
 typedef	int (*mdoc_fp)(struct mpage *, const struct roff_meta *,
 			const struct roff_node *);
 
+/*
+ * One entry found in the directory tree by treescan().
+ */
+struct	scanent {
+	struct stat	 st;      /* of a file or of a link target */
+	char		*path;    /* relative to basedir */
+	char		*name;    /* last component of the path */
+	char		*real;    /* real path of a symbolic link */
+	int		 info;    /* fts_info */
+	int		 level;   /* fts_level relative to basedir */
+	int		 rerr;    /* errno of realpath(3) or 0 */
+	int		 serr;    /* errno of stat(2) or 0 */
+};
+
+struct	scanlist {
+	struct scanent	*ents;    /* in fts(3) order */
+	size_t		 sz;      /* number of entries */
+	size_t		 maxsz;   /* number of allocated entries */
+	char		*root;    /* directory passed to fts_open(3) */
+	int		 err;     /* errno of fts_open(3) or 0 */
+};
+
+struct	scan {
+	struct scanlist	 top;     /* the top level of the tree */
+	struct scanlist	*subs;    /* for each top level entry */
+	size_t		 next;    /* top level entry to read next */
+#if HAVE_PTHREAD
+	pthread_mutex_t	 mutex;   /* protects next */
+	int		 threaded;
+#endif
+};
+
 struct	mdoc_handler {
 	mdoc_fp		 fp; /* optional handler */
 	uint64_t	 mask;  /* set unless handler returns 0 */
 	int		 taboo;  /* node flags that must not be set */
 };
 
+#define	STATS_SLOW	10 /* number of slowest files shown by -S */
+
+enum	phase {
+	PHASE_SCAN = 0, /* treescan(), filescan() */
+	PHASE_DBREAD, /* dba_read(), dbreuse() */
+	PHASE_READ, /* opening, reading and decompressing files */
+	PHASE_PARSE, /* mdoc(7) and man(7) parsing */
+	PHASE_KEYS, /* key extraction, adding pages to the database */
+	PHASE_RENDER, /* -c */
+	PHASE_WAIT, /* waiting for -j worker processes */
+	PHASE_PRUNE, /* dbprune() */
+	PHASE_WRITE, /* dbwrite() */
+	PHASE_MAX
+};
+
+struct	slowfile {
+	double		 secs; /* time used by mpages_merge() */
+	char		 file[PATH_MAX]; /* filename rel. to manpath */
+};
+
+/*
+ * Statistics collected for one manpath with -S.
+ */
+struct	timing {
+	double		 start; /* when the manpath was started */
+	double		 secs[PHASE_MAX]; /* time spent in each phase */
+	double		 readtime; /* mparse_readtime() at the start */
+	size_t		 pages; /* parsed pages */
+	size_t		 kept; /* pages kept from the old database */
+	size_t		 bytes; /* size of the parsed files */
+	struct slowfile	 slow[STATS_SLOW]; /* slowest first */
+	size_t		 nslow; /* used entries in slow[] */
+};
+
 
 int		 mandocdb(int, char *[]);
 
+static	void	*arena_alloc(size_t);
+static	void	 arena_free(void);
+static	void	 arena_reset(void);
 static	void	 dbadd(struct dba *, struct mpage *);
-static	void	 dbadd_mlink(const struct mlink *);
+static	void	 dbadd_mlink(struct dba *, struct mlink *);
 static	void	 dbprune(struct dba *);
+static	void	 dbreuse(struct dba *);
+static	int32_t	 dbopts_version(void);
+static	void	 dbreuse_drop(struct dba_array *);
+static	int	 catdir_mkdirs(const char *);
+static	int	 catdir_path(const char *, char *);
+static	int	 catdir_stale(struct dba_array *);
 static	void	 dbwrite(struct dba *);
 static	void	 filescan(const char *);
 #if HAVE_FTS_COMPARE_CONST
@@ -130,11 +247,27 @@ static	int	 fts_compare(const FTSENT *const *, const FTSENT *const *);
 static	int	 fts_compare(const FTSENT **, const FTSENT **);
 #endif
 static	void	 mlink_add(struct mlink *, const struct stat *);
+static	int	 mlink_dupe(const struct mlink *, char [PATH_MAX]);
+static	int	 mlink_hash(struct mlink *);
+static	int	 mlink_same(struct dba *, struct mlink *, const char *);
+static	void	 mlink_fprint(struct dba *, const struct mlink *);
 static	void	 mlink_check(struct mpage *, struct mlink *);
 static	void	 mlink_free(struct mlink *);
 static	void	 mlinks_undupe(struct mpage *);
 static	void	 mpages_free(void);
 static	void	 mpages_merge(struct dba *, struct mparse *);
+static	int	 mpage_parse(struct mparse *, struct mpage *,
+			struct mlink **);
+static	struct mlink *mlink_sodest(const char *);
+static	void	 mpage_so(struct dba *, struct mpage *, struct mlink *);
+static	void	 mpage_add(struct dba *, struct mpage *);
+static	void	 mpage_keys_free(void);
+static	void	 mpage_render(const struct mpage *,
+			const struct roff_meta *);
+static	void	 mpage_reset(struct mpage *);
+static	int	 mpage_recv(FILE *, struct mpage *, struct mlink **);
+static	void	 mpage_send(FILE *, const struct mpage *, int,
+			const struct mlink *);
 static	void	 parse_cat(struct mpage *, int);
 static	void	 parse_man(struct mpage *, const struct roff_meta *,
 			const struct roff_node *);
@@ -165,20 +298,52 @@ static	void	 putkey(const struct mpage *, char *, uint64_t);
 static	void	 putkeys(const struct mpage *, char *, size_t, uint64_t);
 static	void	 putmdockey(const struct mpage *,
 			const struct roff_node *, uint64_t, int);
-static	int	 render_string(char **, size_t *);
+static	void	 render_string(char **, size_t *);
 static	void	 say(const char *, const char *, ...)
 			__attribute__((__format__ (__printf__, 2, 3)));
 static	int	 set_basedir(const char *, int);
+static	void	 timing_add(enum phase, double *);
+static	double	 timing_now(void);
+static	void	 timing_page(const char *, double);
+static	void	 timing_print(const struct mparse *);
+static	void	 timing_start(const struct mparse *);
 static	int	 treescan(void);
+static	void	 treescan_ent(struct scanent *, enum form *,
+			char **, char **);
+static	void	 scan_run(struct scan *);
+#if HAVE_PTHREAD
+static	void	*scan_thread(void *);
+#endif
+static	int	 scan_tree(struct scanlist *, const char *, int);
+static	void	 scanlist_free(struct scanlist *);
 static	size_t	 utf8(unsigned int, char [7]);
+static	int	 worker_getint(FILE *, int32_t *);
+static	int	 worker_getkeys(FILE *, const struct mpage *,
+			uint64_t *, struct ohash *);
+static	int	 worker_getstr(FILE *, char **);
+static	void	 worker_putint(FILE *, int32_t);
+static	void	 worker_putkeys(FILE *, const uint64_t *, struct ohash *);
+static	void	 worker_putstr(FILE *, const char *);
+static	void	 worker_run(struct mparse *, int, int)
+			__attribute__((__noreturn__));
+static	FILE	**workers_start(struct mparse *);
+static	void	 workers_stop(FILE **);
 
 static	int		 nodb; /* no database changes */
+static	int32_t		 dbopts; /* options affecting the content */
+static	int		 njobs; /* number of parsing processes */
 static	int		 mparse_options; /* abort the parse early */
 static	int		 use_all; /* use all found files */
+static	int		 use_trigrams; /* write the trigram index */
 static	int		 debug; /* print what we're doing */
+static	int		 stats; /* print statistics */
 static	int		 warnings; /* warn about crap */
 static	int		 write_utf8; /* write UTF-8 output; else ASCII */
 static	int		 exitcode; /* to be returned by main */
+static	int		 catdir = -1; /* directory for formatted pages */
+static	time_t		 scantime; /* when the current scan started */
+static	enum outt	 outtype; /* format of formatted pages */
+static	void		*formatter; /* for formatted pages */
 static	enum op		 op; /* operational mode */
 static	char		 basedir[PATH_MAX]; /* current base directory */
 static	size_t		 basedir_len; /* strlen(basedir) */
@@ -187,7 +352,9 @@ static	struct ohash	 mpages; /* table of distinct manual pages */
 static	struct ohash	 mlinks; /* table of directory entries */
 static	struct ohash	 names; /* table of all names */
 static	struct ohash	 strings; /* table of all strings */
+static	struct arena	*arena; /* storage for the keys in both tables */
 static	uint64_t	 name_mask;
+static	struct timing	 timing; /* statistics for -S */
 
 static	const struct mdoc_handler mdoc_handlers[MDOC_MAX - MDOC_Dd] = {
 	{ NULL, 0, NODE_NOPRT },  /* Dd */
@@ -317,14 +484,16 @@ int
 mandocdb(int argc, char *argv[])
 {
 	struct manconf	  conf;
+	struct manoutput  outopts;
 	struct mparse	 *mp;
 	struct dba	 *dba;
-	const char	 *path_arg, *progname;
+	const char	 *catdir_arg, *errstr, *path_arg, *progname;
+	double		  t;
 	size_t		  j, sz;
 	int		  ch, i;
 
 #if HAVE_PLEDGE
-	if (pledge("stdio rpath wpath cpath", NULL) == -1) {
+	if (pledge("stdio rpath wpath cpath proc", NULL) == -1) {
 		warn("pledge");
 		return (int)MANDOCLEVEL_SYSERR;
 	}
@@ -351,10 +520,11 @@ mandocdb(int argc, char *argv[])
 	} while (/*CONSTCOND*/0)
 
 	mparse_options = MPARSE_VALIDATE;
-	path_arg = NULL;
+	catdir_arg = path_arg = NULL;
 	op = OP_DEFAULT;
+	njobs = 1;
 
-	while ((ch = getopt(argc, argv, "aC:Dd:npQT:tu:v")) != -1)
+	while ((ch = getopt(argc, argv, "aC:c:Dd:F:ij:npQST:tu:v")) != -1)
 		switch (ch) {
 		case 'a':
 			use_all = 1;
@@ -364,6 +534,9 @@ mandocdb(int argc, char *argv[])
 			path_arg = optarg;
 			op = OP_CONFFILE;
 			break;
+		case 'c':
+			catdir_arg = optarg;
+			break;
 		case 'D':
 			debug++;
 			break;
@@ -372,6 +545,28 @@ mandocdb(int argc, char *argv[])
 			path_arg = optarg;
 			op = OP_UPDATE;
 			break;
+		case 'F':
+			if (strcmp(optarg, "ascii") == 0)
+				outtype = OUTT_ASCII;
+			else if (strcmp(optarg, "utf8") == 0)
+				outtype = OUTT_UTF8;
+			else if (strcmp(optarg, "html") == 0)
+				outtype = OUTT_HTML;
+			else {
+				warnx("-F %s: Bad argument", optarg);
+				goto usage;
+			}
+			break;
+		case 'i':
+			use_trigrams = 1;
+			break;
+		case 'j':
+			njobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL) {
+				warnx("-j %s: %s", optarg, errstr);
+				goto usage;
+			}
+			break;
 		case 'n':
 			nodb = 1;
 			break;
@@ -381,6 +576,10 @@ mandocdb(int argc, char *argv[])
 		case 'Q':
 			mparse_options |= MPARSE_QUICK;
 			break;
+		case 'S':
+			stats = 1;
+			mparse_options |= MPARSE_STATS;
+			break;
 		case 'T':
 			if (strcmp(optarg, "utf8") != 0) {
 				warnx("-T%s: Unsupported output format",
@@ -410,9 +609,54 @@ mandocdb(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	dbopts = (mparse_options & MPARSE_QUICK ? DBOPT_QUICK : 0) |
+	    (write_utf8 ? DBOPT_UTF8 : 0) | (use_all ? DBOPT_ALL : 0) |
+	    (use_trigrams ? DBOPT_TRIGRAM : 0) | dbopts_version();
+
+	/*
+	 * Let the parser hash the files it reads anyway,
+	 * such that the fingerprints need no second pass.
+	 */
+
+	if (nodb == 0)
+		mparse_options |= MPARSE_HASH;
+
+	/*
+	 * With -c, format each page right after parsing it,
+	 * such that the formatted versions need not be made
+	 * by a separate catman(8) run parsing everything again.
+	 */
+
+	if (catdir_arg != NULL) {
+		if (op == OP_TEST || mparse_options & MPARSE_QUICK) {
+			warnx("-c: Conflicting option");
+			goto usage;
+		}
+		if ((catdir = open(catdir_arg,
+		    O_RDONLY | O_DIRECTORY)) == -1) {
+			warn("open(%s)", catdir_arg);
+			return (int)MANDOCLEVEL_BADARG;
+		}
+		memset(&outopts, 0, sizeof(outopts));
+		switch (outtype) {
+		case OUTT_ASCII:
+			formatter = ascii_alloc(&outopts);
+			break;
+		case OUTT_UTF8:
+			formatter = utf8_alloc(&outopts);
+			break;
+		case OUTT_HTML:
+			outopts.fragment = 1;
+			formatter = html_alloc(&outopts);
+			break;
+		}
+	}
+
 #if HAVE_PLEDGE
-	if (nodb) {
-		if (pledge("stdio rpath", NULL) == -1) {
+	if ((nodb || njobs == 1) && catdir == -1) {
+		if (pledge(nodb && njobs == 1 ? "stdio rpath" :
+		    nodb ? "stdio rpath proc" :
+		    "stdio rpath wpath cpath", NULL) == -1) {
 			warn("pledge");
 			return (int)MANDOCLEVEL_SYSERR;
 		}
@@ -439,7 +683,11 @@ mandocdb(int argc, char *argv[])
 		if (op != OP_TEST && set_basedir(path_arg, 1) == 0)
 			goto out;
 
+		timing_start(mp);
+		scantime = time(NULL);
+		t = timing_now();
 		dba = nodb ? dba_new(128) : dba_read(MANDOC_DB);
+		timing_add(PHASE_DBREAD, &t);
 		if (dba != NULL) {
 			/*
 			 * The existing database is usable.  Process
@@ -448,8 +696,10 @@ mandocdb(int argc, char *argv[])
 			use_all = 1;
 			for (i = 0; i < argc; i++)
 				filescan(argv[i]);
+			timing_add(PHASE_SCAN, &t);
 			if (nodb == 0)
 				dbprune(dba);
+			timing_add(PHASE_PRUNE, &t);
 		} else {
 			/* Database missing or corrupt. */
 			if (op != OP_UPDATE || errno != ENOENT)
@@ -459,13 +709,18 @@ mandocdb(int argc, char *argv[])
 			op = OP_DEFAULT;
 			if (treescan() == 0)
 				goto out;
+			timing_add(PHASE_SCAN, &t);
 			dba = dba_new(128);
+			dba->fopts = dbopts;
 		}
 		if (op != OP_DELETE)
 			mpages_merge(dba, mp);
+		t = timing_now();
 		if (nodb == 0)
 			dbwrite(dba);
+		timing_add(PHASE_WRITE, &t);
 		dba_free(dba);
+		timing_print(mp);
 	} else {
 		/*
 		 * If we have arguments, use them as our manpaths.
@@ -507,13 +762,42 @@ mandocdb(int argc, char *argv[])
 
 			if (set_basedir(conf.manpath.paths[j], argc > 0) == 0)
 				continue;
+			timing_start(mp);
+			scantime = time(NULL);
+			t = timing_now();
 			if (treescan() == 0)
 				continue;
-			dba = dba_new(128);
+			timing_add(PHASE_SCAN, &t);
+
+			/*
+			 * Unless the options changed, only parse the
+			 * manuals that are new or changed since the
+			 * last run and keep the others.
+			 * The trigram index is made from the pages
+			 * table when writing, so -i needs no parsing.
+			 */
+
+			dba = NULL;
+			if (nodb == 0 && warnings == 0 &&
+			    (dba = dba_read(MANDOC_DB)) != NULL &&
+			    (dba->fopts & ~DBOPT_TRIGRAM) !=
+			    (dbopts & ~DBOPT_TRIGRAM)) {
+				dba_free(dba);
+				dba = NULL;
+			}
+			if (dba != NULL)
+				dbreuse(dba);
+			else
+				dba = dba_new(128);
+			dba->fopts = dbopts;
+			timing_add(PHASE_DBREAD, &t);
 			mpages_merge(dba, mp);
+			t = timing_now();
 			if (nodb == 0)
 				dbwrite(dba);
+			timing_add(PHASE_WRITE, &t);
 			dba_free(dba);
+			timing_print(mp);
 
 			if (j + 1 < conf.manpath.sz) {
 				mpages_free();
@@ -523,6 +807,13 @@ mandocdb(int argc, char *argv[])
 		}
 	}
 out:
+	if (catdir != -1) {
+		if (outtype == OUTT_HTML)
+			html_free(formatter);
+		else
+			ascii_free(formatter);
+		close(catdir);
+	}
 	manconf_free(&conf);
 	mparse_free(mp);
 	mchars_free();
@@ -532,10 +823,13 @@ out:
 	return exitcode;
 usage:
 	progname = getprogname();
-	fprintf(stderr, "usage: %s [-aDnpQ] [-C file] [-Tutf8]\n"
-			"       %s [-aDnpQ] [-Tutf8] dir ...\n"
-			"       %s [-DnpQ] [-Tutf8] -d dir [file ...]\n"
-			"       %s [-Dnp] -u dir [file ...]\n"
+	fprintf(stderr, "usage: %s [-aDinpQS] [-c dstdir [-F output]] "
+			"[-j jobs] [-Tutf8] [-C file]\n"
+			"       %s [-aDinpQS] [-c dstdir [-F output]] "
+			"[-j jobs] [-Tutf8] dir ...\n"
+			"       %s [-DnpQS] [-c dstdir [-F output]] "
+			"[-j jobs] [-Tutf8] -d dir [file ...]\n"
+			"       %s [-DnpS] -u dir [file ...]\n"
 			"       %s [-Q] -t file ...\n",
 		        progname, progname, progname, progname, progname);
 
@@ -568,203 +862,416 @@ fts_compare(const FTSENT **a, const FTSENT **b)
  *   or
  *   [./]cat<section>[/<arch>]/<name>.0
  *
+ * The top level is read first.  The manX/ and catX/ directories
+ * below it are read by scan_run(), with -j in several threads
+ * at the same time, which helps on slow file systems.
+ * Finally, all entries are handled in fts(3) order by treescan_ent(),
+ * such that the result does not depend on the number of threads.
+ *
  * TODO: accommodate for multi-language directories.
  */
 static int
 treescan(void)
 {
-	char		 buf[PATH_MAX];
-	FTS		*f;
-	FTSENT		*ff;
-	struct mlink	*mlink;
-	int		 gzip;
+	struct scan	 scan;
+	struct scanlist	*list;
+	size_t		 i, j;
 	enum form	 dform;
-	char		*dsec, *arch, *fsec, *cp;
-	const char	*path;
-	const char	*argv[2];
-
-	argv[0] = ".";
-	argv[1] = NULL;
+	char		*dsec, *arch;
+#if HAVE_PTHREAD
+	pthread_t	*threads;
+	size_t		 nthreads;
+	int		 irc;
+#endif
 
-	f = fts_open((char * const *)argv, FTS_PHYSICAL | FTS_NOCHDIR,
-	    fts_compare);
-	if (f == NULL) {
+	memset(&scan, 0, sizeof(scan));
+	if (scan_tree(&scan.top, ".", 1) == 0) {
 		exitcode = (int)MANDOCLEVEL_SYSERR;
+		errno = scan.top.err;
 		say("", "&fts_open");
 		return 0;
 	}
+	scan.subs = mandoc_calloc(scan.top.sz, sizeof(*scan.subs));
+
+#if HAVE_PTHREAD
+	/*
+	 * With -j, read the directories in several threads.
+	 * If a thread cannot be created, the main thread
+	 * helps the others.
+	 */
+
+	nthreads = 0;
+	threads = NULL;
+	if (njobs > 1) {
+		if ((irc = pthread_mutex_init(&scan.mutex, NULL)) != 0) {
+			errno = irc;
+			err((int)MANDOCLEVEL_SYSERR, "pthread_mutex_init");
+		}
+		scan.threaded = 1;
+		threads = mandoc_reallocarray(NULL, njobs, sizeof(*threads));
+		for (; nthreads < (size_t)njobs; nthreads++) {
+			if ((irc = pthread_create(threads + nthreads,
+			    NULL, scan_thread, &scan)) != 0) {
+				errno = irc;
+				say("", "&pthread_create");
+				break;
+			}
+		}
+	}
+#endif
+	scan_run(&scan);
+#if HAVE_PTHREAD
+	if (scan.threaded) {
+		for (i = 0; i < nthreads; i++) {
+			if ((irc = pthread_join(threads[i], NULL)) != 0) {
+				errno = irc;
+				err((int)MANDOCLEVEL_SYSERR, "pthread_join");
+			}
+		}
+		free(threads);
+		pthread_mutex_destroy(&scan.mutex);
+	}
+#endif
+
+	/* Handle all entries in the order of a single fts(3) walk. */
 
 	dsec = arch = NULL;
 	dform = FORM_NONE;
+	for (i = 0; i < scan.top.sz; i++) {
+		treescan_ent(scan.top.ents + i, &dform, &dsec, &arch);
+		list = scan.subs + i;
+		if (list->err != 0) {
+			exitcode = (int)MANDOCLEVEL_SYSERR;
+			errno = list->err;
+			say(scan.top.ents[i].path, "&fts_open");
+		}
+		for (j = 0; j < list->sz; j++)
+			treescan_ent(list->ents + j, &dform, &dsec, &arch);
+		scanlist_free(list);
+	}
+	scanlist_free(&scan.top);
+	free(scan.subs);
+	return 1;
+}
 
-	while ((ff = fts_read(f)) != NULL) {
-		path = ff->fts_path + 2;
-		switch (ff->fts_info) {
+/*
+ * Handle one entry found by fts(3) in the directory tree,
+ * adding an mlink for each manual page file.
+ */
+static void
+treescan_ent(struct scanent *ent, enum form *dform, char **dsec,
+    char **arch)
+{
+	struct mlink	*mlink;
+	char		*cp, *fsec;
+	const char	*path;
+	int		 gzip;
 
-		/*
-		 * Symbolic links require various sanity checks,
-		 * then get handled just like regular files.
-		 */
-		case FTS_SL:
-			if (realpath(path, buf) == NULL) {
-				if (warnings)
-					say(path, "&realpath");
-				continue;
+	path = ent->path;
+	switch (ent->info) {
+
+	/*
+	 * Symbolic links require various sanity checks,
+	 * then get handled just like regular files.
+	 */
+	case FTS_SL:
+		if (ent->real == NULL) {
+			if (warnings) {
+				errno = ent->rerr;
+				say(path, "&realpath");
 			}
-			if (strncmp(buf, basedir, basedir_len) != 0
+			return;
+		}
+		if (strncmp(ent->real, basedir, basedir_len) != 0
 #ifdef HOMEBREWDIR
-			    && strncmp(buf, HOMEBREWDIR, strlen(HOMEBREWDIR))
+		    && strncmp(ent->real, HOMEBREWDIR, strlen(HOMEBREWDIR))
 #endif
-			) {
-				if (warnings) say("",
-				    "%s: outside base directory", buf);
-				continue;
-			}
-			/* Use logical inode to avoid mpages dupe. */
-			if (stat(path, ff->fts_statp) == -1) {
-				if (warnings)
-					say(path, "&stat");
-				continue;
+		) {
+			if (warnings) say("",
+			    "%s: outside base directory", ent->real);
+			return;
+		}
+		/* Use logical inode to avoid mpages dupe. */
+		if (ent->serr != 0) {
+			if (warnings) {
+				errno = ent->serr;
+				say(path, "&stat");
 			}
-			/* FALLTHROUGH */
+			return;
+		}
+		/* FALLTHROUGH */
 
-		/*
-		 * If we're a regular file, add an mlink by using the
-		 * stored directory data and handling the filename.
-		 */
-		case FTS_F:
-			if ( ! strcmp(path, MANDOC_DB))
-				continue;
-			if ( ! use_all && ff->fts_level < 2) {
-				if (warnings)
-					say(path, "Extraneous file");
-				continue;
-			}
-			gzip = 0;
+	/*
+	 * If we're a regular file, add an mlink by using the
+	 * stored directory data and handling the filename.
+	 */
+	case FTS_F:
+		if ( ! strcmp(path, MANDOC_DB))
+			return;
+		if ( ! use_all && ent->level < 2) {
+			if (warnings)
+				say(path, "Extraneous file");
+			return;
+		}
+		gzip = 0;
+		fsec = NULL;
+		while (fsec == NULL) {
+			fsec = strrchr(ent->name, '.');
+			if (fsec == NULL || strcmp(fsec+1, "gz"))
+				break;
+			gzip = 1;
+			*fsec = '\0';
 			fsec = NULL;
-			while (fsec == NULL) {
-				fsec = strrchr(ff->fts_name, '.');
-				if (fsec == NULL || strcmp(fsec+1, "gz"))
-					break;
-				gzip = 1;
-				*fsec = '\0';
-				fsec = NULL;
-			}
-			if (fsec == NULL) {
-				if ( ! use_all) {
-					if (warnings)
-						say(path,
-						    "No filename suffix");
-					continue;
-				}
-			} else if ( ! strcmp(++fsec, "html")) {
-				if (warnings)
-					say(path, "Skip html");
-				continue;
-			} else if ( ! strcmp(fsec, "ps")) {
-				if (warnings)
-					say(path, "Skip ps");
-				continue;
-			} else if ( ! strcmp(fsec, "pdf")) {
-				if (warnings)
-					say(path, "Skip pdf");
-				continue;
-			} else if ( ! use_all &&
-			    ((dform == FORM_SRC &&
-			      strncmp(fsec, dsec, strlen(dsec))) ||
-			     (dform == FORM_CAT && strcmp(fsec, "0")))) {
+		}
+		if (fsec == NULL) {
+			if ( ! use_all) {
 				if (warnings)
-					say(path, "Wrong filename suffix");
-				continue;
-			} else
-				fsec[-1] = '\0';
-
-			mlink = mandoc_calloc(1, sizeof(struct mlink));
-			if (strlcpy(mlink->file, path,
-			    sizeof(mlink->file)) >=
-			    sizeof(mlink->file)) {
-				say(path, "Filename too long");
-				free(mlink);
-				continue;
+					say(path, "No filename suffix");
+				return;
 			}
-			mlink->dform = dform;
-			mlink->dsec = dsec;
-			mlink->arch = arch;
-			mlink->name = ff->fts_name;
-			mlink->fsec = fsec;
-			mlink->gzip = gzip;
-			mlink_add(mlink, ff->fts_statp);
-			continue;
+		} else if ( ! strcmp(++fsec, "html")) {
+			if (warnings)
+				say(path, "Skip html");
+			return;
+		} else if ( ! strcmp(fsec, "ps")) {
+			if (warnings)
+				say(path, "Skip ps");
+			return;
+		} else if ( ! strcmp(fsec, "pdf")) {
+			if (warnings)
+				say(path, "Skip pdf");
+			return;
+		} else if ( ! use_all &&
+		    ((*dform == FORM_SRC &&
+		      strncmp(fsec, *dsec, strlen(*dsec))) ||
+		     (*dform == FORM_CAT && strcmp(fsec, "0")))) {
+			if (warnings)
+				say(path, "Wrong filename suffix");
+			return;
+		} else
+			fsec[-1] = '\0';
+
+		mlink = mandoc_calloc(1, sizeof(struct mlink));
+		if (strlcpy(mlink->file, path,
+		    sizeof(mlink->file)) >=
+		    sizeof(mlink->file)) {
+			say(path, "Filename too long");
+			free(mlink);
+			return;
+		}
+		mlink->dform = *dform;
+		mlink->dsec = *dsec;
+		mlink->arch = *arch;
+		mlink->name = ent->name;
+		mlink->fsec = fsec;
+		mlink->gzip = gzip;
+		mlink_add(mlink, &ent->st);
+		return;
+
+	case FTS_D:
+	case FTS_DP:
+		break;
+
+	default:
+		if (warnings)
+			say(path, "Not a regular file");
+		return;
+	}
 
-		case FTS_D:
-		case FTS_DP:
+	switch (ent->level) {
+	case 1:
+		/*
+		 * This might contain manX/ or catX/.
+		 * Try to infer this from the name.
+		 * If we're not in use_all, enforce it.
+		 */
+		cp = ent->name;
+		if (ent->info == FTS_DP) {
+			*dform = FORM_NONE;
+			*dsec = NULL;
 			break;
+		}
 
-		default:
-			if (warnings)
-				say(path, "Not a regular file");
-			continue;
+		if ( ! strncmp(cp, "man", 3)) {
+			*dform = FORM_SRC;
+			*dsec = cp + 3;
+		} else if ( ! strncmp(cp, "cat", 3)) {
+			*dform = FORM_CAT;
+			*dsec = cp + 3;
+		} else {
+			*dform = FORM_NONE;
+			*dsec = NULL;
 		}
 
-		switch (ff->fts_level) {
-		case 0:
-			/* Ignore the root directory. */
+		/* Otherwise, scan_run() did not read it. */
+
+		if (*dsec != NULL || use_all)
 			break;
-		case 1:
-			/*
-			 * This might contain manX/ or catX/.
-			 * Try to infer this from the name.
-			 * If we're not in use_all, enforce it.
-			 */
-			cp = ff->fts_name;
-			if (ff->fts_info == FTS_DP) {
-				dform = FORM_NONE;
-				dsec = NULL;
-				break;
-			}
 
-			if ( ! strncmp(cp, "man", 3)) {
-				dform = FORM_SRC;
-				dsec = cp + 3;
-			} else if ( ! strncmp(cp, "cat", 3)) {
-				dform = FORM_CAT;
-				dsec = cp + 3;
-			} else {
-				dform = FORM_NONE;
-				dsec = NULL;
-			}
+		if (warnings)
+			say(path, "Unknown directory part");
+		break;
+	case 2:
+		/*
+		 * Possibly our architecture.
+		 * If we're descending, keep tabs on it.
+		 */
+		if (ent->info != FTS_DP && *dsec != NULL)
+			*arch = ent->name;
+		else
+			*arch = NULL;
+		break;
+	default:
+		/* Skipped by scan_tree(). */
+		if (ent->info == FTS_DP || use_all)
+			break;
+		if (warnings)
+			say(path, "Extraneous directory part");
+		break;
+	}
+}
 
-			if (dsec != NULL || use_all)
-				break;
+#if HAVE_PTHREAD
+static void *
+scan_thread(void *arg)
+{
+	scan_run(arg);
+	return NULL;
+}
+#endif
 
-			if (warnings)
-				say(path, "Unknown directory part");
+/*
+ * Read the directories below the top level that may contain
+ * manual pages, each into its own list, until none is left.
+ */
+static void
+scan_run(struct scan *scan)
+{
+	struct scanent	*ent;
+	size_t		 i;
+#if HAVE_PTHREAD
+	int		 irc;
+#endif
+
+	for (;;) {
+#if HAVE_PTHREAD
+		if (scan->threaded &&
+		    (irc = pthread_mutex_lock(&scan->mutex)) != 0) {
+			errno = irc;
+			err((int)MANDOCLEVEL_SYSERR, "pthread_mutex_lock");
+		}
+#endif
+		i = scan->next++;
+#if HAVE_PTHREAD
+		if (scan->threaded &&
+		    (irc = pthread_mutex_unlock(&scan->mutex)) != 0) {
+			errno = irc;
+			err((int)MANDOCLEVEL_SYSERR, "pthread_mutex_unlock");
+		}
+#endif
+		if (i >= scan->top.sz)
+			break;
+		ent = scan->top.ents + i;
+		if (ent->info == FTS_D && (use_all ||
+		    strncmp(ent->name, "man", 3) == 0 ||
+		    strncmp(ent->name, "cat", 3) == 0))
+			(void)scan_tree(scan->subs + i, ent->path, 0);
+	}
+}
+
+/*
+ * Read one directory tree with fts(3) and record its entries,
+ * except for the root directory itself, calling stat(2) and
+ * realpath(3) on symbolic links right away.
+ * For the top level, do not descend into directories.
+ * Below the top level, skip the directories that treescan_ent()
+ * refuses to descend into.
+ * This function may run in several threads at the same time,
+ * so it does not print messages or change global variables.
+ */
+static int
+scan_tree(struct scanlist *list, const char *dir, int top)
+{
+	char		 buf[PATH_MAX];
+	const char	*argv[2];
+	FTS		*f;
+	FTSENT		*ff;
+	struct scanent	*ent;
+	int		 level;
+
+	if (top)
+		argv[0] = dir;
+	else {
+		mandoc_asprintf(&list->root, "./%s", dir);
+		argv[0] = list->root;
+	}
+	argv[1] = NULL;
+
+	f = fts_open((char * const *)argv, FTS_PHYSICAL | FTS_NOCHDIR,
+	    fts_compare);
+	if (f == NULL) {
+		list->err = errno;
+		return 0;
+	}
+
+	while ((ff = fts_read(f)) != NULL) {
+		level = ff->fts_level + (top ? 0 : 1);
+
+		/* The root directory of a subtree is a top level entry. */
+
+		if (ff->fts_level == 0 && (top || ff->fts_info == FTS_D))
+			continue;
+
+		if (ff->fts_info == FTS_D &&
+		    (top || (level > 2 && use_all == 0)))
 			fts_set(f, ff, FTS_SKIP);
+
+		if (list->sz == list->maxsz) {
+			list->maxsz = list->maxsz ? list->maxsz * 2 : 64;
+			list->ents = mandoc_reallocarray(list->ents,
+			    list->maxsz, sizeof(*list->ents));
+		}
+		ent = list->ents + list->sz++;
+		memset(ent, 0, sizeof(*ent));
+		ent->path = mandoc_strdup(ff->fts_path + 2);
+		ent->name = mandoc_strdup(ff->fts_name);
+		ent->info = ff->fts_info;
+		ent->level = level;
+		switch (ent->info) {
+		case FTS_SL:
+			if (realpath(ent->path, buf) == NULL) {
+				ent->rerr = errno;
+				break;
+			}
+			ent->real = mandoc_strdup(buf);
+			if (stat(ent->path, &ent->st) == -1)
+				ent->serr = errno;
 			break;
-		case 2:
-			/*
-			 * Possibly our architecture.
-			 * If we're descending, keep tabs on it.
-			 */
-			if (ff->fts_info != FTS_DP && dsec != NULL)
-				arch = ff->fts_name;
-			else
-				arch = NULL;
+		case FTS_F:
+			ent->st = *ff->fts_statp;
 			break;
 		default:
-			if (ff->fts_info == FTS_DP || use_all)
-				break;
-			if (warnings)
-				say(path, "Extraneous directory part");
-			fts_set(f, ff, FTS_SKIP);
 			break;
 		}
 	}
-
 	fts_close(f);
 	return 1;
 }
 
+static void
+scanlist_free(struct scanlist *list)
+{
+	size_t		 i;
+
+	for (i = 0; i < list->sz; i++) {
+		free(list->ents[i].path);
+		free(list->ents[i].name);
+		free(list->ents[i].real);
+	}
+	free(list->ents);
+	free(list->root);
+}
+
 /*
  * Add a file to the mlinks table.
  * Do not verify that it's a "valid" looking manpage (we'll do that
@@ -1006,6 +1513,14 @@ mlink_add(struct mlink *mlink, const struct stat *st)
 	assert(NULL == ohash_find(&mlinks, slot));
 	ohash_insert(&mlinks, slot, mlink);
 
+	mlink->fprint.ino = (int32_t)st->st_ino;
+	mlink->fprint.size = (int32_t)st->st_size;
+	mlink->fprint.mtime = (int32_t)st->st_mtime;
+	mlink->mtime = st->st_mtime;
+#if HAVE_ST_MTIM
+	mlink->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+
 	memset(&inodev, 0, sizeof(inodev));  /* Clear padding. */
 	inodev.st_ino = st->st_ino;
 	inodev.st_dev = st->st_dev;
@@ -1069,7 +1584,6 @@ mlinks_undupe(struct mpage *mpage)
 	char		  buf[PATH_MAX];
 	struct mlink	**prev;
 	struct mlink	 *mlink;
-	char		 *bufp;
 
 	mpage->form = FORM_CAT;
 	prev = &mpage->mlinks;
@@ -1078,15 +1592,7 @@ mlinks_undupe(struct mpage *mpage)
 			mpage->form = FORM_NONE;
 			goto nextlink;
 		}
-		(void)strlcpy(buf, mlink->file, sizeof(buf));
-		bufp = strstr(buf, "cat");
-		assert(NULL != bufp);
-		memcpy(bufp, "man", 3);
-		if (NULL != (bufp = strrchr(buf, '.')))
-			*++bufp = '\0';
-		(void)strlcat(buf, mlink->dsec, sizeof(buf));
-		if (NULL == ohash_find(&mlinks,
-		    ohash_qlookup(&mlinks, buf)))
+		if (mlink_dupe(mlink, buf) == 0)
 			goto nextlink;
 		if (warnings)
 			say(mlink->file, "Man source exists: %s", buf);
@@ -1100,6 +1606,78 @@ nextlink:
 	}
 }
 
+/*
+ * Check whether a formatted mlink has a source manual
+ * by the same name, and return the name of the source in buf.
+ */
+static int
+mlink_dupe(const struct mlink *mlink, char buf[PATH_MAX])
+{
+	char		 *bufp;
+
+	if (mlink->dform != FORM_CAT)
+		return 0;
+	(void)strlcpy(buf, mlink->file, PATH_MAX);
+	bufp = strstr(buf, "cat");
+	assert(NULL != bufp);
+	memcpy(bufp, "man", 3);
+	if (NULL != (bufp = strrchr(buf, '.')))
+		*++bufp = '\0';
+	(void)strlcat(buf, mlink->dsec, PATH_MAX);
+	return ohash_find(&mlinks, ohash_qlookup(&mlinks, buf)) != NULL;
+}
+
+/*
+ * Compute the hash of the content of the file of an mlink,
+ * using the 32-bit FNV-1a function on the decompressed data,
+ * like mparse_hash(3).  Only needed for files not parsed
+ * in this run, or for formatted pages.
+ */
+static int
+mlink_hash(struct mlink *mlink)
+{
+	unsigned char	 buf[8192];
+	gzFile		 gz;
+	const char	*cp;
+	ssize_t		 i, sz;
+	uint32_t	 hash;
+	int		 fd;
+
+	if (mlink->hashed)
+		return 0;
+	if ((fd = open(mlink->file, O_RDONLY)) == -1) {
+		say(mlink->file, "&open");
+		return -1;
+	}
+
+	/* Decompress exactly when mparse_open(3) would. */
+
+	gz = NULL;
+	if ((cp = strrchr(mlink->file, '.')) != NULL &&
+	    strcmp(cp + 1, "gz") == 0 &&
+	    (gz = gzdopen(fd, "rb")) == NULL) {
+		say(mlink->file, "&gzdopen");
+		close(fd);
+		return -1;
+	}
+	hash = 2166136261U;
+	while ((sz = gz == NULL ? read(fd, buf, sizeof(buf)) :
+	    gzread(gz, buf, sizeof(buf))) > 0)
+		for (i = 0; i < sz; i++)
+			hash = (hash ^ buf[i]) * 16777619U;
+	if (gz == NULL)
+		close(fd);
+	else
+		gzclose(gz);
+	if (sz == -1) {
+		say(mlink->file, "&read");
+		return -1;
+	}
+	mlink->fprint.hash = (int32_t)hash;
+	mlink->hashed = 1;
+	return 0;
+}
+
 static void
 mlink_check(struct mpage *mpage, struct mlink *mlink)
 {
@@ -1158,145 +1736,748 @@ mlink_check(struct mpage *mpage, struct mlink *mlink)
 }
 
 /*
- * Run through the files in the global vector "mpages"
- * and add them to the database specified in "basedir".
- *
- * This handles the parsing scheme itself, using the cues of directory
- * and filename to determine whether the file is parsable or not.
+ * Run through the files in the global vector "mpages"
+ * and add them to the database specified in "basedir".
+ *
+ * This handles the parsing scheme itself, using the cues of directory
+ * and filename to determine whether the file is parsable or not.
+ * With -j, the parsing is done by worker processes,
+ * but the results are still added to the database in order.
+ */
+static void
+mpages_merge(struct dba *dba, struct mparse *mp)
+{
+	struct mpage		*mpage;
+	struct mlink		*mlink, *mlink_dest;
+	FILE			**workers;
+	double			  start, t;
+	size_t			  ipage;
+	int			  res;
+
+	mandoc_ohash_init(&names, 4, offsetof(struct str, key));
+	mandoc_ohash_init(&strings, 6, offsetof(struct str, key));
+	workers = njobs > 1 ? workers_start(mp) : NULL;
+	for (ipage = 0, mpage = mpage_head; mpage != NULL;
+	     ipage++, mpage = mpage->next) {
+
+		/* Unchanged, kept from the old database. */
+
+		if (mpage->dba != NULL) {
+			timing.kept++;
+			continue;
+		}
+
+		start = t = timing_now();
+		mlinks_undupe(mpage);
+		name_mask = NAME_MASK;
+		timing_add(PHASE_READ, &t);
+
+		res = MPAGE_RETRY;
+		if (workers != NULL &&
+		    (res = mpage_recv(workers[ipage % njobs], mpage,
+		     &mlink_dest)) == MPAGE_FAIL) {
+			workers_stop(workers);
+			workers = NULL;
+			res = MPAGE_RETRY;
+		}
+		timing_add(PHASE_WAIT, &t);
+		if (mpage->mlinks == NULL)
+			res = MPAGE_SKIP;
+		else if (res == MPAGE_RETRY) {
+			res = mpage_parse(mp, mpage, &mlink_dest);
+			t = timing_now();
+		}
+
+		/*
+		 * All links of a page are the same file.
+		 * If it includes other files, they might change,
+		 * so never keep the page in later runs.
+		 */
+
+		for (mlink = mpage->mlinks; mlink != NULL;
+		     mlink = mlink->next) {
+			if (mpage->hashed) {
+				mlink->fprint.hash = (int32_t)mpage->hash;
+				mlink->hashed = 1;
+			}
+			mlink->noreuse = mpage->sofiles;
+		}
+
+		/* Remember the file for -S; mpage_so() moves it. */
+
+		mlink = mpage->mlinks;
+		switch (res) {
+		case MPAGE_SO:
+			mpage_so(dba, mpage, mlink_dest);
+			break;
+		case MPAGE_DONE:
+			mpage_add(dba, mpage);
+			break;
+		default:
+			break;
+		}
+		mpage_keys_free();
+		timing_add(PHASE_KEYS, &t);
+		if (stats && res != MPAGE_SKIP) {
+			timing.pages++;
+			timing.bytes += (uint32_t)mlink->fprint.size;
+			timing_page(mlink->file, t - start);
+		}
+	}
+	if (workers != NULL)
+		workers_stop(workers);
+	ohash_delete(&strings);
+	ohash_delete(&names);
+	arena_free();
+}
+
+/*
+ * Parse one manual page and collect its keys in the "names" and
+ * "strings" tables, but do not change any data structures shared
+ * with other manual pages, such that this can also be done in
+ * a worker process.  If the page is a .so link to a page that
+ * is also being indexed, return MPAGE_SO and the target.
+ */
+static int
+mpage_parse(struct mparse *mp, struct mpage *mpage,
+	struct mlink **mlink_dest)
+{
+	struct mlink		*mlink;
+	struct roff_meta	*meta;
+	double			 t;
+	int			 fd;
+
+	t = timing_now();
+	mlink = mpage->mlinks;
+	mparse_reset(mp);
+	meta = NULL;
+
+	if ((fd = mparse_open(mp, mlink->file)) == -1) {
+		say(mlink->file, "&open");
+		return MPAGE_SKIP;
+	}
+	timing_add(PHASE_READ, &t);
+
+	/*
+	 * Interpret the file as mdoc(7) or man(7) source
+	 * code, unless it is known to be formatted.
+	 * The time spent reading is moved to PHASE_READ
+	 * by timing_print().
+	 */
+	if (mlink->dform != FORM_CAT || mlink->fform != FORM_CAT) {
+		mparse_readfd(mp, fd, mlink->file);
+		close(fd);
+		fd = -1;
+		mpage->hashed = mparse_hash(mp, &mpage->hash) == 0;
+		mpage->sofiles = mparse_sofiles(mp) > 0;
+		meta = mparse_result(mp);
+		timing_add(PHASE_PARSE, &t);
+	}
+
+	if (meta != NULL && meta->sodest != NULL) {
+		if ((*mlink_dest = mlink_sodest(meta->sodest)) != NULL)
+			return MPAGE_SO;
+		meta->macroset = MACROSET_NONE;
+	}
+	if (meta != NULL && meta->macroset == MACROSET_MDOC) {
+		mpage->form = FORM_SRC;
+		mpage->sec = meta->msec;
+		mpage->sec = mandoc_strdup(
+		    mpage->sec == NULL ? "" : mpage->sec);
+		mpage->arch = meta->arch;
+		mpage->arch = mandoc_strdup(
+		    mpage->arch == NULL ? "" : mpage->arch);
+		mpage->title = mandoc_strdup(meta->title);
+	} else if (meta != NULL && meta->macroset == MACROSET_MAN) {
+		if (*meta->msec != '\0' || *meta->title != '\0') {
+			mpage->form = FORM_SRC;
+			mpage->sec = mandoc_strdup(meta->msec);
+			mpage->arch = mandoc_strdup(mlink->arch);
+			mpage->title = mandoc_strdup(meta->title);
+		} else
+			meta = NULL;
+	}
+
+	assert(mpage->desc == NULL);
+	if (meta == NULL || meta->sodest != NULL) {
+		mpage->sec = mandoc_strdup(mlink->dsec);
+		mpage->arch = mandoc_strdup(mlink->arch);
+		mpage->title = mandoc_strdup(mlink->name);
+		if (meta == NULL) {
+			mpage->form = FORM_CAT;
+			parse_cat(mpage, fd);
+			timing_add(PHASE_PARSE, &t);
+		} else
+			mpage->form = FORM_SRC;
+	} else {
+		if (meta->macroset == MACROSET_MDOC)
+			parse_mdoc(mpage, meta, meta->first);
+		else
+			parse_man(mpage, meta, meta->first);
+		timing_add(PHASE_KEYS, &t);
+		if (catdir != -1) {
+			mpage_render(mpage, meta);
+			timing_add(PHASE_RENDER, &t);
+		}
+	}
+	if (mpage->desc == NULL) {
+		mpage->desc = mandoc_strdup(mlink->name);
+		if (warnings)
+			say(mlink->file, "No one-line description, "
+			    "using filename \"%s\"", mlink->name);
+	}
+	return MPAGE_DONE;
+}
+
+/*
+ * For -c, format the page from the syntax tree that was just parsed
+ * and store the result below the -c directory, using the same
+ * relative path as the source file, like catman(8) does.
+ * Write to a temporary file in the same directory and only
+ * rename it into place once all output was written successfully.
+ */
+static void
+mpage_render(const struct mpage *mpage, const struct roff_meta *meta)
+{
+	char		 path[PATH_MAX], tmpname[PATH_MAX];
+	const char	*file, *base;
+	int		 fd, old_stdout, irc;
+
+	file = mpage->mlinks->file;
+	if (catdir_path(file, path) == -1 || catdir_mkdirs(path) == -1)
+		return;
+	if ((base = strrchr(path, '/')) == NULL)
+		base = path;
+	else
+		base++;
+	if ((size_t)snprintf(tmpname, sizeof(tmpname), "%.*s%s%s",
+	    (int)(base - path), path, TMP_PREFIX, base) >= sizeof(tmpname)) {
+		say(file, "Filename too long");
+		return;
+	}
+	if ((fd = openat(catdir, tmpname,
+	    O_WRONLY | O_NOFOLLOW | O_CREAT | O_TRUNC,
+	    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+		say(file, "&openat");
+		return;
+	}
+	fflush(stdout);
+	if ((old_stdout = dup(STDOUT_FILENO)) == -1) {
+		say(file, "&dup");
+		close(fd);
+		(void)unlinkat(catdir, tmpname, 0);
+		return;
+	}
+	if (dup2(fd, STDOUT_FILENO) == -1) {
+		say(file, "&dup2");
+		close(old_stdout);
+		close(fd);
+		(void)unlinkat(catdir, tmpname, 0);
+		return;
+	}
+	close(fd);
+
+	if (meta->macroset == MACROSET_MDOC) {
+		if (outtype == OUTT_HTML)
+			html_mdoc(formatter, meta);
+		else
+			terminal_mdoc(formatter, meta);
+	} else {
+		if (outtype == OUTT_HTML)
+			html_man(formatter, meta);
+		else
+			terminal_man(formatter, meta);
+	}
+	if (outtype == OUTT_HTML)
+		html_reset(formatter);
+	irc = 0;
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		say(file, "&write");
+		clearerr(stdout);
+		irc = -1;
+	}
+
+	/* Close the file by restoring the old standard output. */
+
+	if (dup2(old_stdout, STDOUT_FILENO) == -1) {
+		say(file, "&dup2");
+		irc = -1;
+	}
+	close(old_stdout);
+
+	if (irc == 0 && renameat(catdir, tmpname, catdir, path) == -1) {
+		say(file, "&renameat");
+		irc = -1;
+	}
+	if (irc == -1)
+		(void)unlinkat(catdir, tmpname, 0);
+}
+
+/*
+ * Find the mlink a .so request points to, if any.
+ */
+static struct mlink *
+mlink_sodest(const char *sodest)
+{
+	struct mlink	*mlink;
+	char		*cp;
+
+	mlink = ohash_find(&mlinks, ohash_qlookup(&mlinks, sodest));
+	if (mlink == NULL) {
+		mandoc_asprintf(&cp, "%s.gz", sodest);
+		mlink = ohash_find(&mlinks, ohash_qlookup(&mlinks, cp));
+		free(cp);
+	}
+	return mlink;
+}
+
+/*
+ * The page is a .so link to the page of mlink_dest:
+ * move all its links to the target.
+ */
+static void
+mpage_so(struct dba *dba, struct mpage *mpage, struct mlink *mlink_dest)
+{
+	struct mpage	*mpage_dest;
+	struct mlink	*mlink;
+
+	mpage_dest = mlink_dest->mpage;
+	mlink = mpage->mlinks;
+	while (1) {
+		mlink->mpage = mpage_dest;
+
+		/*
+		 * If the target was already
+		 * processed, add the links
+		 * to the database now.
+		 * Otherwise, this will
+		 * happen when we come
+		 * to the target.
+		 */
+
+		if (mpage_dest->dba != NULL)
+			dbadd_mlink(dba, mlink);
+
+		if (mlink->next == NULL)
+			break;
+		mlink = mlink->next;
+	}
+
+	/* Move all links to the target. */
+
+	mlink->next = mlink_dest->next;
+	mlink_dest->next = mpage->mlinks;
+	mpage->mlinks = NULL;
+}
+
+/*
+ * Add the names of the files and the parsed page to the database.
+ */
+static void
+mpage_add(struct dba *dba, struct mpage *mpage)
+{
+	struct mlink	*mlink;
+
+	for (mlink = mpage->mlinks; mlink != NULL; mlink = mlink->next) {
+		putkey(mpage, mlink->name, NAME_FILE);
+		if (warnings && !use_all)
+			mlink_check(mpage, mlink);
+	}
+	dbadd(dba, mpage);
+}
+
+/*
+ * Forget the keys collected for the current page,
+ * keeping the arena for the next page.
+ */
+static void
+mpage_keys_free(void)
+{
+	ohash_delete(&strings);
+	ohash_delete(&names);
+	mandoc_ohash_init(&names, 4, offsetof(struct str, key));
+	mandoc_ohash_init(&strings, 6, offsetof(struct str, key));
+	arena_reset();
+}
+
+/*
+ * Allocate storage for a key that lives until mpage_keys_free().
+ * Each page needs many small keys, all released at the same time,
+ * so they are cut from large blocks rather than allocated one by one.
+ */
+static void *
+arena_alloc(size_t sz)
+{
+	struct arena	*a;
+	void		*p;
+
+	sz = (sz + sizeof(a->data[0]) - 1) & ~(sizeof(a->data[0]) - 1);
+	if ((a = arena) == NULL || a->size - a->used < sz) {
+		a = mandoc_malloc(sizeof(*a) +
+		    (sz > ARENA_SIZE ? sz : ARENA_SIZE));
+		a->size = sz > ARENA_SIZE ? sz : ARENA_SIZE;
+		a->used = 0;
+		a->next = arena;
+		arena = a;
+	}
+	p = (char *)a->data + a->used;
+	a->used += sz;
+	return p;
+}
+
+/*
+ * Release all keys at once, keeping the oldest block for reuse.
+ */
+static void
+arena_reset(void)
+{
+	struct arena	*a;
+
+	while (arena != NULL && (a = arena->next) != NULL) {
+		free(arena);
+		arena = a;
+	}
+	if (arena != NULL)
+		arena->used = 0;
+}
+
+static void
+arena_free(void)
+{
+	arena_reset();
+	free(arena);
+	arena = NULL;
+}
+
+/*
+ * Fork the worker processes for -j.  Worker i parses the pages
+ * i, i + njobs, i + 2 * njobs, ... in order and writes the results
+ * to a pipe, such that the parent can read them in page order.
+ * Return the read ends of the pipes, or NULL on failure.
+ */
+static FILE **
+workers_start(struct mparse *mp)
+{
+	FILE		**workers;
+	pid_t		  pid;
+	int		  fds[2];
+	int		  i;
+
+	if (mpage_head == NULL || mpage_head->next == NULL)
+		return NULL;
+	fflush(stdout);
+	workers = mandoc_calloc(njobs, sizeof(*workers));
+	for (i = 0; i < njobs; i++) {
+		if (pipe(fds) == -1) {
+			say("", "&pipe");
+			break;
+		}
+		if ((pid = fork()) == -1) {
+			say("", "&fork");
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			worker_run(mp, fds[1], i);
+			/* NOTREACHED */
+		}
+		close(fds[1]);
+		if ((workers[i] = fdopen(fds[0], "r")) == NULL) {
+			say("", "&fdopen");
+			close(fds[0]);
+			break;
+		}
+	}
+	if (i < njobs) {
+		workers_stop(workers);
+		workers = NULL;
+	}
+	return workers;
+}
+
+/*
+ * Close the pipes to the workers and wait for them to exit.
+ * Workers still writing die from SIGPIPE.
+ */
+static void
+workers_stop(FILE **workers)
+{
+	int	 i;
+
+	for (i = 0; i < njobs; i++)
+		if (workers[i] != NULL)
+			fclose(workers[i]);
+	while (wait(NULL) != -1 || errno == EINTR)
+		continue;
+	free(workers);
+}
+
+/*
+ * The main loop of a worker process.
  */
 static void
-mpages_merge(struct dba *dba, struct mparse *mp)
+worker_run(struct mparse *mp, int fd, int iworker)
 {
-	struct mpage		*mpage, *mpage_dest;
-	struct mlink		*mlink, *mlink_dest;
-	struct roff_meta	*meta;
-	char			*cp;
-	int			 fd;
+	struct mpage	*mpage;
+	struct mlink	*mlink_dest;
+	FILE		*stream;
+	size_t		 ipage;
+	int		 res, saved_warnings;
 
-	for (mpage = mpage_head; mpage != NULL; mpage = mpage->next) {
-		mlinks_undupe(mpage);
-		if ((mlink = mpage->mlinks) == NULL)
+	mlink_dest = NULL;
+	if ((stream = fdopen(fd, "w")) == NULL) {
+		say("", "&fdopen");
+		_exit((int)MANDOCLEVEL_SYSERR);
+	}
+	for (ipage = 0, mpage = mpage_head; mpage != NULL;
+	     ipage++, mpage = mpage->next) {
+		if (ipage % njobs != (size_t)iworker || mpage->dba != NULL)
 			continue;
 
+		/* The parent prints the warnings. */
+
+		saved_warnings = warnings;
+		warnings = 0;
+		mlinks_undupe(mpage);
+		warnings = saved_warnings;
+
 		name_mask = NAME_MASK;
-		mandoc_ohash_init(&names, 4, offsetof(struct str, key));
-		mandoc_ohash_init(&strings, 6, offsetof(struct str, key));
-		mparse_reset(mp);
-		meta = NULL;
+		res = mpage->mlinks == NULL ? MPAGE_SKIP :
+		    mpage_parse(mp, mpage, &mlink_dest);
+		mpage_send(stream, mpage, res, mlink_dest);
+		mpage_keys_free();
+		free(mpage->sec);
+		free(mpage->arch);
+		free(mpage->title);
+		free(mpage->desc);
+		mpage->sec = mpage->arch = mpage->title = mpage->desc = NULL;
+	}
+	if (fclose(stream) == EOF)
+		_exit((int)MANDOCLEVEL_SYSERR);
+	_exit((int)MANDOCLEVEL_OK);
+}
 
-		if ((fd = mparse_open(mp, mlink->file)) == -1) {
-			say(mlink->file, "&open");
-			goto nextpage;
-		}
+/*
+ * Write the result of parsing one page to the parent.
+ * The keys are written in the order they were inserted,
+ * such that the parent can rebuild identical hash tables.
+ */
+static void
+mpage_send(FILE *stream, const struct mpage *mpage, int res,
+	const struct mlink *mlink_dest)
+{
+	worker_putint(stream, res);
+	worker_putstr(stream, mpage->mlinks == NULL ? NULL :
+	    mpage->mlinks->file);
+	worker_putint(stream, mpage->hashed);
+	worker_putint(stream, mpage->hash);
+	worker_putint(stream, mpage->sofiles);
+	switch (res) {
+	case MPAGE_SO:
+		worker_putstr(stream, mlink_dest->file);
+		break;
+	case MPAGE_DONE:
+		worker_putint(stream, mpage->form);
+		worker_putstr(stream, mpage->sec);
+		worker_putstr(stream, mpage->arch);
+		worker_putstr(stream, mpage->title);
+		worker_putstr(stream, mpage->desc);
+		worker_putint(stream, mpage->name_head_done);
+		worker_putkeys(stream, &name_mask, &names);
+		worker_putkeys(stream, NULL, &strings);
+		break;
+	default:
+		break;
+	}
+	if (ferror(stream)) {
+		say("", "&write");
+		_exit((int)MANDOCLEVEL_SYSERR);
+	}
+}
 
-		/*
-		 * Interpret the file as mdoc(7) or man(7) source
-		 * code, unless it is known to be formatted.
-		 */
-		if (mlink->dform != FORM_CAT || mlink->fform != FORM_CAT) {
-			mparse_readfd(mp, fd, mlink->file);
-			close(fd);
-			fd = -1;
-			meta = mparse_result(mp);
-		}
-
-		if (meta != NULL && meta->sodest != NULL) {
-			mlink_dest = ohash_find(&mlinks,
-			    ohash_qlookup(&mlinks, meta->sodest));
-			if (mlink_dest == NULL) {
-				mandoc_asprintf(&cp, "%s.gz", meta->sodest);
-				mlink_dest = ohash_find(&mlinks,
-				    ohash_qlookup(&mlinks, cp));
-				free(cp);
-			}
-			if (mlink_dest != NULL) {
+static void
+worker_putkeys(FILE *stream, const uint64_t *mask, struct ohash *htab)
+{
+	struct str	**keys, *key;
+	unsigned int	  i, nkeys, slot;
+
+	if (mask != NULL)
+		fwrite(mask, sizeof(*mask), 1, stream);
+	nkeys = ohash_entries(htab);
+	keys = mandoc_reallocarray(NULL, nkeys + 1, sizeof(*keys));
+	for (key = ohash_first(htab, &slot); key != NULL;
+	     key = ohash_next(htab, &slot))
+		keys[key->order] = key;
+	worker_putint(stream, nkeys);
+	for (i = 0; i < nkeys; i++) {
+		fwrite(&keys[i]->mask, sizeof(keys[i]->mask), 1, stream);
+		worker_putstr(stream, keys[i]->key);
+	}
+	free(keys);
+}
 
-				/* The .so target exists. */
+static void
+worker_putint(FILE *stream, int32_t i)
+{
+	fwrite(&i, sizeof(i), 1, stream);
+}
 
-				mpage_dest = mlink_dest->mpage;
-				while (1) {
-					mlink->mpage = mpage_dest;
+static void
+worker_putstr(FILE *stream, const char *s)
+{
+	int32_t	 sz;
 
-					/*
-					 * If the target was already
-					 * processed, add the links
-					 * to the database now.
-					 * Otherwise, this will
-					 * happen when we come
-					 * to the target.
-					 */
+	sz = s == NULL ? -1 : (int32_t)strlen(s);
+	fwrite(&sz, sizeof(sz), 1, stream);
+	if (sz > 0)
+		fwrite(s, 1, sz, stream);
+}
 
-					if (mpage_dest->dba != NULL)
-						dbadd_mlink(mlink);
+/*
+ * Read the result of parsing one page from a worker,
+ * filling the "names" and "strings" tables.
+ * Return MPAGE_RETRY if the worker parsed a different file
+ * than the parent would, or MPAGE_FAIL if the worker died.
+ */
+static int
+mpage_recv(FILE *stream, struct mpage *mpage, struct mlink **mlink_dest)
+{
+	char		*file, *dest;
+	int32_t		 res, form, done, hashed, hash, sofiles;
+
+	file = dest = NULL;
+	if (worker_getint(stream, &res) == -1 ||
+	    worker_getstr(stream, &file) == -1 ||
+	    worker_getint(stream, &hashed) == -1 ||
+	    worker_getint(stream, &hash) == -1 ||
+	    worker_getint(stream, &sofiles) == -1)
+		goto fail;
+	mpage->hashed = hashed;
+	mpage->hash = hash;
+	mpage->sofiles = sofiles;
+	switch (res) {
+	case MPAGE_SO:
+		if (worker_getstr(stream, &dest) == -1)
+			goto fail;
+		*mlink_dest = dest == NULL ? NULL : mlink_sodest(dest);
+		if (*mlink_dest == NULL)
+			res = MPAGE_RETRY;
+		break;
+	case MPAGE_DONE:
+		if (worker_getint(stream, &form) == -1 ||
+		    worker_getstr(stream, &mpage->sec) == -1 ||
+		    worker_getstr(stream, &mpage->arch) == -1 ||
+		    worker_getstr(stream, &mpage->title) == -1 ||
+		    worker_getstr(stream, &mpage->desc) == -1 ||
+		    worker_getint(stream, &done) == -1 ||
+		    worker_getkeys(stream, mpage, &name_mask, &names) == -1 ||
+		    worker_getkeys(stream, mpage, NULL, &strings) == -1)
+			goto fail;
+		mpage->form = form;
+		mpage->name_head_done = done;
+		break;
+	case MPAGE_SKIP:
+		break;
+	default:
+		goto fail;
+	}
 
-					if (mlink->next == NULL)
-						break;
-					mlink = mlink->next;
-				}
+	/*
+	 * The worker cannot see changes the parent made to the links,
+	 * so in the rare case it parsed a different file, start over.
+	 */
 
-				/* Move all links to the target. */
+	if (mpage->mlinks != NULL && res != MPAGE_RETRY &&
+	    (file == NULL || strcmp(file, mpage->mlinks->file) != 0))
+		res = MPAGE_RETRY;
+	if (res == MPAGE_RETRY)
+		mpage_reset(mpage);
+	free(file);
+	free(dest);
+	return res;
+
+fail:
+	say("", "Worker process failed, continuing without");
+	mpage_reset(mpage);
+	free(file);
+	free(dest);
+	return MPAGE_FAIL;
+}
 
-				mlink->next = mlink_dest->next;
-				mlink_dest->next = mpage->mlinks;
-				mpage->mlinks = NULL;
-				goto nextpage;
-			}
-			meta->macroset = MACROSET_NONE;
-		}
-		if (meta != NULL && meta->macroset == MACROSET_MDOC) {
-			mpage->form = FORM_SRC;
-			mpage->sec = meta->msec;
-			mpage->sec = mandoc_strdup(
-			    mpage->sec == NULL ? "" : mpage->sec);
-			mpage->arch = meta->arch;
-			mpage->arch = mandoc_strdup(
-			    mpage->arch == NULL ? "" : mpage->arch);
-			mpage->title = mandoc_strdup(meta->title);
-		} else if (meta != NULL && meta->macroset == MACROSET_MAN) {
-			if (*meta->msec != '\0' || *meta->title != '\0') {
-				mpage->form = FORM_SRC;
-				mpage->sec = mandoc_strdup(meta->msec);
-				mpage->arch = mandoc_strdup(mlink->arch);
-				mpage->title = mandoc_strdup(meta->title);
-			} else
-				meta = NULL;
-		}
-
-		assert(mpage->desc == NULL);
-		if (meta == NULL || meta->sodest != NULL) {
-			mpage->sec = mandoc_strdup(mlink->dsec);
-			mpage->arch = mandoc_strdup(mlink->arch);
-			mpage->title = mandoc_strdup(mlink->name);
-			if (meta == NULL) {
-				mpage->form = FORM_CAT;
-				parse_cat(mpage, fd);
-			} else
-				mpage->form = FORM_SRC;
-		} else if (meta->macroset == MACROSET_MDOC)
-			parse_mdoc(mpage, meta, meta->first);
-		else
-			parse_man(mpage, meta, meta->first);
-		if (mpage->desc == NULL) {
-			mpage->desc = mandoc_strdup(mlink->name);
-			if (warnings)
-				say(mlink->file, "No one-line description, "
-				    "using filename \"%s\"", mlink->name);
-		}
+/*
+ * Discard the partial results of parsing a page.
+ */
+static void
+mpage_reset(struct mpage *mpage)
+{
+	mpage_keys_free();
+	name_mask = NAME_MASK;
+	free(mpage->sec);
+	free(mpage->arch);
+	free(mpage->title);
+	free(mpage->desc);
+	mpage->sec = mpage->arch = mpage->title = mpage->desc = NULL;
+	mpage->name_head_done = 0;
+	mpage->hashed = 0;
+	mpage->sofiles = 0;
+}
 
-		for (mlink = mpage->mlinks;
-		     mlink != NULL;
-		     mlink = mlink->next) {
-			putkey(mpage, mlink->name, NAME_FILE);
-			if (warnings && !use_all)
-				mlink_check(mpage, mlink);
-		}
+static int
+worker_getkeys(FILE *stream, const struct mpage *mpage,
+	uint64_t *mask, struct ohash *htab)
+{
+	struct str	*s;
+	char		*key;
+	uint64_t	 keymask;
+	int32_t		 i, nkeys;
+	unsigned int	 slot;
+
+	if (mask != NULL && fread(mask, sizeof(*mask), 1, stream) != 1)
+		return -1;
+	if (worker_getint(stream, &nkeys) == -1)
+		return -1;
+	for (i = 0; i < nkeys; i++) {
+		if (fread(&keymask, sizeof(keymask), 1, stream) != 1 ||
+		    worker_getstr(stream, &key) == -1 || key == NULL)
+			return -1;
+		slot = ohash_qlookup(htab, key);
+		s = arena_alloc(sizeof(struct str) + strlen(key) + 1);
+		strcpy(s->key, key);
+		s->mpage = mpage;
+		s->mask = keymask;
+		s->order = ohash_entries(htab);
+		ohash_insert(htab, slot, s);
+		free(key);
+	}
+	return 0;
+}
+
+static int
+worker_getint(FILE *stream, int32_t *i)
+{
+	return fread(i, sizeof(*i), 1, stream) == 1 ? 0 : -1;
+}
 
-		dbadd(dba, mpage);
+static int
+worker_getstr(FILE *stream, char **s)
+{
+	int32_t	 sz;
 
-nextpage:
-		ohash_delete(&strings);
-		ohash_delete(&names);
+	*s = NULL;
+	if (worker_getint(stream, &sz) == -1 || sz < -1)
+		return -1;
+	if (sz == -1)
+		return 0;
+	*s = mandoc_malloc(sz + 1);
+	if (sz > 0 && fread(*s, 1, sz, stream) != (size_t)sz) {
+		free(*s);
+		*s = NULL;
+		return -1;
 	}
+	(*s)[sz] = '\0';
+	return 0;
 }
 
 static void
@@ -1850,12 +3031,12 @@ putkeys(const struct mpage *mpage, char *cp, size_t sz, uint64_t v)
 	struct str	*s;
 	const char	*end;
 	unsigned int	 slot;
-	int		 i, mustfree;
+	int		 i;
 
 	if (0 == sz)
 		return;
 
-	mustfree = render_string(&cp, &sz);
+	render_string(&cp, &sz);
 
 	if (TYPE_Nm & v) {
 		htab = &names;
@@ -1884,15 +3065,14 @@ putkeys(const struct mpage *mpage, char *cp, size_t sz, uint64_t v)
 		s->mask |= v;
 		return;
 	} else if (NULL == s) {
-		s = mandoc_calloc(1, sizeof(struct str) + sz + 1);
+		s = arena_alloc(sizeof(struct str) + sz + 1);
 		memcpy(s->key, cp, sz);
+		s->key[sz] = '\0';
+		s->order = ohash_entries(htab);
 		ohash_insert(htab, slot, s);
 	}
 	s->mpage = mpage;
 	s->mask = v;
-
-	if (mustfree)
-		free(cp);
 }
 
 /*
@@ -1948,14 +3128,15 @@ utf8(unsigned int cp, char out[7])
 }
 
 /*
- * If the string contains escape sequences,
- * replace it with an allocated rendering and return 1,
- * such that the caller can free it after use.
- * Otherwise, do nothing and return 0.
+ * If the string contains escape sequences, replace it with
+ * a rendering in a static buffer that is reused by the next call.
+ * Otherwise, leave it in place.
  */
-static int
+static void
 render_string(char **public, size_t *psz)
 {
+	static char	*buf = NULL;
+	static size_t	 bufsz = 0;
 	const char	*src, *scp, *addcp, *seq;
 	char		*dst;
 	size_t		 ssz, dsz, addsz;
@@ -1991,7 +3172,11 @@ render_string(char **public, size_t *psz)
 		 */
 
 		if (dst == NULL) {
-			dst = mandoc_malloc(ssz + 1);
+			if (bufsz < ssz + 1) {
+				bufsz = ssz + 1;
+				buf = mandoc_realloc(buf, bufsz);
+			}
+			dst = buf;
 			dsz = scp - src;
 			memcpy(dst, src, dsz);
 		}
@@ -2052,7 +3237,10 @@ render_string(char **public, size_t *psz)
 		/* Copy the rendered glyph into the stream. */
 
 		ssz += addsz;
-		dst = mandoc_realloc(dst, ssz + 1);
+		if (bufsz < ssz + 1) {
+			bufsz = ssz + 1;
+			dst = buf = mandoc_realloc(buf, bufsz);
+		}
 		memcpy(dst + dsz, addcp, addsz);
 		dsz += addsz;
 	}
@@ -2065,21 +3253,20 @@ render_string(char **public, size_t *psz)
 
 	while (*psz > 0 && (*public)[*psz - 1] == ' ')
 		--*psz;
-	if (dst != NULL) {
+	if (dst != NULL)
 		(*public)[*psz] = '\0';
-		return 1;
-	} else
-		return 0;
 }
 
 static void
-dbadd_mlink(const struct mlink *mlink)
+dbadd_mlink(struct dba *dba, struct mlink *mlink)
 {
 	dba_page_alias(mlink->mpage->dba, mlink->name, NAME_FILE);
 	dba_page_add(mlink->mpage->dba, DBP_SECT, mlink->dsec);
 	dba_page_add(mlink->mpage->dba, DBP_SECT, mlink->fsec);
 	dba_page_add(mlink->mpage->dba, DBP_ARCH, mlink->arch);
 	dba_page_add(mlink->mpage->dba, DBP_FILE, mlink->file);
+	if (mlink->noreuse == 0 && mlink_hash(mlink) == 0)
+		mlink_fprint(dba, mlink);
 }
 
 /*
@@ -2095,17 +3282,10 @@ dbadd(struct dba *dba, struct mpage *mpage)
 	uint64_t	 mask;
 	size_t		 i;
 	unsigned int	 slot;
-	int		 mustfree;
 
 	mlink = mpage->mlinks;
 
 	if (nodb) {
-		for (key = ohash_first(&names, &slot); NULL != key;
-		     key = ohash_next(&names, &slot))
-			free(key);
-		for (key = ohash_first(&strings, &slot); NULL != key;
-		     key = ohash_next(&strings, &slot))
-			free(key);
 		if (0 == debug)
 			return;
 		while (NULL != mlink) {
@@ -2136,16 +3316,14 @@ dbadd(struct dba *dba, struct mpage *mpage)
 
 	cp = mpage->desc;
 	i = strlen(cp);
-	mustfree = render_string(&cp, &i);
+	render_string(&cp, &i);
 	mpage->dba = dba_page_new(dba->pages,
 	    *mpage->arch == '\0' ? mlink->arch : mpage->arch,
 	    cp, mlink->file, mpage->form);
-	if (mustfree)
-		free(cp);
 	dba_page_add(mpage->dba, DBP_SECT, mpage->sec);
 
 	while (mlink != NULL) {
-		dbadd_mlink(mlink);
+		dbadd_mlink(dba, mlink);
 		mlink = mlink->next;
 	}
 
@@ -2153,19 +3331,19 @@ dbadd(struct dba *dba, struct mpage *mpage)
 	     key = ohash_next(&names, &slot)) {
 		assert(key->mpage == mpage);
 		dba_page_alias(mpage->dba, key->key, key->mask);
-		free(key);
 	}
 	for (key = ohash_first(&strings, &slot); NULL != key;
 	     key = ohash_next(&strings, &slot)) {
 		assert(key->mpage == mpage);
 		i = 0;
 		for (mask = TYPE_Xr; mask <= TYPE_Lb; mask *= 2) {
-			if (key->mask & mask)
-				dba_macro_add(dba->macros, i,
-				    key->key, mpage->dba);
+			if (key->mask & mask && dba_macro_add(dba, i,
+			    key->key, mpage->dba) == -1) {
+				exitcode = (int)MANDOCLEVEL_SYSERR;
+				say(mpage->mlinks->file, "&dba_macro_add");
+			}
 			i++;
 		}
-		free(key);
 	}
 }
 
@@ -2191,16 +3369,265 @@ dbprune(struct dba *dba)
 	}
 }
 
+/*
+ * The keys extracted from a page may differ between mandoc versions,
+ * so store a hash of the version with the options, such that pages
+ * are not kept from a database written by a different version.
+ */
+static int32_t
+dbopts_version(void)
+{
+	const char	*cp;
+	uint32_t	 hash;
+
+	hash = 2166136261U;
+	for (cp = VERSION; *cp != '\0'; cp++)
+		hash = (hash ^ (unsigned char)*cp) * 16777619U;
+	return (hash << 8) & DBOPT_VERSION;
+}
+
+/*
+ * Keep the pages of the old database having all their files unchanged,
+ * and mark the manual pages found in the file system that they cover,
+ * such that mpages_merge() does not parse them again.
+ * Pages including other files have no fingerprints, so they are
+ * never kept.  Delete all other pages from the old database.
+ */
+static void
+dbreuse(struct dba *dba)
+{
+	char			 buf[PATH_MAX];
+	struct dba_array	*page, *dbpage;
+	struct mpage		*mpage;
+	struct mlink		*mlink;
+	char			*file;
+	int			 changed, keep;
+
+	/* Find the old pages with all their files unchanged. */
+
+	dba_array_FOREACH(dba->pages, page) {
+		keep = 1;
+		dba_array_FOREACH(dba_array_get(page, DBP_FILE), file) {
+			if (*file < ' ')
+				file++;
+			mlink = ohash_find(&mlinks,
+			    ohash_qlookup(&mlinks, file));
+			if (mlink == NULL || mlink->dbpage != NULL ||
+			    mlink_same(dba, mlink, file) == 0)
+				keep = 0;
+		}
+		if (keep == 0 || (catdir != -1 && catdir_stale(page)))
+			continue;
+		dba_array_FOREACH(dba_array_get(page, DBP_FILE), file) {
+			if (*file < ' ')
+				file++;
+			mlink = ohash_find(&mlinks,
+			    ohash_qlookup(&mlinks, file));
+			mlink->dbpage = page;
+		}
+	}
+
+	/*
+	 * Manual pages having new or changed files, or files
+	 * from more than one old page, need to be parsed again,
+	 * so the old pages of all their files cannot be kept.
+	 * Repeat until that no longer affects other manual pages.
+	 */
+
+	do {
+		changed = 0;
+		for (mpage = mpage_head; mpage != NULL; mpage = mpage->next) {
+			mpage->dba = NULL;
+			dbpage = NULL;
+			keep = 1;
+			for (mlink = mpage->mlinks; mlink != NULL;
+			     mlink = mlink->next) {
+				if (use_all == 0 && mlink_dupe(mlink, buf))
+					continue;
+				if (mlink->dbpage == NULL || (dbpage != NULL &&
+				    mlink->dbpage != dbpage))
+					keep = 0;
+				dbpage = mlink->dbpage;
+			}
+			if (keep && dbpage != NULL) {
+				mpage->dba = dbpage;
+				continue;
+			}
+			for (mlink = mpage->mlinks; mlink != NULL;
+			     mlink = mlink->next) {
+				if (mlink->dbpage != NULL) {
+					dbreuse_drop(mlink->dbpage);
+					changed = 1;
+				}
+			}
+		}
+	} while (changed);
+
+	/* Delete the old pages that cannot be kept. */
+
+	dba_array_FOREACH(dba->pages, page) {
+		file = dba_array_get(dba_array_get(page, DBP_FILE), 0);
+		if (*file < ' ')
+			file++;
+		mlink = ohash_find(&mlinks, ohash_qlookup(&mlinks, file));
+		if (mlink != NULL && mlink->dbpage == page)
+			continue;
+		if (debug)
+			say(file, "Deleting from database");
+		dba_array_del(dba->pages);
+	}
+}
+
+/*
+ * Forget that the files of an old page are unchanged.
+ */
+static void
+dbreuse_drop(struct dba_array *page)
+{
+	struct mlink	*mlink;
+	char		*file;
+
+	dba_array_FOREACH(dba_array_get(page, DBP_FILE), file) {
+		if (*file < ' ')
+			file++;
+		mlink = ohash_find(&mlinks, ohash_qlookup(&mlinks, file));
+		if (mlink != NULL && mlink->dbpage == page)
+			mlink->dbpage = NULL;
+	}
+}
+
+/*
+ * For -c, check whether the formatted version of an old page
+ * is missing or older than the source file.  Only the first file
+ * of each page is parsed, so only that one is formatted.
+ */
+static int
+catdir_stale(struct dba_array *page)
+{
+	char		 path[PATH_MAX];
+	struct stat	 st;
+	struct mlink	*mlink;
+	const char	*file;
+
+	file = dba_array_get(dba_array_get(page, DBP_FILE), 0);
+	if (*file != FORM_SRC)
+		return 0;
+	file++;
+	if (catdir_path(file, path) == -1)
+		return 0;
+	mlink = ohash_find(&mlinks, ohash_qlookup(&mlinks, file));
+	if (fstatat(catdir, path, &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return 1;
+#if HAVE_ST_MTIM
+	if (st.st_mtim.tv_sec != mlink->mtime)
+		return st.st_mtim.tv_sec < mlink->mtime;
+	return st.st_mtim.tv_nsec < mlink->mtime_nsec;
+#else
+	/* Within the same second, we cannot tell which came first. */
+	return st.st_mtime <= mlink->mtime;
+#endif
+}
+
+/*
+ * Construct the path of the formatted version of a file
+ * below the -c directory: the same, but without a .gz suffix.
+ */
+static int
+catdir_path(const char *file, char *path)
+{
+	size_t	 sz;
+
+	if ((sz = strlcpy(path, file, PATH_MAX)) >= PATH_MAX) {
+		say(file, "Filename too long");
+		return -1;
+	}
+	if (sz > 3 && strcmp(path + sz - 3, ".gz") == 0)
+		path[sz - 3] = '\0';
+	return 0;
+}
+
+/*
+ * Create the directories leading to a path below the -c directory.
+ */
+static int
+catdir_mkdirs(const char *path)
+{
+	char	 dir[PATH_MAX];
+	char	*cp;
+
+	(void)strlcpy(dir, path, sizeof(dir));
+	for (cp = strchr(dir, '/'); cp != NULL; cp = strchr(cp + 1, '/')) {
+		*cp = '\0';
+		if (mkdirat(catdir, dir, S_IRWXU | S_IRGRP | S_IXGRP |
+		    S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+			say(dir, "&mkdirat");
+			return -1;
+		}
+		*cp = '/';
+	}
+	return 0;
+}
+
+/*
+ * Check whether the file of an mlink is unchanged since its
+ * fingerprint was stored in the old database.  If the inode number,
+ * size, or modification time differ, including a modification time
+ * cleared by mlink_fprint(), compare the content hash.
+ */
+static int
+mlink_same(struct dba *dba, struct mlink *mlink, const char *file)
+{
+	const struct dba_fprint	*fp;
+
+	if ((fp = dba_file_get(dba, file)) == NULL)
+		return 0;
+	if (fp->ino == mlink->fprint.ino &&
+	    fp->size == mlink->fprint.size &&
+	    fp->mtime == mlink->fprint.mtime) {
+		mlink->fprint.hash = fp->hash;
+		mlink->hashed = 1;
+		return 1;
+	}
+	if (fp->size != mlink->fprint.size || mlink_hash(mlink) == -1 ||
+	    fp->hash != mlink->fprint.hash)
+		return 0;
+	mlink_fprint(dba, mlink);
+	return 1;
+}
+
+/*
+ * Store the fingerprint of the file of an mlink in the database.
+ * If the file was modified in the same second the scan started,
+ * or in the second before, in case the file system clock lags,
+ * a later change in the same second would not change the mtime.
+ * Store a modification time of 0 in that case, such that the
+ * next run compares the content hash instead.
+ */
+static void
+mlink_fprint(struct dba *dba, const struct mlink *mlink)
+{
+	struct dba_fprint	 fp;
+
+	fp = mlink->fprint;
+	if (mlink->mtime + 1 >= scantime)
+		fp.mtime = 0;
+	dba_file_add(dba, mlink->file, &fp);
+}
+
 /*
  * Write the database from memory to disk.
  */
 static void
 dbwrite(struct dba *dba)
 {
-	struct stat	 sb1, sb2;
-	char		 tfn[33], *cp1, *cp2;
-	off_t		 i;
-	int		 fd1, fd2;
+	static const char *const sections[DIGEST_MAX] = {
+		NULL, "pages table", "macros table", "names index",
+		"trigram index", "cross reference index",
+		"file fingerprints index"
+	};
+	uint64_t	 digest[DIGEST_MAX];
+	struct dbm	*db;
+	int		 id, ndigests;
 
 	/*
 	 * Do not write empty databases, and delete existing ones
@@ -2214,9 +3641,19 @@ dbwrite(struct dba *dba)
 		return;
 	}
 
+	/* Remember the digests stored in the old database. */
+
+	ndigests = 0;
+	if ((db = dbm_open(MANDOC_DB)) != NULL) {
+		ndigests = dbm_digest(db, digest);
+		dbm_close(db);
+	}
+
 	/*
 	 * Build the database in a temporary file,
 	 * then atomically move it into place.
+	 * Always replace the old file, even if the digests match,
+	 * such that rebuilding repairs a damaged database.
 	 */
 
 	if (dba_write(MANDOC_DB "~", dba) != -1) {
@@ -2224,77 +3661,35 @@ dbwrite(struct dba *dba)
 			exitcode = (int)MANDOCLEVEL_SYSERR;
 			say(MANDOC_DB, "&rename");
 			unlink(MANDOC_DB "~");
+		} else if (debug && ndigests == DIGEST_MAX) {
+			if (digest[0] == dba->digest[0])
+				say(MANDOC_DB, "Data unchanged");
+			else
+				for (id = 1; id < DIGEST_MAX; id++)
+					if (digest[id] != dba->digest[id])
+						say(MANDOC_DB,
+						    "Changed %s",
+						    sections[id]);
 		}
 		return;
 	}
+	if (errno != EACCES && errno != EPERM && errno != EROFS) {
+		exitcode = (int)MANDOCLEVEL_SYSERR;
+		say(MANDOC_DB "~", "&dba_write");
+		return;
+	}
 
 	/*
 	 * We lack write permission and cannot replace the database
-	 * file, but let's at least check whether the data changed.
+	 * file, but let's at least check whether the data changed,
+	 * computing the digest without writing anything.
 	 */
 
-	(void)strlcpy(tfn, "/tmp/mandocdb.XXXXXXXX", sizeof(tfn));
-	if (mkdtemp(tfn) == NULL) {
+	(void)dba_write(NULL, dba);
+	if (ndigests == 0 || digest[0] != dba->digest[0]) {
 		exitcode = (int)MANDOCLEVEL_SYSERR;
-		say("", "&%s", tfn);
-		return;
+		say(MANDOC_DB, "Data changed, but cannot replace database");
 	}
-	cp1 = cp2 = MAP_FAILED;
-	fd1 = fd2 = -1;
-	(void)strlcat(tfn, "/" MANDOC_DB, sizeof(tfn));
-	if (dba_write(tfn, dba) == -1) {
-		say(tfn, "&dba_write");
-		goto err;
-	}
-	if ((fd1 = open(MANDOC_DB, O_RDONLY, 0)) == -1) {
-		say(MANDOC_DB, "&open");
-		goto err;
-	}
-	if ((fd2 = open(tfn, O_RDONLY, 0)) == -1) {
-		say(tfn, "&open");
-		goto err;
-	}
-	if (fstat(fd1, &sb1) == -1) {
-		say(MANDOC_DB, "&fstat");
-		goto err;
-	}
-	if (fstat(fd2, &sb2) == -1) {
-		say(tfn, "&fstat");
-		goto err;
-	}
-	if (sb1.st_size != sb2.st_size)
-		goto err;
-	if ((cp1 = mmap(NULL, sb1.st_size, PROT_READ, MAP_PRIVATE,
-	    fd1, 0)) == MAP_FAILED) {
-		say(MANDOC_DB, "&mmap");
-		goto err;
-	}
-	if ((cp2 = mmap(NULL, sb2.st_size, PROT_READ, MAP_PRIVATE,
-	    fd2, 0)) == MAP_FAILED) {
-		say(tfn, "&mmap");
-		goto err;
-	}
-	for (i = 0; i < sb1.st_size; i++)
-		if (cp1[i] != cp2[i])
-			goto err;
-	goto out;
-
-err:
-	exitcode = (int)MANDOCLEVEL_SYSERR;
-	say(MANDOC_DB, "Data changed, but cannot replace database");
-
-out:
-	if (cp1 != MAP_FAILED)
-		munmap(cp1, sb1.st_size);
-	if (cp2 != MAP_FAILED)
-		munmap(cp2, sb2.st_size);
-	if (fd1 != -1)
-		close(fd1);
-	if (fd2 != -1)
-		close(fd2);
-	unlink(tfn);
-	*strrchr(tfn, '/') = '\0';
-	rmdir(tfn);
 }
 
 static int
@@ -2381,6 +3776,101 @@ set_basedir(const char *targetdir, int report_baddir)
 	return 1;
 }
 
+/*
+ * Return the current time in seconds for -S, or 0 without -S.
+ */
+static double
+timing_now(void)
+{
+	struct timespec	 ts;
+
+	if (stats == 0)
+		return 0.0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Charge the time since *start to the given phase
+ * and let the next phase start now.
+ */
+static void
+timing_add(enum phase phase, double *start)
+{
+	double	 now;
+
+	if (stats == 0)
+		return;
+	now = timing_now();
+	timing.secs[phase] += now - *start;
+	*start = now;
+}
+
+static void
+timing_start(const struct mparse *mp)
+{
+	if (stats == 0)
+		return;
+	memset(&timing, 0, sizeof(timing));
+	timing.start = timing_now();
+	timing.readtime = mparse_readtime(mp);
+}
+
+/*
+ * Remember the slowest files, in decreasing order.
+ */
+static void
+timing_page(const char *file, double secs)
+{
+	size_t	 i;
+
+	for (i = timing.nslow; i > 0 && timing.slow[i - 1].secs < secs; i--)
+		if (i < STATS_SLOW)
+			timing.slow[i] = timing.slow[i - 1];
+	if (i == STATS_SLOW)
+		return;
+	timing.slow[i].secs = secs;
+	strlcpy(timing.slow[i].file, file, sizeof(timing.slow[i].file));
+	if (timing.nslow < STATS_SLOW)
+		timing.nslow++;
+}
+
+/*
+ * Print the statistics for one manpath to standard output,
+ * one tab-separated record per line.
+ */
+static void
+timing_print(const struct mparse *mp)
+{
+	static const char *const phases[PHASE_MAX] = {
+		"scan", "dbread", "read", "parse", "keys",
+		"render", "wait", "prune", "write"
+	};
+	double	 total, read;
+	size_t	 i;
+
+	if (stats == 0)
+		return;
+	total = timing_now() - timing.start;
+	read = mparse_readtime(mp) - timing.readtime;
+	timing.secs[PHASE_READ] += read;
+	timing.secs[PHASE_PARSE] -= read;
+
+	printf("manpath\t%s\n", basedir);
+	for (i = 0; i < PHASE_MAX; i++)
+		printf("time\t%s\t%.6f\n", phases[i], timing.secs[i]);
+	printf("time\ttotal\t%.6f\n", total);
+	printf("pages\t%zu\n", timing.pages);
+	printf("kept\t%zu\n", timing.kept);
+	printf("bytes\t%zu\n", timing.bytes);
+	printf("pages/s\t%.1f\n", total > 0.0 ? timing.pages / total : 0.0);
+	printf("bytes/s\t%.0f\n", total > 0.0 ? timing.bytes / total : 0.0);
+	for (i = 0; i < timing.nslow; i++)
+		printf("slow\t%.6f\t%s\n",
+		    timing.slow[i].secs, timing.slow[i].file);
+	fflush(stdout);
+}
+
 static void
 say(const char *file, const char *format, ...)
 {
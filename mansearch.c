@@ -28,6 +28,9 @@
 #include <fcntl.h>
 #include <glob.h>
 #include <limits.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <regex.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -36,8 +39,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "mandoc.h"
 #include "mandoc_aux.h"
-#include "mandoc_ohash.h"
 #include "manconf.h"
 #include "mansearch.h"
 #include "dbm.h"
@@ -46,12 +49,68 @@ struct	expr {
 	/* Used for terms: */
 	struct dbm_match match;   /* Match type and expression. */
 	uint64_t	 bits;    /* Type mask. */
+	const char	*word;    /* The term if it is a plain word. */
 	/* Used for OR and AND groups: */
 	struct expr	*next;    /* Next child in the parent group. */
 	struct expr	*child;   /* First child in this group. */
 	enum { EXPR_TERM, EXPR_OR, EXPR_AND } type;
 };
 
+struct	job {
+	const struct mansearch *search;
+	struct expr	*e;       /* The expression to evaluate. */
+	const char	*path;    /* The tree to search. */
+	struct hit	*res;     /* The results found in this tree. */
+	size_t		 sz;      /* The number of results. */
+	size_t		 maxres;  /* The number of allocated results. */
+	size_t		 ipath;   /* The number of the tree. */
+	size_t		 outkey;  /* The macro to show. */
+	struct dbm	*db;      /* The database of the tree. */
+	struct dbm_iter	*it;      /* For iterating the database. */
+	int		 count;   /* Only count, do not collect results. */
+#if HAVE_PTHREAD
+	pthread_t	 thread;
+	int		 threaded; /* The tree is searched in a thread. */
+#endif
+};
+
+/*
+ * One search result.  The strings in the manpage structure
+ * are only built when they are needed, see hit_build().
+ */
+struct	hit {
+	struct manpage	 mpage;
+	struct job	*job;     /* The tree the page is in. */
+	int32_t		 page;    /* The number of the page in the tree. */
+	int		 built;   /* MANPAGE_* fields already built. */
+	int		 missing; /* The file does not exist. */
+};
+
+struct	manhits {
+	struct job	*jobs;    /* One for each tree, holding the dbm. */
+	size_t		 njobs;
+	struct expr	*e;
+	struct hit	*hits;
+	size_t		 sz;      /* The number of results. */
+};
+
+#define	OUTKEY_REFBY	KEY_MAX	/* Pages referring to the page. */
+
+struct	pageset {
+	uint64_t	*set;     /* One bit for each page. */
+	int32_t		*bits;    /* Name quality for each page or NULL. */
+	int32_t		*score;   /* Relevance of each page, for ranking. */
+	int32_t		 npages;  /* Number of pages in the database. */
+};
+
+struct	rank {
+	int32_t		 page;
+	int32_t		 score;   /* Relevance, higher is better. */
+	int		 prio;    /* Section priority, lower is better. */
+};
+
+static	const int sec_prios[] = {1, 4, 5, 8, 6, 3, 7, 2, 9};
+
 const char *const mansearch_keynames[KEY_MAX] = {
 	"arch",	"sec",	"Xr",	"Ar",	"Fa",	"Fl",	"Dv",	"Fn",
 	"Ic",	"Pa",	"Cm",	"Li",	"Em",	"Cd",	"Va",	"Ft",
@@ -60,13 +119,35 @@ const char *const mansearch_keynames[KEY_MAX] = {
 	"Ms",	"Bsx",	"Dx",	"Rs",	"Vt",	"Lb",	"Nm",	"Nd"
 };
 
-
-static	struct ohash	*manmerge(struct expr *, struct ohash *);
-static	struct ohash	*manmerge_term(struct expr *, struct ohash *);
-static	struct ohash	*manmerge_or(struct expr *, struct ohash *);
-static	struct ohash	*manmerge_and(struct expr *, struct ohash *);
+static	struct manhits *search_run(const struct mansearch *,
+				const struct manpaths *, int, char *[], int);
+#if HAVE_PTHREAD
+static	void		*manpath_thread(void *);
+#endif
+static	void		 manpath_search(struct job *);
+static	void		 manpath_rank(struct job *, struct pageset *);
+static	int		 manpath_want(const struct mansearch *,
+				const struct dbm_page *, int32_t);
+static	struct hit	*hit_add(struct job *, int32_t,
+				const struct dbm_page *, int32_t, int32_t);
+static	int		 hit_build(struct hit *, int);
+static	void		 hits_free(struct hit *, size_t);
+static	struct pageset *manmerge(struct job *,
+				struct expr *, struct pageset *);
+static	struct pageset *manmerge_term(struct job *,
+				struct expr *, struct pageset *);
+static	struct pageset *manmerge_or(struct job *,
+				struct expr *, struct pageset *);
+static	struct pageset *manmerge_and(struct job *,
+				struct expr *, struct pageset *);
+static	int32_t		 term_score(struct job *, const struct expr *,
+				uint64_t, const struct dbm_res *);
+static	struct pageset *pageset_new(int32_t, int);
+static	void		 pageset_free(struct pageset *);
+static	int32_t		 pageset_count(const struct pageset *);
 static	char		*buildnames(const struct dbm_page *);
-static	char		*buildoutput(size_t, struct dbm_page *);
+static	char		*buildoutput(struct job *, int32_t,
+				struct dbm_page *);
 static	size_t		 lstlen(const char *, size_t);
 static	void		 lstcat(char *, size_t *, const char *, const char *);
 static	int		 lstmatch(const char *, const char *);
@@ -76,8 +157,13 @@ static	struct expr	*expr_and(const struct mansearch *,
 				int, char *[], int *);
 static	struct expr	*exprterm(const struct mansearch *,
 				int, char *[], int *);
+static	char		*exprprefix(const char *);
+static	char		*exprlit(const char *);
 static	void		 exprfree(struct expr *);
-static	int		 manpage_compare(const void *, const void *);
+static	int		 hit_compare(const void *, const void *);
+static	int		 hit_rank_compare(const void *, const void *);
+static	int		 rank_compare(const void *, const void *);
+static	int		 sec_prio(int);
 
 
 int
@@ -86,48 +172,136 @@ mansearch(const struct mansearch *search,
 		int argc, char *argv[],
 		struct manpage **res, size_t *sz)
 {
-	char		 buf[PATH_MAX];
-	struct dbm_res	*rp;
-	struct expr	*e;
-	struct dbm_page	*page;
-	struct manpage	*mpage;
-	struct ohash	*htab;
-	size_t		 cur, i, maxres, outkey;
-	unsigned int	 slot;
-	int		 argi, chdir_status, getcwd_status, im;
+	struct manhits	*mh;
 
-	argi = 0;
-	if ((e = exprcomp(search, argc, argv, &argi)) == NULL) {
+	if ((mh = search_run(search, paths, argc, argv,
+	    res == NULL)) == NULL) {
 		*sz = 0;
 		return 0;
 	}
+	if (res == NULL)
+		*sz = mh->sz;
+	else
+		*sz = manhits_take(mh, MANPAGE_ALL, res);
+	manhits_free(mh);
+	return res != NULL || *sz;
+}
+
+/*
+ * Like mansearch(), but only collect handles to the pages found,
+ * such that file names, names and output are only built
+ * for the results actually used, by manhits_get().
+ * Return NULL if the expression is invalid.
+ */
+struct manhits *
+mansearch_hits(const struct mansearch *search,
+		const struct manpaths *paths, int argc, char *argv[])
+{
+	return search_run(search, paths, argc, argv, 0);
+}
 
-	cur = maxres = 0;
-	if (res != NULL)
-		*res = NULL;
+size_t
+manhits_count(const struct manhits *mh)
+{
+	return mh->sz;
+}
+
+/*
+ * Build the requested fields of the result with the number i.
+ * Return NULL if MANPAGE_FILE is requested and the file is missing.
+ */
+const struct manpage *
+manhits_get(struct manhits *mh, size_t i, int fields)
+{
+	assert(i < mh->sz);
+	return hit_build(mh->hits + i, fields) == -1 ?
+	    NULL : &mh->hits[i].mpage;
+}
+
+/*
+ * Build the requested fields of all results and move them
+ * to a new array that the caller passes to mansearch_free().
+ * Results with missing files are skipped if MANPAGE_FILE
+ * is requested.  Return the number of results in the array.
+ */
+size_t
+manhits_take(struct manhits *mh, int fields, struct manpage **res)
+{
+	struct hit	*hit;
+	size_t		 i, sz;
+
+	*res = NULL;
+	sz = 0;
+	for (i = 0; i < mh->sz; i++) {
+		hit = mh->hits + i;
+		if (hit_build(hit, fields) == -1)
+			continue;
+		if (sz == 0)
+			*res = mandoc_reallocarray(NULL,
+			    mh->sz - i, sizeof(**res));
+		(*res)[sz++] = hit->mpage;
+		hit->mpage.file = hit->mpage.names = hit->mpage.output = NULL;
+		hit->built = 0;
+	}
+	return sz;
+}
+
+void
+manhits_free(struct manhits *mh)
+{
+	struct job	*job;
+	size_t		 i;
+
+	if (mh == NULL)
+		return;
+	hits_free(mh->hits, mh->sz);
+	for (i = 0; i < mh->njobs; i++) {
+		job = mh->jobs + i;
+		if (job->db == NULL)
+			continue;
+		dbm_iter_free(job->it);
+		if (job->search->cache)
+			dbm_cache_put(job->db);
+		else
+			dbm_close(job->db);
+	}
+	free(mh->jobs);
+	exprfree(mh->e);
+	free(mh);
+}
+
+/*
+ * Search all trees and collect the results, sorted.
+ * When only counting, stop after the first result.
+ */
+static struct manhits *
+search_run(const struct mansearch *search, const struct manpaths *paths,
+		int argc, char *argv[], int count)
+{
+	struct manhits	*mh;
+	struct expr	*e;
+	struct job	*jobs, *job;
+	size_t		 i, outkey;
+	int		 argi, done, im;
+#if HAVE_PTHREAD
+	int		 irc;
+#endif
+
+	argi = 0;
+	if ((e = exprcomp(search, argc, argv, &argi)) == NULL)
+		return NULL;
 
 	outkey = KEY_Nd;
-	if (search->outkey != NULL)
+	if (search->outkey != NULL) {
 		for (im = 0; im < KEY_MAX; im++)
 			if (0 == strcasecmp(search->outkey,
 			    mansearch_keynames[im])) {
 				outkey = im;
 				break;
 			}
-
-	/*
-	 * Remember the original working directory, if possible.
-	 * This will be needed if the second or a later directory
-	 * is given as a relative path.
-	 * Do not error out if the current directory is not
-	 * searchable: Maybe it won't be needed after all.
-	 */
-
-	if (getcwd(buf, PATH_MAX) == NULL) {
-		getcwd_status = 0;
-		(void)strlcpy(buf, strerror(errno), sizeof(buf));
-	} else
-		getcwd_status = 1;
+		if (0 == strcasecmp(search->outkey, "refby"))
+			outkey = OUTKEY_REFBY;
+	}
 
 	/*
 	 * Loop over the directories (containing databases) for us to
@@ -135,131 +309,335 @@ mansearch(const struct mansearch *search,
 	 * Don't let missing/bad databases/directories phase us.
 	 * In each, try to open the resident database and, if it opens,
 	 * scan it for our match expression.
+	 * The databases stay open until the results are freed.
 	 */
 
-	chdir_status = 0;
+	mh = mandoc_calloc(1, sizeof(*mh));
+	mh->e = e;
+	mh->njobs = paths->sz;
+	mh->jobs = jobs = mandoc_calloc(paths->sz, sizeof(*jobs));
 	for (i = 0; i < paths->sz; i++) {
-		if (chdir_status && paths->paths[i][0] != '/') {
-			if ( ! getcwd_status) {
-				warnx("%s: getcwd: %s", paths->paths[i], buf);
-				continue;
-			} else if (chdir(buf) == -1) {
-				warn("%s", buf);
-				continue;
+		job = jobs + i;
+		job->search = search;
+		job->e = e;
+		job->ipath = i;
+		job->path = paths->paths[i];
+		job->outkey = outkey;
+		job->count = count;
+	}
+
+#if HAVE_PTHREAD
+	/*
+	 * In parallel mode, search each tree in its own thread,
+	 * unless only the first tree having a match is needed.
+	 * If a thread cannot be created, search that tree
+	 * in the main thread after starting the others.
+	 */
+
+	if (search->parallel && search->firstmatch == 0 &&
+	    paths->sz > 1) {
+		for (i = 0; i < paths->sz; i++) {
+			job = jobs + i;
+			if ((irc = pthread_create(&job->thread, NULL,
+			    manpath_thread, job)) == 0)
+				job->threaded = 1;
+			else {
+				errno = irc;
+				warn("pthread_create");
 			}
 		}
-		if (chdir(paths->paths[i]) == -1) {
-			warn("%s", paths->paths[i]);
-			continue;
+		for (i = 0; i < paths->sz; i++) {
+			job = jobs + i;
+			if (job->threaded == 0)
+				manpath_search(job);
+			else if ((irc = pthread_join(job->thread,
+			    NULL)) != 0) {
+				errno = irc;
+				err((int)MANDOCLEVEL_SYSERR, "pthread_join");
+			}
 		}
-		chdir_status = 1;
+	} else
+#endif
+		for (i = 0; i < paths->sz; i++) {
+			manpath_search(jobs + i);
 
-		if (dbm_open(MANDOC_DB) == -1) {
-			if (errno != ENOENT)
-				warn("%s/%s", paths->paths[i], MANDOC_DB);
-			continue;
+			/*
+			 * In man(1) mode, prefer matches in earlier trees
+			 * over matches in later trees.
+			 */
+
+			if (jobs[i].sz && search->firstmatch)
+				break;
 		}
 
-		if ((htab = manmerge(e, NULL)) == NULL) {
-			dbm_close();
-			continue;
+	/* Merge the results in the order of the trees. */
+
+	done = 0;
+	for (i = 0; i < paths->sz; i++) {
+		job = jobs + i;
+		if (done || job->sz == 0)
+			hits_free(job->res, job->sz);
+		else if (count)
+			mh->sz = 1;
+		else {
+			mh->hits = mandoc_reallocarray(mh->hits,
+			    mh->sz + job->sz, sizeof(*mh->hits));
+			memcpy(mh->hits + mh->sz, job->res,
+			    job->sz * sizeof(*mh->hits));
+			mh->sz += job->sz;
+			free(job->res);
 		}
+		job->res = NULL;
+		job->sz = 0;
+		if (mh->sz && (count || search->firstmatch))
+			done = 1;
+	}
 
-		for (rp = ohash_first(htab, &slot); rp != NULL;
-		    rp = ohash_next(htab, &slot)) {
-			page = dbm_page_get(rp->page);
+	if (count)
+		return mh;
+	if (search->limit > 0) {
+		qsort(mh->hits, mh->sz, sizeof(*mh->hits),
+		    hit_rank_compare);
+		if (mh->sz > search->limit) {
+			hits_free(mh->hits + search->limit,
+			    mh->sz - search->limit);
+			mh->sz = search->limit;
+		}
+	} else
+		qsort(mh->hits, mh->sz, sizeof(*mh->hits), hit_compare);
+	return mh;
+}
 
-			if (lstmatch(search->sec, page->sect) == 0 ||
-			    lstmatch(search->arch, page->arch) == 0 ||
-			    (search->argmode == ARG_NAME &&
-			     rp->bits <= (int32_t)(NAME_SYN & NAME_MASK)))
-				continue;
+#if HAVE_PTHREAD
+static void *
+manpath_thread(void *arg)
+{
+	manpath_search(arg);
+	return NULL;
+}
+#endif
 
-			if (res == NULL) {
-				cur = 1;
-				break;
+/*
+ * Search the database of one tree
+ * and collect the results in the job structure.
+ * When only counting, stop after the first result.
+ * When ranking, only collect the best results.
+ */
+static void
+manpath_search(struct job *job)
+{
+	const struct mansearch	*search;
+	struct dbm_page		 page;
+	struct pageset		*ps;
+	char			*dbpath;
+	int32_t			 bits, ip;
+
+	search = job->search;
+	mandoc_asprintf(&dbpath, "%s/%s", job->path, MANDOC_DB);
+	job->db = search->cache ? dbm_cache_get(dbpath) : dbm_open(dbpath);
+	if (job->db == NULL && errno != ENOENT)
+		warn("%s", dbpath);
+	free(dbpath);
+	if (job->db == NULL)
+		return;
+	job->it = dbm_iter_new(job->db);
+	ps = manmerge(job, job->e, NULL);
+
+	if (ps->score != NULL)
+		manpath_rank(job, ps);
+	else {
+		for (ip = 0; ip < ps->npages; ip++) {
+			if (ip % 64 == 0 && ps->set[ip / 64] == 0) {
+				ip += 63;
+				continue;
 			}
-			if (cur + 1 > maxres) {
-				maxres += 1024;
-				*res = mandoc_reallocarray(*res,
-				    maxres, sizeof(**res));
+			if ((ps->set[ip / 64] & 1ULL << ip % 64) == 0)
+				continue;
+			bits = ps->bits == NULL ? 0 : ps->bits[ip];
+			dbm_page_get(job->db, ip, &page);
+			if (manpath_want(search, &page, bits) == 0)
+				continue;
+			if (job->count) {
+				job->sz = 1;
+				break;
 			}
-			mpage = *res + cur;
-			mandoc_asprintf(&mpage->file, "%s/%s",
-			    paths->paths[i], page->file + 1);
-			if (access(chdir_status ? page->file + 1 :
-			    mpage->file, R_OK) == -1) {
-				warn("%s", mpage->file);
+			hit_add(job, ip, &page, bits, 0);
+		}
+	}
+	pageset_free(ps);
+}
+
+/*
+ * Collect the pages with the highest relevance scores, in order.
+ * Once the limit is reached, only add pages that might still
+ * compare equal to the last one, such that the final sort
+ * can decide between them.
+ * To be sure about the limit, check that the files exist.
+ */
+static void
+manpath_rank(struct job *job, struct pageset *ps)
+{
+	struct dbm_page		 page;
+	struct rank		*ranks, *last;
+	struct hit		*hit;
+	int32_t			 bits, ip, ir, nr;
+
+	ranks = mandoc_reallocarray(NULL, pageset_count(ps) + 1,
+	    sizeof(*ranks));
+	nr = 0;
+	for (ip = 0; ip < ps->npages; ip++) {
+		if ((ps->set[ip / 64] & 1ULL << ip % 64) == 0)
+			continue;
+		bits = ps->bits == NULL ? 0 : ps->bits[ip];
+		dbm_page_get(job->db, ip, &page);
+		if (manpath_want(job->search, &page, bits) == 0)
+			continue;
+		ranks[nr].page = ip;
+		ranks[nr].score = ps->score[ip];
+		ranks[nr].prio = sec_prio(*page.sect - '0');
+		nr++;
+	}
+	qsort(ranks, nr, sizeof(*ranks), rank_compare);
+
+	last = NULL;
+	for (ir = 0; ir < nr; ir++) {
+		if (job->sz >= job->search->limit &&
+		    rank_compare(ranks + ir, last) != 0)
+			break;
+		ip = ranks[ir].page;
+		bits = ps->bits == NULL ? 0 : ps->bits[ip];
+		dbm_page_get(job->db, ip, &page);
+		hit = hit_add(job, ip, &page, bits, ranks[ir].score);
+		if (hit_build(hit, MANPAGE_FILE) == -1) {
+			hits_free(hit, 1);
+			job->sz--;
+		} else
+			last = ranks + ir;
+	}
+	free(ranks);
+}
+
+/*
+ * Return 1 if the page passes the section and architecture filters
+ * and, in man(1) mode, if the name is not only in the SYNOPSIS.
+ */
+static int
+manpath_want(const struct mansearch *search,
+		const struct dbm_page *page, int32_t bits)
+{
+	return lstmatch(search->sec, page->sect) &&
+	    lstmatch(search->arch, page->arch) &&
+	    (search->argmode != ARG_NAME ||
+	     bits > (int32_t)(NAME_SYN & NAME_MASK));
+}
+
+/*
+ * Add one page to the results of the job,
+ * without building any strings yet.
+ */
+static struct hit *
+hit_add(struct job *job, int32_t ip, const struct dbm_page *page,
+		int32_t bits, int32_t score)
+{
+	struct hit	*hit;
+
+	if (job->sz + 1 > job->maxres) {
+		job->maxres += 1024;
+		job->res = mandoc_reallocarray(job->res,
+		    job->maxres, sizeof(*job->res));
+	}
+	hit = job->res + job->sz++;
+	memset(hit, 0, sizeof(*hit));
+	hit->job = job;
+	hit->page = ip;
+	hit->mpage.bits = job->search->firstmatch ? bits : 0;
+	hit->mpage.score = score;
+	hit->mpage.ipath = job->ipath;
+	hit->mpage.sec = *page->sect - '0';
+	if (hit->mpage.sec < 0 || hit->mpage.sec > 9)
+		hit->mpage.sec = 10;
+	hit->mpage.form = *page->file;
+	return hit;
+}
+
+/*
+ * Build those of the requested fields of the result
+ * that were not built before.
+ * Return -1 if MANPAGE_FILE is requested and the file is missing.
+ */
+static int
+hit_build(struct hit *hit, int fields)
+{
+	struct dbm_page	 page;
+	struct job	*job;
+	int		 todo;
+
+	if ((todo = fields & ~hit->built) != 0) {
+		job = hit->job;
+		dbm_page_get(job->db, hit->page, &page);
+		if (todo & MANPAGE_FILE) {
+			mandoc_asprintf(&hit->mpage.file, "%s/%s",
+			    job->path, page.file + 1);
+			if (access(hit->mpage.file, R_OK) == -1) {
+				warn("%s", hit->mpage.file);
 				warnx("outdated mandoc.db contains "
 				    "bogus %s entry, run makewhatis %s",
-				    page->file + 1, paths->paths[i]);
-				free(mpage->file);
-				free(rp);
-				continue;
+				    page.file + 1, job->path);
+				hit->missing = 1;
 			}
-			mpage->names = buildnames(page);
-			mpage->output = buildoutput(outkey, page);
-			mpage->bits = search->firstmatch ? rp->bits : 0;
-			mpage->ipath = i;
-			mpage->sec = *page->sect - '0';
-			if (mpage->sec < 0 || mpage->sec > 9)
-				mpage->sec = 10;
-			mpage->form = *page->file;
-			free(rp);
-			cur++;
-		}
-		ohash_delete(htab);
-		free(htab);
-		dbm_close();
+		}
+		if (todo & MANPAGE_NAMES)
+			hit->mpage.names = buildnames(&page);
+		if (todo & MANPAGE_OUTPUT)
+			hit->mpage.output = buildoutput(job, hit->page, &page);
+		hit->built |= todo;
+	}
+	return fields & MANPAGE_FILE && hit->missing ? -1 : 0;
+}
 
-		/*
-		 * In man(1) mode, prefer matches in earlier trees
-		 * over matches in later trees.
-		 */
+static void
+hits_free(struct hit *hits, size_t sz)
+{
+	size_t	 i;
 
-		if (cur && search->firstmatch)
-			break;
+	for (i = 0; i < sz; i++) {
+		free(hits[i].mpage.file);
+		free(hits[i].mpage.names);
+		free(hits[i].mpage.output);
 	}
-	if (res != NULL)
-		qsort(*res, cur, sizeof(struct manpage), manpage_compare);
-	if (chdir_status && getcwd_status && chdir(buf) == -1)
-		warn("%s", buf);
-	exprfree(e);
-	*sz = cur;
-	return res != NULL || cur;
 }
 
 /*
  * Merge the results for the expression tree rooted at e
- * into the the result list htab.
+ * into the result set ps.
  */
-static struct ohash *
-manmerge(struct expr *e, struct ohash *htab)
+static struct pageset *
+manmerge(struct job *job, struct expr *e, struct pageset *ps)
 {
 	switch (e->type) {
 	case EXPR_TERM:
-		return manmerge_term(e, htab);
+		return manmerge_term(job, e, ps);
 	case EXPR_OR:
-		return manmerge_or(e->child, htab);
+		return manmerge_or(job, e->child, ps);
 	case EXPR_AND:
-		return manmerge_and(e->child, htab);
+		return manmerge_and(job, e->child, ps);
 	default:
 		abort();
 	}
 }
 
-static struct ohash *
-manmerge_term(struct expr *e, struct ohash *htab)
+static struct pageset *
+manmerge_term(struct job *job, struct expr *e, struct pageset *ps)
 {
-	struct dbm_res	 res, *rp;
+	struct dbm_iter	*it;
+	struct dbm_res	 res;
 	uint64_t	 ib;
-	unsigned int	 slot;
 	int		 im;
 
-	if (htab == NULL) {
-		htab = mandoc_malloc(sizeof(*htab));
-		mandoc_ohash_init(htab, 4, offsetof(struct dbm_res, page));
-	}
+	if (ps == NULL)
+		ps = pageset_new(dbm_page_count(job->db),
+		    job->search->limit > 0 && job->count == 0);
+	it = job->it;
 
 	for (im = 0, ib = 1; im < KEY_MAX; im++, ib <<= 1) {
 		if ((e->bits & ib) == 0)
@@ -267,125 +645,197 @@ manmerge_term(struct expr *e, struct ohash *htab)
 
 		switch (ib) {
 		case TYPE_arch:
-			dbm_page_byarch(&e->match);
+			dbm_page_byarch(it, &e->match);
 			break;
 		case TYPE_sec:
-			dbm_page_bysect(&e->match);
+			dbm_page_bysect(it, &e->match);
 			break;
 		case TYPE_Nm:
-			dbm_page_byname(&e->match);
+			dbm_page_byname(it, &e->match);
 			break;
 		case TYPE_Nd:
-			dbm_page_bydesc(&e->match);
+			dbm_page_bydesc(it, &e->match);
 			break;
 		default:
-			dbm_page_bymacro(im - 2, &e->match);
+			dbm_page_bymacro(it, im - 2, &e->match);
 			break;
 		}
 
-		/*
-		 * When hashing for deduplication, use the unique
-		 * page ID itself instead of a hash function;
-		 * that is quite efficient.
-		 */
-
 		for (;;) {
-			res = dbm_page_next();
+			res = dbm_page_next(it);
 			if (res.page == -1)
 				break;
-			slot = ohash_lookup_memory(htab,
-			    (char *)&res, sizeof(res.page), res.page);
-			if ((rp = ohash_find(htab, slot)) != NULL) {
-				rp->bits |= res.bits;
+			ps->set[res.page / 64] |= 1ULL << res.page % 64;
+			if (ps->score != NULL)
+				ps->score[res.page] +=
+				    term_score(job, e, ib, &res);
+			if (res.bits == 0)
 				continue;
-			}
-			rp = mandoc_malloc(sizeof(*rp));
-			*rp = res;
-			ohash_insert(htab, slot, rp);
+			if (ps->bits == NULL)
+				ps->bits = mandoc_calloc(ps->npages,
+				    sizeof(*ps->bits));
+			ps->bits[res.page] |= res.bits;
+		}
+	}
+	return ps;
+}
+
+/*
+ * Relevance of one match of a term, depending on where it was found.
+ * Names count most, the more so the more prominent they are
+ * and even more if the page has a name equal to the term,
+ * followed by descriptions, section headers, and other macros.
+ * Architectures and sections only serve as filters.
+ */
+static int32_t
+term_score(struct job *job, const struct expr *e, uint64_t ib,
+		const struct dbm_res *res)
+{
+	struct dbm_page	 page;
+	const char	*cp;
+
+	switch (ib) {
+	case TYPE_arch:
+	case TYPE_sec:
+		return 0;
+	case TYPE_Nm:
+		if (e->word != NULL) {
+			dbm_page_get(job->db, res->page, &page);
+			for (cp = page.name; *cp != '\0';
+			    cp = strchr(cp, '\0') + 1)
+				if (strcasecmp(cp + 1, e->word) == 0)
+					return 64 + (res->bits & NAME_MASK);
 		}
+		return 32 + (res->bits & NAME_MASK);
+	case TYPE_Nd:
+		return 16;
+	case TYPE_Sh:
+	case TYPE_Ss:
+		return 4;
+	default:
+		return 2;
 	}
-	return htab;
 }
 
-static struct ohash *
-manmerge_or(struct expr *e, struct ohash *htab)
+static struct pageset *
+manmerge_or(struct job *job, struct expr *e, struct pageset *ps)
 {
 	while (e != NULL) {
-		htab = manmerge(e, htab);
+		ps = manmerge(job, e, ps);
 		e = e->next;
 	}
-	return htab;
+	return ps;
 }
 
-static struct ohash *
-manmerge_and(struct expr *e, struct ohash *htab)
+static struct pageset *
+manmerge_and(struct job *job, struct expr *e, struct pageset *ps)
 {
-	struct ohash	*hand, *h1, *h2;
-	struct dbm_res	*res;
-	unsigned int	 slot1, slot2;
+	struct pageset	*hand, *h2;
+	int32_t		*bits;
+	uint64_t	 word;
+	int32_t		 ip, iw, nw;
 
 	/* Evaluate the first term of the AND clause. */
 
-	hand = manmerge(e, NULL);
+	hand = manmerge(job, e, NULL);
+	nw = (hand->npages + 63) / 64;
 
 	while ((e = e->next) != NULL) {
 
-		/* Evaluate the next term and prepare for ANDing. */
-
-		h2 = manmerge(e, NULL);
-		if (ohash_entries(h2) < ohash_entries(hand)) {
-			h1 = h2;
-			h2 = hand;
-		} else
-			h1 = hand;
-		hand = mandoc_malloc(sizeof(*hand));
-		mandoc_ohash_init(hand, 4, offsetof(struct dbm_res, page));
-
-		/* Keep all pages that are in both result sets. */
+		/*
+		 * Evaluate the next term and keep all pages
+		 * that are in both result sets, taking the
+		 * quality from the smaller one.
+		 */
 
-		for (res = ohash_first(h1, &slot1); res != NULL;
-		    res = ohash_next(h1, &slot1)) {
-			if (ohash_find(h2, ohash_lookup_memory(h2,
-			    (char *)res, sizeof(res->page),
-			    res->page)) == NULL)
-				free(res);
-			else
-				ohash_insert(hand, ohash_lookup_memory(hand,
-				    (char *)res, sizeof(res->page),
-				    res->page), res);
+		h2 = manmerge(job, e, NULL);
+		if (pageset_count(h2) < pageset_count(hand)) {
+			bits = hand->bits;
+			hand->bits = h2->bits;
+			h2->bits = bits;
 		}
-
-		/* Discard the merged results. */
-
-		for (res = ohash_first(h2, &slot2); res != NULL;
-		    res = ohash_next(h2, &slot2))
-			free(res);
-		ohash_delete(h2);
-		free(h2);
-		ohash_delete(h1);
-		free(h1);
+		for (iw = 0; iw < nw; iw++)
+			hand->set[iw] &= h2->set[iw];
+		if (hand->bits != NULL)
+			for (ip = 0; ip < hand->npages; ip++)
+				if ((hand->set[ip / 64] &
+				    1ULL << ip % 64) == 0)
+					hand->bits[ip] = 0;
+		if (hand->score != NULL)
+			for (ip = 0; ip < hand->npages; ip++)
+				hand->score[ip] = hand->set[ip / 64] &
+				    1ULL << ip % 64 ?
+				    hand->score[ip] + h2->score[ip] : 0;
+		pageset_free(h2);
 	}
 
-	/* Merge the result of the AND into htab. */
+	/*
+	 * Merge the result of the AND into ps,
+	 * keeping the quality of pages already contained in ps
+	 * and adding up the relevance.
+	 */
 
-	if (htab == NULL)
+	if (ps == NULL)
 		return hand;
 
-	for (res = ohash_first(hand, &slot1); res != NULL;
-	    res = ohash_next(hand, &slot1)) {
-		slot2 = ohash_lookup_memory(htab,
-		    (char *)res, sizeof(res->page), res->page);
-		if (ohash_find(htab, slot2) == NULL)
-			ohash_insert(htab, slot2, res);
-		else
-			free(res);
+	if (ps->score != NULL)
+		for (ip = 0; ip < ps->npages; ip++)
+			ps->score[ip] += hand->score[ip];
+
+	for (iw = 0; iw < nw; iw++) {
+		word = hand->set[iw] & ~ps->set[iw];
+		ps->set[iw] |= hand->set[iw];
+		if (word == 0 || hand->bits == NULL)
+			continue;
+		if (ps->bits == NULL)
+			ps->bits = mandoc_calloc(ps->npages,
+			    sizeof(*ps->bits));
+		for (ip = iw * 64; word != 0; ip++, word >>= 1)
+			if (word & 1)
+				ps->bits[ip] = hand->bits[ip];
 	}
+	pageset_free(hand);
+	return ps;
+}
 
-	/* Discard the merged result. */
+/*
+ * A set of manual pages, using one bit for each page in the database.
+ * The name quality is only stored if at least one page has any.
+ */
+static struct pageset *
+pageset_new(int32_t npages, int rank)
+{
+	struct pageset	*ps;
+
+	ps = mandoc_malloc(sizeof(*ps));
+	ps->set = mandoc_calloc(npages / 64 + 1, sizeof(*ps->set));
+	ps->bits = NULL;
+	ps->score = rank ? mandoc_calloc(npages + 1, sizeof(*ps->score)) :
+	    NULL;
+	ps->npages = npages;
+	return ps;
+}
+
+static void
+pageset_free(struct pageset *ps)
+{
+	free(ps->set);
+	free(ps->bits);
+	free(ps->score);
+	free(ps);
+}
 
-	ohash_delete(hand);
-	free(hand);
-	return htab;
+static int32_t
+pageset_count(const struct pageset *ps)
+{
+	uint64_t	 word;
+	int32_t		 count, iw;
+
+	count = 0;
+	for (iw = 0; iw < (ps->npages + 63) / 64; iw++)
+		for (word = ps->set[iw]; word != 0; word &= word - 1)
+			count++;
+	return count;
 }
 
 void
@@ -402,34 +852,75 @@ mansearch_free(struct manpage *res, size_t sz)
 }
 
 static int
-manpage_compare(const void *vp1, const void *vp2)
+hit_compare(const void *vp1, const void *vp2)
 {
-	const struct manpage	*mp1, *mp2;
-	const char		*cp1, *cp2;
-	size_t			 sz1, sz2;
-	int			 diff;
-
-	mp1 = vp1;
-	mp2 = vp2;
-	if ((diff = mp2->bits - mp1->bits) ||
-	    (diff = mp1->sec - mp2->sec))
+	struct hit	*hp1, *hp2;
+	const char	*cp1, *cp2;
+	size_t		 sz1, sz2;
+	int		 diff;
+
+	hp1 = (struct hit *)vp1;
+	hp2 = (struct hit *)vp2;
+	if ((diff = hp2->mpage.bits - hp1->mpage.bits) ||
+	    (diff = hp1->mpage.sec - hp2->mpage.sec))
 		return diff;
 
 	/* Fall back to alphabetic ordering of names. */
-	sz1 = strcspn(mp1->names, "(");
-	sz2 = strcspn(mp2->names, "(");
+	hit_build(hp1, MANPAGE_NAMES);
+	hit_build(hp2, MANPAGE_NAMES);
+	sz1 = strcspn(hp1->mpage.names, "(");
+	sz2 = strcspn(hp2->mpage.names, "(");
 	if (sz1 < sz2)
 		sz1 = sz2;
-	if ((diff = strncasecmp(mp1->names, mp2->names, sz1)))
+	if ((diff = strncasecmp(hp1->mpage.names, hp2->mpage.names, sz1)))
 		return diff;
 
 	/* For identical names and sections, prefer arch-dependent. */
-	cp1 = strchr(mp1->names + sz1, '/');
-	cp2 = strchr(mp2->names + sz2, '/');
+	cp1 = strchr(hp1->mpage.names + sz1, '/');
+	cp2 = strchr(hp2->mpage.names + sz2, '/');
 	return cp1 != NULL && cp2 != NULL ? strcasecmp(cp1, cp2) :
 	    cp1 != NULL ? -1 : cp2 != NULL ? 1 : 0;
 }
 
+/*
+ * Compare by relevance, then by section priority,
+ * and for equal ranks, fall back to the usual ordering.
+ */
+static int
+hit_rank_compare(const void *vp1, const void *vp2)
+{
+	const struct hit	*hp1, *hp2;
+	int			 diff;
+
+	hp1 = vp1;
+	hp2 = vp2;
+	if ((diff = hp2->mpage.score - hp1->mpage.score) ||
+	    (diff = sec_prio(hp1->mpage.sec) - sec_prio(hp2->mpage.sec)))
+		return diff;
+	return hit_compare(vp1, vp2);
+}
+
+static int
+rank_compare(const void *vp1, const void *vp2)
+{
+	const struct rank	*rp1, *rp2;
+
+	rp1 = vp1;
+	rp2 = vp2;
+	return rp1->score != rp2->score ? rp2->score - rp1->score :
+	    rp1->prio - rp2->prio;
+}
+
+/*
+ * Priority of a section number for ranking, lower is better;
+ * the same order as used by man(1) to select the best page.
+ */
+static int
+sec_prio(int sec)
+{
+	return sec >= 1 && sec <= 9 ? sec_prios[sec - 1] : 10;
+}
+
 static char *
 buildnames(const struct dbm_page *page)
 {
@@ -546,16 +1037,19 @@ lstmatch(const char *want, const char *have)
 }
 
 /*
- * Build a list of values taken by the macro im in the manual page.
+ * Build a list of values taken by the macro im in the manual page,
+ * or for OUTKEY_REFBY, a list of the pages referring to it.
  */
 static char *
-buildoutput(size_t im, struct dbm_page *page)
+buildoutput(struct job *job, int32_t ip, struct dbm_page *page)
 {
+	struct dbm_page	 refpage;
+	struct dbm_res	 res;
 	const char	*oldoutput, *sep, *input;
 	char		*output, *newoutput, *value;
 	size_t		 sz, i;
 
-	switch (im) {
+	switch (job->outkey) {
 	case KEY_Nd:
 		return mandoc_strdup(page->desc);
 	case KEY_Nm:
@@ -585,8 +1079,25 @@ buildoutput(size_t im, struct dbm_page *page)
 	}
 
 	output = NULL;
-	dbm_macro_bypage(im - 2, page->addr);
-	while ((value = dbm_macro_next()) != NULL) {
+	if (job->outkey == OUTKEY_REFBY) {
+		if (dbm_page_byxref(job->it, ip) == -1)
+			return NULL;
+		while ((res = dbm_page_next(job->it)).page != -1) {
+			dbm_page_get(job->db, res.page, &refpage);
+			value = buildnames(&refpage);
+			if (output == NULL) {
+				output = value;
+				continue;
+			}
+			mandoc_asprintf(&newoutput, "%s # %s", output, value);
+			free(output);
+			free(value);
+			output = newoutput;
+		}
+		return output;
+	}
+	dbm_macro_bypage(job->it, job->outkey - 2, page->addr);
+	while ((value = dbm_macro_next(job->it)) != NULL) {
 		if (output == NULL) {
 			oldoutput = "";
 			sep = "";
@@ -750,7 +1261,7 @@ exprterm(const struct mansearch *search, int argc, char *argv[], int *argi)
 	if (search->argmode == ARG_NAME) {
 		e->bits = TYPE_Nm;
 		e->match.type = DBM_EXACT;
-		e->match.str = argv[(*argi)++];
+		e->match.str = e->word = argv[(*argi)++];
 		return e;
 	}
 
@@ -781,7 +1292,7 @@ exprterm(const struct mansearch *search, int argc, char *argv[], int *argi)
 			e->bits = TYPE_Nm | TYPE_Nd;
 		if (*val == '=') {
 			e->match.type = DBM_SUB;
-			e->match.str = val + 1;
+			e->match.str = e->word = val + 1;
 		} else
 			e->match.type = DBM_REGEX;
 		*val++ = '\0';
@@ -799,6 +1310,16 @@ exprterm(const struct mansearch *search, int argc, char *argv[], int *argi)
 			regerror(irc, e->match.re, errbuf, sizeof(errbuf));
 			warnx("regcomp /%s/: %s", val, errbuf);
 		}
+		if (irc == 0) {
+			e->match.icase = cs == 0;
+			e->match.prefix = exprprefix(val);
+			e->match.lit = exprlit(search->argmode == ARG_WORD ?
+			    argv[*argi] : val);
+			e->word = search->argmode == ARG_WORD ?
+			    argv[*argi] : val;
+			if (strpbrk(e->word, "\\^$.[]()|*+?{}") != NULL)
+				e->word = NULL;
+		}
 		if (search->argmode == ARG_WORD)
 			free(val);
 		if (irc) {
@@ -840,6 +1361,105 @@ exprterm(const struct mansearch *search, int argc, char *argv[], int *argi)
 	return e;
 }
 
+/*
+ * If the regular expression can only match at the beginning
+ * of a string starting with some literal ASCII characters,
+ * return an allocated copy of these characters.
+ * Such a prefix allows using the index of names.
+ */
+static char *
+exprprefix(const char *re)
+{
+	const char	*cp;
+	size_t		 sz;
+
+	if (*re++ != '^' || strchr(re, '|') != NULL)
+		return NULL;
+	sz = strcspn(re, "\\^$.[]()*+?{}|");
+	if (sz > 0 && re[sz] != '\0' && strchr("*?{", re[sz]) != NULL)
+		sz--;
+	if (sz == 0)
+		return NULL;
+	for (cp = re; cp < re + sz; cp++)
+		if ((unsigned char)*cp > 0x7f)
+			return NULL;
+	return mandoc_strndup(re, sz);
+}
+
+/*
+ * If every string matching the regular expression contains
+ * a literal substring of at least three characters,
+ * return an allocated copy of the longest such substring.
+ * Such a substring allows using the trigram index.
+ * Expressions containing alternatives or groups are not analyzed.
+ */
+static char *
+exprlit(const char *re)
+{
+	const char	*cp, *lit, *run;
+	size_t		 sz;
+	char		 delim;
+
+	if (strpbrk(re, "|(") != NULL)
+		return NULL;
+	lit = run = NULL;
+	sz = 0;
+	for (cp = re; ; cp++) {
+
+		/* Literal characters extend the current run. */
+
+		if (*cp != '\0' && strchr("\\^$.[]*+?{}", *cp) == NULL &&
+		    (cp[1] == '\0' || strchr("*?{", cp[1]) == NULL)) {
+			if (run == NULL)
+				run = cp;
+			continue;
+		}
+
+		/* Anything else ends it. */
+
+		if (run != NULL && (size_t)(cp - run) > sz) {
+			lit = run;
+			sz = cp - run;
+		}
+		run = NULL;
+
+		switch (*cp) {
+		case '\0':
+			return sz < 3 ? NULL : mandoc_strndup(lit, sz);
+		case '\\':
+			if (cp[1] != '\0')
+				cp++;
+			break;
+		case '[':
+			if (cp[1] == '^')
+				cp++;
+			if (cp[1] == ']')
+				cp++;
+			while (cp[1] != '\0' && cp[1] != ']') {
+				cp++;
+				if (cp[0] != '[' || cp[1] == '\0' ||
+				    strchr(":.=", cp[1]) == NULL)
+					continue;
+				delim = *++cp;
+				while (cp[1] != '\0' &&
+				    (cp[1] != delim || cp[2] != ']'))
+					cp++;
+				if (cp[1] != '\0')
+					cp += 2;
+			}
+			if (cp[1] != '\0')
+				cp++;
+			break;
+		case '{':
+			while (cp[1] != '\0' && cp[1] != '}')
+				cp++;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 static void
 exprfree(struct expr *e)
 {
@@ -847,5 +1467,7 @@ exprfree(struct expr *e)
 		exprfree(e->next);
 	if (e->child != NULL)
 		exprfree(e->child);
+	free(e->match.prefix);
+	free(e->match.lit);
 	free(e);
 }
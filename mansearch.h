@@ -18,11 +18,19 @@
 
 #define	MANDOC_DB	 "mandoc.db"
 #define	MANDOCDB_MAGIC	 0x3a7d0cdb
-#define	MANDOCDB_VERSION 1
+#define	MANDOCDB_VERSION 2
 
 #define	MACRO_MAX	 36
+#define	INDEX_NAME	 0
+#define	INDEX_TRIGRAM	 1
+#define	INDEX_XREF	 2
+#define	INDEX_FILE	 3
+#define	INDEX_DIGEST	 4
+#define	INDEX_MAX	 5
+#define	DIGEST_MAX	 (3 + INDEX_DIGEST) /* all, pages, macros, indexes */
 #define	KEY_arch	 0
 #define	KEY_sec		 1
+#define	KEY_Xr		 2
 #define	KEY_Nm		 38
 #define	KEY_Nd		 39
 #define	KEY_MAX		 40
@@ -75,6 +83,13 @@
 #define	NAME_FILE	 0x0000004000000010ULL
 #define	NAME_MASK	 0x000000000000001fULL
 
+/* Trigrams consist of ASCII characters, folded to lower case. */
+#define	TRIGRAM_CHAR(c)	 ((c) > 0 && (c) < 0x80)
+#define	TRIGRAM_FOLD(c)	 ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+#define	TRIGRAM_VALUE(cp) \
+	(TRIGRAM_FOLD((cp)[0]) << 16 | TRIGRAM_FOLD((cp)[1]) << 8 | \
+	 TRIGRAM_FOLD((cp)[2]))
+
 enum	form {
 	FORM_SRC = 1,	/* Format is mdoc(7) or man(7). */
 	FORM_CAT,	/* Manual page is preformatted. */
@@ -93,6 +108,7 @@ struct	manpage {
 	char		*names; /* a list of names with sections */
 	char		*output; /* user-defined additional output */
 	uint64_t	 bits; /* name type mask */
+	int32_t		 score; /* relevance, if ranked */
 	size_t		 ipath; /* number of the manpath */
 	int		 sec; /* section number, 10 means invalid */
 	enum form	 form;
@@ -102,12 +118,22 @@ struct	mansearch {
 	const char	*arch; /* architecture/NULL */
 	const char	*sec; /* mansection/NULL */
 	const char	*outkey; /* show content of this macro */
+	size_t		 limit; /* rank and show only the best results */
 	enum argmode	 argmode; /* interpretation of arguments */
 	int		 firstmatch; /* first matching database only */
+	int		 parallel; /* search databases in parallel */
+	int		 cache; /* keep databases open after searching */
 };
 
 
+/* Fields of struct manpage to build with manhits_get(). */
+#define	MANPAGE_FILE	 0x01
+#define	MANPAGE_NAMES	 0x02
+#define	MANPAGE_OUTPUT	 0x04
+#define	MANPAGE_ALL	 0x07
+
 struct	manpaths;
+struct	manhits;
 
 int	mansearch(const struct mansearch *cfg, /* options */
 		const struct manpaths *paths, /* manpaths */
@@ -116,3 +142,9 @@ int	mansearch(const struct mansearch *cfg, /* options */
 		struct manpage **res, /* results */
 		size_t *ressz); /* results returned */
 void	mansearch_free(struct manpage *, size_t);
+struct manhits *mansearch_hits(const struct mansearch *,
+		const struct manpaths *, int, char *[]);
+size_t	manhits_count(const struct manhits *);
+const struct manpage *manhits_get(struct manhits *, size_t, int);
+size_t	manhits_take(struct manhits *, int, struct manpage **);
+void	manhits_free(struct manhits *);
@@ -33,9 +33,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
@@ -50,6 +52,31 @@
 #include "tag.h"
 
 #define	REPARSE_LIMIT	1000
+#define	SOCACHE_MAX	(8 * 1024 * 1024) /* bytes of .so targets kept */
+
+/*
+ * Decompressed content of a gzipped file included with .so,
+ * kept until mparse_free() such that other pages including
+ * the same file need not decompress it again.
+ */
+struct	sofile {
+	struct sofile	 *next;
+	char		 *buf; /* decompressed content */
+	size_t		  sz; /* bytes in buf */
+	dev_t		  dev; /* identifying the compressed file */
+	ino_t		  ino;
+	off_t		  size;
+	time_t		  mtime;
+};
+
+/*
+ * Who owns the input buffer returned by read_whole_file().
+ */
+enum	rbuf {
+	RBUF_MMAP, /* mapped file, to be unmapped */
+	RBUF_POOL, /* allocated, to be returned to the pool */
+	RBUF_CACHE /* owned by the .so cache */
+};
 
 struct	mparse {
 	struct roff	 *roff; /* roff parser (!NULL) */
@@ -57,20 +84,31 @@ struct	mparse {
 	struct buf	 *primary; /* buffer currently being parsed */
 	struct buf	 *secondary; /* copy of top level input */
 	struct buf	 *loop; /* open .while request line */
+	struct buf	 *pool; /* unused input buffers */
+	struct sofile	 *socache; /* decompressed .so targets */
+	size_t		  socachesz; /* total bytes in socache */
+	double		  readtime; /* seconds reading, for MPARSE_STATS */
 	const char	 *os_s; /* default operating system */
 	int		  options; /* parser options */
 	int		  gzip; /* current input file is gzipped */
 	int		  filenc; /* encoding of the current file */
 	int		  reparse_count; /* finite interp. stack */
 	int		  line; /* line number in the file */
+	int		  sofiles; /* .so requests followed since reset */
+	int		  hashed; /* hash is valid, for MPARSE_HASH */
+	unsigned int	  hash; /* of the top level input */
 };
 
 static	void	  choose_parser(struct mparse *);
 static	void	  free_buf_list(struct buf *);
 static	void	  resize_buf(struct buf *, size_t);
 static	int	  mparse_buf_r(struct mparse *, struct buf, size_t, int);
-static	int	  read_whole_file(struct mparse *, int, struct buf *, int *);
+static	int	  read_whole_file(struct mparse *, int, struct buf *,
+			int, enum rbuf *);
+static	void	  pool_get(struct mparse *, struct buf *);
+static	void	  pool_put(struct mparse *, char *, size_t);
 static	void	  mparse_end(struct mparse *);
+static	void	  hash_buf(struct mparse *, const struct buf *);
 
 
 static void
@@ -94,6 +132,38 @@ free_buf_list(struct buf *buf)
 	}
 }
 
+/*
+ * Take an input buffer from the pool, or an empty one.
+ * Its size is only a lower bound of the allocated size.
+ */
+static void
+pool_get(struct mparse *curp, struct buf *fb)
+{
+	struct buf	*pb;
+
+	if ((pb = curp->pool) == NULL) {
+		fb->buf = NULL;
+		fb->sz = 0;
+		return;
+	}
+	curp->pool = pb->next;
+	fb->buf = pb->buf;
+	fb->sz = pb->sz;
+	free(pb);
+}
+
+static void
+pool_put(struct mparse *curp, char *buf, size_t sz)
+{
+	struct buf	*pb;
+
+	pb = mandoc_malloc(sizeof(*pb));
+	pb->buf = buf;
+	pb->sz = sz;
+	pb->next = curp->pool;
+	curp->pool = pb;
+}
+
 static void
 choose_parser(struct mparse *curp)
 {
@@ -377,6 +447,7 @@ rerun:
 				    mandoc_strdup(ln.buf + of);
 				goto out;
 			}
+			curp->sofiles++;
 			if ((fd = mparse_open(curp, ln.buf + of)) != -1) {
 				mparse_readfd(curp, fd, ln.buf + of);
 				close(fd);
@@ -429,11 +500,14 @@ out:
 }
 
 static int
-read_whole_file(struct mparse *curp, int fd, struct buf *fb, int *with_mmap)
+read_whole_file(struct mparse *curp, int fd, struct buf *fb,
+	int isso, enum rbuf *how)
 {
 	struct stat	 st;
+	struct sofile	*sf;
 	gzFile		 gz;
-	size_t		 off;
+	unsigned char	 trailer[4];
+	size_t		 off, isize;
 	ssize_t		 ssz;
 	int		 gzerrnum, retval;
 
@@ -454,14 +528,54 @@ read_whole_file(struct mparse *curp, int fd, struct buf *fb, int *with_mmap)
 			mandoc_msg(MANDOCERR_TOOLARGE, 0, 0, NULL);
 			return -1;
 		}
-		*with_mmap = 1;
+		*how = RBUF_MMAP;
 		fb->sz = (size_t)st.st_size;
 		fb->buf = mmap(NULL, fb->sz, PROT_READ, MAP_SHARED, fd, 0);
 		if (fb->buf != MAP_FAILED)
 			return 0;
 	}
 
+	/* A gzipped file may already be decompressed in the cache. */
+
+	if (curp->gzip) {
+		for (sf = curp->socache; sf != NULL; sf = sf->next) {
+			if (sf->dev == st.st_dev && sf->ino == st.st_ino &&
+			    sf->size == st.st_size &&
+			    sf->mtime == st.st_mtime) {
+				*how = RBUF_CACHE;
+				fb->buf = sf->buf;
+				fb->sz = sf->sz;
+				return 0;
+			}
+		}
+	}
+
+	*how = RBUF_POOL;
+	pool_get(curp, fb);
+
 	if (curp->gzip) {
+		/*
+		 * The last four bytes of a gzip file contain the size
+		 * of the decompressed data modulo 2^32.  Use it to make
+		 * the buffer large enough to begin with, such that
+		 * it need not be enlarged while decompressing.
+		 * Deflate cannot compress by more than a factor
+		 * of 1032, so do not trust larger sizes.
+		 */
+		if (S_ISREG(st.st_mode) && st.st_size >= 18 &&
+		    pread(fd, trailer, sizeof(trailer),
+		     st.st_size - sizeof(trailer)) == sizeof(trailer)) {
+			isize = (size_t)trailer[0] |
+			    (size_t)trailer[1] << 8 |
+			    (size_t)trailer[2] << 16 |
+			    (size_t)(trailer[3] & 0x7f) << 24;
+			if (isize >= fb->sz &&
+			    isize / 1032 <= (size_t)st.st_size) {
+				fb->sz = isize + 1;
+				fb->buf = mandoc_realloc(fb->buf, fb->sz);
+			}
+		}
+
 		/*
 		 * Duplicating the file descriptor is required
 		 * because we will have to call gzclose(3)
@@ -472,12 +586,14 @@ read_whole_file(struct mparse *curp, int fd, struct buf *fb, int *with_mmap)
 		if ((fd = dup(fd)) == -1) {
 			mandoc_msg(MANDOCERR_DUP, 0, 0,
 			    "%s", strerror(errno));
+			free(fb->buf);
 			return -1;
 		}
 		if ((gz = gzdopen(fd, "rb")) == NULL) {
 			mandoc_msg(MANDOCERR_GZDOPEN, 0, 0,
 			    "%s", strerror(errno));
 			close(fd);
+			free(fb->buf);
 			return -1;
 		}
 	} else
@@ -488,14 +604,11 @@ read_whole_file(struct mparse *curp, int fd, struct buf *fb, int *with_mmap)
 	 * go the old way and just read things in bit by bit.
 	 */
 
-	*with_mmap = 0;
 	off = 0;
 	retval = -1;
-	fb->sz = 0;
-	fb->buf = NULL;
 	for (;;) {
 		if (off == fb->sz) {
-			if (fb->sz == (1U << 31)) {
+			if (fb->sz >= (1U << 31)) {
 				mandoc_msg(MANDOCERR_TOOLARGE, 0, 0, NULL);
 				break;
 			}
@@ -527,6 +640,28 @@ read_whole_file(struct mparse *curp, int fd, struct buf *fb, int *with_mmap)
 	if (retval == -1) {
 		free(fb->buf);
 		fb->buf = NULL;
+		return retval;
+	}
+
+	/*
+	 * Remember decompressed files included with .so,
+	 * such that other pages can include them without
+	 * decompressing them again.
+	 */
+
+	if (curp->gzip && isso && S_ISREG(st.st_mode) &&
+	    curp->socachesz + fb->sz <= SOCACHE_MAX) {
+		sf = mandoc_malloc(sizeof(*sf));
+		sf->buf = fb->buf;
+		sf->sz = fb->sz;
+		sf->dev = st.st_dev;
+		sf->ino = st.st_ino;
+		sf->size = st.st_size;
+		sf->mtime = st.st_mtime;
+		sf->next = curp->socache;
+		curp->socache = sf;
+		curp->socachesz += fb->sz;
+		*how = RBUF_CACHE;
 	}
 	return retval;
 }
@@ -543,6 +678,20 @@ mparse_end(struct mparse *curp)
 	roff_endparse(curp->roff);
 }
 
+static void
+hash_buf(struct mparse *curp, const struct buf *fb)
+{
+	const unsigned char	*cp, *end;
+	uint32_t		 hash;
+
+	hash = 2166136261U;
+	end = (const unsigned char *)fb->buf + fb->sz;
+	for (cp = (const unsigned char *)fb->buf; cp < end; cp++)
+		hash = (hash ^ *cp) * 16777619U;
+	curp->hash = hash;
+	curp->hashed = 1;
+}
+
 /*
  * Read the whole file into memory and call the parsers.
  * Called recursively when an .so request is encountered.
@@ -552,12 +701,13 @@ mparse_readfd(struct mparse *curp, int fd, const char *filename)
 {
 	static int	 recursion_depth;
 
+	struct timespec	 start, end;
 	struct buf	 blk;
 	struct buf	*save_primary;
 	const char	*save_filename, *cp;
 	size_t		 offset;
-	int		 save_filenc, save_lineno;
-	int		 with_mmap;
+	int		 rc, save_filenc, save_lineno;
+	enum rbuf	 how;
 
 	if (recursion_depth > 64) {
 		mandoc_msg(MANDOCERR_ROFFLOOP, curp->line, 0, NULL);
@@ -569,8 +719,18 @@ mparse_readfd(struct mparse *curp, int fd, const char *filename)
         else
                 curp->man->filesec = '\0';
 
-	if (read_whole_file(curp, fd, &blk, &with_mmap) == -1)
+	if (curp->options & MPARSE_STATS)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = read_whole_file(curp, fd, &blk, recursion_depth > 0, &how);
+	if (curp->options & MPARSE_STATS) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		curp->readtime += (end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+	if (rc == -1)
 		return;
+	if (recursion_depth == 0 && curp->options & MPARSE_HASH)
+		hash_buf(curp, &blk);
 
 	/*
 	 * Save some properties of the parent file.
@@ -605,10 +765,16 @@ mparse_readfd(struct mparse *curp, int fd, const char *filename)
 	 * Clean up and restore saved parent properties.
 	 */
 
-	if (with_mmap)
+	switch (how) {
+	case RBUF_MMAP:
 		munmap(blk.buf, blk.sz);
-	else
-		free(blk.buf);
+		break;
+	case RBUF_POOL:
+		pool_put(curp, blk.buf, blk.sz);
+		break;
+	case RBUF_CACHE:
+		break;
+	}
 
 	curp->primary = save_primary;
 	curp->filenc = save_filenc;
@@ -690,12 +856,56 @@ mparse_reset(struct mparse *curp)
 	free_buf_list(curp->secondary);
 	curp->secondary = NULL;
 	curp->gzip = 0;
+	curp->sofiles = 0;
+	curp->hashed = 0;
 	tag_alloc();
 }
 
+/*
+ * Return the total time spent reading and decompressing input files
+ * since mparse_alloc(), in seconds.  Only measured with MPARSE_STATS.
+ */
+double
+mparse_readtime(const struct mparse *curp)
+{
+	return curp->readtime;
+}
+
+/*
+ * Return the number of .so requests followed since mparse_alloc()
+ * or mparse_reset(), including those naming files that do not exist.
+ */
+int
+mparse_sofiles(const struct mparse *curp)
+{
+	return curp->sofiles;
+}
+
+/*
+ * With MPARSE_HASH, provide the 32-bit FNV-1a hash of the content
+ * of the top level input file since mparse_reset(), after
+ * decompression.  Return -1 if no such file was read.
+ */
+int
+mparse_hash(const struct mparse *curp, unsigned int *hash)
+{
+	if (curp->hashed == 0)
+		return -1;
+	*hash = curp->hash;
+	return 0;
+}
+
 void
 mparse_free(struct mparse *curp)
 {
+	struct sofile	*sf;
+
+	while ((sf = curp->socache) != NULL) {
+		curp->socache = sf->next;
+		free(sf->buf);
+		free(sf);
+	}
+	free_buf_list(curp->pool);
 	tag_free();
 	roffhash_free(curp->man->mdocmac);
 	roffhash_free(curp->man->manmac);
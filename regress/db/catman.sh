@@ -0,0 +1,38 @@
+# $OpenBSD$
+#
+# With -u, catman(8) only formats manuals that are missing
+# from the destination directory or older than their sources.
+
+. db/setup.sh
+
+[ -x "$top/catman" ] || exit 77
+
+# Replace formatted manuals with a marker dated after the sources.
+mark() {
+	for f in "$@"; do
+		echo stale > "cat/$f"
+		touch -t 202101010000 "cat/$f"
+	done
+}
+
+# Show which formatted manuals still contain the marker.
+show() {
+	echo "\$ grep -lr stale cat"
+	grep -lr stale cat | sort
+}
+
+mktree tree
+mkdir cat
+run catman -I os=OpenBSD tree cat
+run ls cat/man1 cat/man3 cat/man7
+mark man1/cat.1 man1/ls.1 man3/printf.3 man7/intro.7
+run catman -I os=OpenBSD -u tree cat
+show
+run touch -t 202201010000 tree/man1/ls.1
+run rm cat/man3/printf.3
+run catman -I os=OpenBSD -u -j 2 tree cat
+show
+run ls cat/man3
+run catman -I os=OpenBSD tree cat
+show
+run find cat -name '.catman.*'
@@ -0,0 +1,27 @@
+# $OpenBSD$
+#
+# Parsing in worker processes must not change the database
+# nor the formatted manuals.
+
+. db/setup.sh
+
+mktree tree
+run makewhatis -j 1 tree
+mv tree/mandoc.db one.db
+run makewhatis -j 2 tree
+run cmp one.db tree/mandoc.db
+rm tree/mandoc.db
+run makewhatis -j 4 tree
+run cmp one.db tree/mandoc.db
+rm tree/mandoc.db
+run makewhatis -j 4 -i tree
+mv tree/mandoc.db four.db
+run makewhatis -j 1 -i tree
+run cmp four.db tree/mandoc.db
+rm tree/mandoc.db
+mkdir cat1 cat4
+run makewhatis -j 1 -c cat1 tree
+rm tree/mandoc.db
+run makewhatis -j 4 -c cat4 tree
+run diff -r cat1 cat4
+run ls cat4/man1
@@ -0,0 +1,36 @@
+# $OpenBSD$
+#
+# Exact, prefix, substring and regular expression searches
+# and ranked results, both without and with the trigram index.
+
+. db/setup.sh
+
+mktree tree
+
+queries() {
+	run whatis -M tree cat ls strlcat list
+	run whatis -M tree nonexistent
+	run apropos -M tree Nm=printf
+	run apropos -M tree Nm~^cat
+	run apropos -M tree Nm~^str
+	run apropos -M tree Xr~^cat
+	run apropos -M tree Fn~^strl
+	run apropos -M tree cat
+	run apropos -M tree concat
+	run apropos -M tree -s 1 cat
+	run apropos -M tree Nd~'dir.*cont'
+	run apropos -M tree Nm~'print?f$'
+	run apropos -M tree Nm~'^(ls|cat)$'
+	run apropos -M tree -- -i Nm~^CAT
+	run apropos -M tree -- cat -a Xr=ls
+	run apropos -M tree -- cat -o printf
+	run apropos -M tree -n 2 cat
+	run apropos -M tree -n 3 print
+}
+
+run makewhatis tree
+queries > plain
+cat plain
+run makewhatis -i tree
+queries > trigram
+run cmp plain trigram
@@ -0,0 +1,49 @@
+# $OpenBSD$
+#
+# Common setup for the database tests, sourced by each of them.
+# Usage: sh db/test.sh workdir
+# Runs from the regress directory.  Creates the working directory,
+# changes into it, and defines commands running the programs just
+# built, independent of the names they will be installed under.
+
+set -e
+top=$(cd .. && pwd)
+dbdir=$(pwd)/db
+tree=$dbdir/tree
+rm -rf "$1"
+mkdir -p "$1/bin"
+cd "$1"
+ln -s "$top/mandoc" bin/mandocdb
+PATH=$(pwd)/bin:$top:$PATH
+LC_ALL=C
+export LC_ALL PATH
+unset MANPATH MANSECT MACHINE
+
+# Copy the test manuals to the given directory, without .in suffixes.
+# Date them back such that makewhatis(8) trusts their mtimes.
+mktree() {
+	for f in "$tree"/man*/*.in; do
+		d=$1/${f#$tree/}
+		mkdir -p "${d%/*}"
+		cp "$f" "${d%.in}"
+		touch -t 202001010000 "${d%.in}"
+	done
+}
+
+# Show a command, then run it, showing its output and exit status.
+run() {
+	echo "\$ $*"
+	if "$@" 2>&1; then :; else echo "exit status $?"; fi
+}
+
+makewhatis() {
+	mandocdb "$@"
+}
+
+apropos() {
+	"$top/mandoc" -C /dev/null -k "$@"
+}
+
+whatis() {
+	"$top/mandoc" -C /dev/null -f "$@"
+}
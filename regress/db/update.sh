@@ -0,0 +1,42 @@
+# $OpenBSD$
+#
+# Updating an existing database after touching, changing,
+# adding and deleting manuals must give the same search results
+# as building it from scratch, reusing the unchanged manuals.
+
+. db/setup.sh
+
+# Build, then show how many manuals were parsed and kept.
+stats() {
+	echo "\$ makewhatis $*"
+	makewhatis -S "$@" | grep -E '^(pages|kept)	'
+}
+
+queries() {
+	run apropos -M "$1" Nm~.
+	run apropos -M "$1" Nd~contents
+	run apropos -M "$1" Xr=cat
+	run whatis -M "$1" list
+}
+
+mktree tree
+stats tree
+stats tree
+run touch tree/man1/cat.1 tree/man3/printf.3
+stats tree
+sed 's/list directory contents/list the contents of directories/' \
+    tree/man1/ls.1 > ls.1
+cat ls.1 > tree/man1/ls.1
+touch -t 202001010000 tree/man1/ls.1
+run rm tree/man1/catalog.1
+sed 's/concatenate and print files/cut out fields/; s/cat/cut/g; s/CAT/CUT/' \
+    tree/man1/cat.1 > tree/man1/cut.1
+stats tree
+queries tree > updated
+cat updated
+stats tree
+mkdir fresh
+cp -Rp tree/man1 tree/man3 tree/man7 fresh
+stats fresh
+queries fresh | sed 's/fresh/tree/' > fresh.out
+run diff updated fresh.out
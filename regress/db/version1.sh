@@ -0,0 +1,35 @@
+# $OpenBSD$
+#
+# Searching a database in the old format version 1, which lacks
+# the names, trigram and cross reference indexes, the shared section
+# lists and the fingerprints, must give the same results as searching
+# one in the current format.  Updating it must rebuild it.
+
+. db/setup.sh
+
+queries() {
+	run whatis -M "$1" cat ls strlcat list
+	run apropos -M "$1" Nm=printf
+	run apropos -M "$1" Nm~^cat
+	run apropos -M "$1" Xr~^cat
+	run apropos -M "$1" cat
+	run apropos -M "$1" Nd~'dir.*cont'
+	run apropos -M "$1" -s 3 -O Fn Nm~.
+	run apropos -M "$1" -n 2 cat
+}
+
+mktree tree
+cp "$dbdir/version1.db" tree/mandoc.db
+queries tree > old
+cat old
+run apropos -M tree -O refby Nm=cat
+mkdir new
+cp -Rp tree/man1 tree/man3 tree/man7 new
+run makewhatis new
+queries new | sed 's/new/tree/' > new.out
+run diff old new.out
+echo "\$ makewhatis tree"
+makewhatis -S tree | grep -E '^(pages|kept)	'
+queries tree > updated
+run diff old updated
+run apropos -M tree -O refby Nm=cat
@@ -120,17 +120,17 @@ sub fail ($$) {
 
 my $onlytest = shift // '';
 for (@ARGV) {
-	/^(all|ascii|tag|man|utf8|html|markdown|lint|clean|verbose)$/
+	/^(all|ascii|tag|man|utf8|html|markdown|lint|db|clean|verbose)$/
 	    or usage "$_: invalid modifier";
 	$targets{$_} = 1;
 }
 $targets{all} = 1
     unless $targets{ascii} || $targets{tag} || $targets{man} ||
       $targets{utf8} || $targets{html} || $targets{markdown} ||
-      $targets{lint} || $targets{clean};
+      $targets{lint} || $targets{db} || $targets{clean};
 $targets{ascii} = $targets{tag} = $targets{man} = $targets{utf8} =
-    $targets{html} = $targets{markdown} = $targets{lint} = 1
-    if $targets{all};
+    $targets{html} = $targets{markdown} = $targets{lint} =
+    $targets{db} = 1 if $targets{all};
 
 
 # --- parse Makefiles --------------------------------------------------
@@ -245,6 +245,19 @@ foreach my $module (qw(roff char mdoc man tbl eqn)) {
 	}
 }
 
+# The database tests are shell scripts rather than input files.
+my @db_tests;
+{
+	my %dbvars;
+	parse_makefile "db/Makefile", \%dbvars;
+	push @db_tests, "db/$_" for split ' ', $dbvars{DB_TARGETS};
+	delete $dbvars{DB_TARGETS};
+	if (keys %dbvars) {
+		my @vars = keys %dbvars;
+		die "unknown var(s) @vars in module db";
+	}
+}
+
 # --- run targets ------------------------------------------------------
 
 my $count_total = 0;
@@ -435,6 +448,40 @@ if ($targets{lint}) {
 	print " $count_lint tests run.\n";
 }
 
+my $count_db = 0;
+if ($targets{db}) {
+	print "Running db tests ";
+	print "...\n" if $targets{verbose};
+}
+for my $test (@db_tests) {
+	my $o = "$test.mandoc_db";
+	my $w = "$test.out_db";
+	my $d = "$test.work";
+	if ($targets{db} && $test =~ /^$onlytest/) {
+		my $rc = sysout $o, 'sh', "$test.sh", $d;
+		if ($rc == 77) {
+			print "$test: skipped\n" if $targets{verbose};
+			unlink $o;
+		} else {
+			$count_db++;
+			$count_total++;
+			$rc and fail $test, 'db:sh';
+			system @diff, $w, $o
+			    and fail $test, 'db:diff';
+			print "." unless $targets{verbose};
+		}
+	}
+	if ($targets{clean}) {
+		print "rm -r $o $d\n" if $targets{verbose};
+		$count_rm += unlink $o;
+		system qw(rm -rf), $d;
+	}
+}
+if ($targets{db}) {
+	print "Number of db tests:" if $targets{verbose};
+	print " $count_db tests run.\n";
+}
+
 # --- final report -----------------------------------------------------
 
 if (@failures) {
@@ -456,6 +503,7 @@ if ($count_total == 1) {
 	print " $count_html html" if $count_html;
 	print " $count_markdown markdown" if $count_markdown;
 	print " $count_lint lint" if $count_lint;
+	print " $count_db db" if $count_db;
 	print "\n";
 } else {
 	print "No tests were run.\n";
@@ -0,0 +1,27 @@
+#include <pthread.h>
+#include <stdio.h>
+
+static void *
+run(void *arg)
+{
+	*(int *)arg = 0;
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t	 thread;
+	int		 irc, result;
+
+	result = 1;
+	if ((irc = pthread_create(&thread, NULL, run, &result)) != 0) {
+		fprintf(stderr, "pthread_create: error %d\n", irc);
+		return 1;
+	}
+	if ((irc = pthread_join(thread, NULL)) != 0) {
+		fprintf(stderr, "pthread_join: error %d\n", irc);
+		return 1;
+	}
+	return result;
+}
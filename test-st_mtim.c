@@ -0,0 +1,12 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+int
+main(void)
+{
+	struct stat	 sb;
+
+	if (stat(".", &sb) == -1)
+		return 1;
+	return sb.st_mtim.tv_nsec < 0;
+}